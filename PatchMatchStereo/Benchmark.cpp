@@ -0,0 +1,389 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include <stack>
+#include <string>
+#include <fstream>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <omp.h>
+#include "Utilities.h"
+#include "Benchmark.h"
+#include "DatasetPack.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#endif
+
+
+extern int nrows, ncols;
+
+#define BENCHMARK_DEFAULT_REPORT		"benchmark_report.json"
+#define BENCHMARK_TIME_TOLERANCE		0.10f		// relative slowdown reported as a regression
+#define BENCHMARK_ERROR_TOLERANCE		0.002f		// increase of a bad pixel rate reported as a regression
+
+static const char *pipelineNames[] = { "wta", "patchmatch", "laplacian", "ransac" };
+static const int npipelines = sizeof(pipelineNames) / sizeof(pipelineNames[0]);
+
+
+static void ResetPeakMemory()
+{
+#ifdef __linux__
+	// Writing 5 resets VmHWM to the current RSS (Linux 4.0+).
+	FILE *f = fopen("/proc/self/clear_refs", "w");
+	if (f != NULL) {
+		fputs("5", f);
+		fclose(f);
+	}
+#endif
+}
+
+static double PeakMemoryMB()
+{
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+		return pmc.PeakWorkingSetSize / (1024.0 * 1024.0);
+	}
+	return 0;
+#elif defined(__linux__)
+	double kb = 0;
+	char line[256];
+	FILE *f = fopen("/proc/self/status", "r");
+	if (f == NULL) {
+		return 0;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "VmHWM: %lf", &kb) == 1) {
+			break;
+		}
+	}
+	fclose(f);
+	return kb / 1024.0;
+#else
+	return 0;
+#endif
+}
+
+std::vector<std::string> SplitList(const std::string& list)
+{
+	std::vector<std::string> items;
+	size_t start = 0;
+	while (start <= list.size()) {
+		size_t end = list.find(',', start);
+		if (end == std::string::npos) {
+			end = list.size();
+		}
+		if (end > start) {
+			items.push_back(list.substr(start, end - start));
+		}
+		start = end + 1;
+	}
+	return items;
+}
+
+static std::string DatasetName(int id)
+{
+	return folders[id].substr(0, folders[id].length() - 1);
+}
+
+std::vector<int> ParseDatasetList(const std::string& list)
+{
+	std::vector<int> ids;
+	std::vector<std::string> names = SplitList(list);
+	for (int k = 0; k < names.size(); k++) {
+		bool found = false;
+		for (int id = 0; id < nfolders; id++) {
+			if (names[k] == "all" || names[k] == DatasetName(id)) {
+				ids.push_back(id);
+				found = true;
+			}
+		}
+		if (!found) {
+			printf("unknown dataset %s\n", names[k].c_str());
+		}
+	}
+	return ids;
+}
+
+bool IsPipelineName(const std::string& name)
+{
+	return std::find(pipelineNames, pipelineNames + npipelines, name) != pipelineNames + npipelines;
+}
+
+VECBITMAP<float> RunPipeline(const std::string& pipeline, cv::Mat& imL, cv::Mat& imR)
+{
+	if (pipeline == "wta") {
+		cv::Mat dispL, dispR;
+		Timer::tic("LocalSearch");
+		LocalSearch(imL, imR, ndisps, dispL, dispR);
+		Timer::toc();
+		VECBITMAP<float> disp(nrows, ncols);
+		for (int y = 0; y < nrows; y++) {
+			for (int x = 0; x < ncols; x++) {
+				disp[y][x] = dispL.at<float>(y, x);
+			}
+		}
+		return disp;
+	}
+	if (pipeline == "patchmatch") {
+		return RunPatchMatchStereo(imL, imR, ndisps);
+	}
+	if (pipeline == "laplacian") {
+		return RunLaplacianStereo(imL, imR, ndisps);
+	}
+	return RunRansacPlaneFitting(imL, imR, ndisps);
+}
+
+std::string BenchmarkRun::ToJson() const
+{
+	char buf[512];
+	sprintf(buf, "{\"pipeline\": \"%s\", \"dataset\": \"%s\", \"plan\": \"%s\", \"threads\": %d, \"total_s\": %.4f, \"peak_rss_mb\": %.1f, "
+		"\"tracked_peak_mb\": %.1f, \"estimated_peak_mb\": %.1f, \"stages\": {",
+		pipeline.c_str(), dataset.c_str(), plan.c_str(), threads, totalSeconds, peakRssMB, trackedPeakMB, estimatedPeakMB);
+	std::string json = buf;
+	for (int i = 0; i < stages.size(); i++) {
+		sprintf(buf, "%s\"%s\": %.4f", i ? ", " : "", stages[i].first.c_str(), stages[i].second);
+		json += buf;
+	}
+	json += "}, \"stage_peak_mb\": {";
+	for (int i = 0; i < stagePeaks.size(); i++) {
+		sprintf(buf, "%s\"%s\": %.1f", i ? ", " : "", stagePeaks[i].first.c_str(), stagePeaks[i].second);
+		json += buf;
+	}
+	json += "}, \"eval\": " + eval.ToJson() + "}";
+	return json;
+}
+
+
+// The report is written one run per line, so a baseline can be read back line by line
+// by looking up the keys below.
+static bool FindString(const std::string& line, const char *key, std::string& value)
+{
+	std::string pattern = std::string("\"") + key + "\": \"";
+	size_t pos = line.find(pattern);
+	if (pos == std::string::npos) {
+		return false;
+	}
+	pos += pattern.length();
+	value = line.substr(pos, line.find('"', pos) - pos);
+	return true;
+}
+
+static bool FindNumber(const std::string& line, const char *key, double& value)
+{
+	std::string pattern = std::string("\"") + key + "\": ";
+	size_t pos = line.find(pattern);
+	if (pos == std::string::npos) {
+		return false;
+	}
+	value = atof(line.c_str() + pos + pattern.length());
+	return true;
+}
+
+static std::vector<float> FindArray(const std::string& line, const char *key)
+{
+	std::vector<float> values;
+	std::string pattern = std::string("\"") + key + "\": [";
+	size_t pos = line.find(pattern);
+	if (pos == std::string::npos) {
+		return values;
+	}
+	const char *p = line.c_str() + pos + pattern.length();
+	while (*p && *p != ']') {
+		char *end;
+		float v = strtod(p, &end);
+		if (end == p) {
+			break;
+		}
+		values.push_back(v);
+		p = end;
+		while (*p == ',' || *p == ' ') {
+			p++;
+		}
+	}
+	return values;
+}
+
+static int CompareWithBaseline(std::vector<BenchmarkRun>& runs, const std::string& baselinePath, float timeTolerance)
+{
+	std::ifstream fin(baselinePath.c_str());
+	if (!fin) {
+		printf("cannot open baseline %s\n", baselinePath.c_str());
+		return 1;
+	}
+
+	int nregressions = 0;
+	printf("\n%-12s %-12s %10s %10s %8s %10s %10s   %s\n", "pipeline", "dataset", "base_s", "now_s", "ratio", "base_mb", "now_mb", "bad nonocc (base -> now)");
+	std::string line;
+	while (std::getline(fin, line)) {
+		std::string pipeline, dataset;
+		double baseTime, baseRss = 0;
+		if (!FindString(line, "pipeline", pipeline) || !FindString(line, "dataset", dataset) || !FindNumber(line, "total_s", baseTime)) {
+			continue;
+		}
+		FindNumber(line, "peak_rss_mb", baseRss);
+		std::vector<float> baseBad = FindArray(line, "nonocc");
+
+		for (int i = 0; i < runs.size(); i++) {
+			BenchmarkRun& run = runs[i];
+			if (run.pipeline != pipeline || run.dataset != dataset) {
+				continue;
+			}
+			bool slower = run.totalSeconds > baseTime * (1 + timeTolerance);
+			bool worse = false;
+			std::string rates;
+			for (int k = 0; k < baseBad.size() && k < run.eval.badNonocc.size(); k++) {
+				char buf[64];
+				sprintf(buf, "%s%.2f%% -> %.2f%%", k ? ", " : "", baseBad[k] * 100.f, run.eval.badNonocc[k] * 100.f);
+				rates += buf;
+				worse |= (run.eval.badNonocc[k] > baseBad[k] + BENCHMARK_ERROR_TOLERANCE);
+			}
+			printf("%-12s %-12s %10.3f %10.3f %8.2f %10.1f %10.1f   %s%s%s\n", pipeline.c_str(), dataset.c_str(),
+				baseTime, run.totalSeconds, run.totalSeconds / std::max(baseTime, 1e-6), baseRss, run.peakRssMB, rates.c_str(),
+				slower ? "  SLOWER" : "", worse ? "  WORSE" : "");
+			nregressions += (slower || worse);
+		}
+	}
+	printf("%d regression(s) against %s\n", nregressions, baselinePath.c_str());
+	return nregressions > 0;
+}
+
+int RunBenchmark(int argc, char **argv)
+{
+	std::vector<std::string> pipelines(pipelineNames, pipelineNames + npipelines);
+	std::vector<int> datasets;
+	std::string reportPath = BENCHMARK_DEFAULT_REPORT, baselinePath;
+	float timeTolerance = BENCHMARK_TIME_TOLERANCE;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (i + 1 >= argc) {
+			printf("missing value for %s\n", arg.c_str());
+			return 1;
+		}
+		std::string value = argv[++i];
+		if (arg == "--pipelines") {
+			pipelines = SplitList(value);
+		}
+		else if (arg == "--datasets") {
+			std::vector<int> ids = ParseDatasetList(value);
+			datasets.insert(datasets.end(), ids.begin(), ids.end());
+		}
+		else if (arg == "--threads") {
+			omp_set_num_threads(atoi(value.c_str()));
+		}
+		else if (arg == "--out") {
+			reportPath = value;
+		}
+		else if (arg == "--baseline") {
+			baselinePath = value;
+		}
+		else if (arg == "--tolerance") {
+			timeTolerance = atof(value.c_str());
+		}
+		else if (arg == "--mem-budget") {
+			g_memoryBudgetBytes = (long long)(atof(value.c_str()) * 1048576.0);
+		}
+		else {
+			printf("unknown option %s\n", arg.c_str());
+			return 1;
+		}
+	}
+	if (datasets.empty()) {
+		for (int id = 0; id < nfolders; id++) {
+			datasets.push_back(id);
+		}
+	}
+	for (int k = 0; k < pipelines.size(); k++) {
+		if (!IsPipelineName(pipelines[k])) {
+			printf("unknown pipeline %s\n", pipelines[k].c_str());
+			return 1;
+		}
+	}
+
+	g_batchMode = true;
+	std::vector<float> thresholds;
+	thresholds.push_back(0.5f);
+	thresholds.push_back(1.f);
+	thresholds.push_back(2.f);
+
+	// The next dataset is read while the pipelines run on the current one.
+	std::vector<BenchmarkRun> runs;
+	DatasetPrefetcher prefetcher(datasets);
+	StereoDataset ds;
+	while (prefetcher.Next(ds)) {
+		SelectDataset(ds.folderId);
+		SetEvaluationDataset(ds);
+		cv::Mat imL = ds.L, imR = ds.R;
+		nrows = imL.rows;
+		ncols = imL.cols;
+
+		for (int p = 0; p < pipelines.size(); p++) {
+			printf("\n==== %s on %s ====\n", pipelines[p].c_str(), DatasetName(folder_id).c_str());
+			if (!PlanStereo(pipelines[p], nrows, ncols, ndisps)) {
+				continue;
+			}
+			ResetPeakMemory();
+			MemoryTracker::ResetPeak();
+			Timer::StartRecording();
+			double start = omp_get_wtime();
+			VECBITMAP<float> disp = RunPipeline(pipelines[p], imL, imR);
+			double elapsed = omp_get_wtime() - start;
+			std::vector<std::pair<std::string, double> > stages = Timer::StopRecording();
+
+			BenchmarkRun run;
+			run.pipeline = pipelines[p];
+			run.dataset = DatasetName(folder_id);
+			run.threads = omp_get_max_threads();
+			run.totalSeconds = elapsed;
+			run.peakRssMB = PeakMemoryMB();
+			run.trackedPeakMB = MemoryTracker::Peak() / 1048576.0;
+			run.estimatedPeakMB = EstimatePeakBytes(pipelines[p], nrows, ncols, ndisps, g_plan) / 1048576.0;
+			run.plan = g_plan.Describe();
+			std::vector<std::pair<std::string, double> > peaks = Timer::RecordedPeaks();
+			for (int i = 0; i < stages.size(); i++) {
+				int k = 0;
+				while (k < run.stages.size() && run.stages[k].first != stages[i].first) {
+					k++;
+				}
+				if (k == run.stages.size()) {
+					run.stages.push_back(std::make_pair(stages[i].first, 0.0));
+					run.stagePeaks.push_back(std::make_pair(stages[i].first, 0.0));
+				}
+				run.stages[k].second += stages[i].second;
+				run.stagePeaks[k].second = std::max(run.stagePeaks[k].second, peaks[i].second);
+			}
+			run.eval = EvaluateDisparityHeadless(disp, thresholds);
+			runs.push_back(run);
+			printf("%s on %s: %.2fs, peak %.0f MB (tracked %.0f MB, predicted %.0f MB), bad nonocc %.2f%% @1px\n",
+				run.pipeline.c_str(), run.dataset.c_str(), run.totalSeconds, run.peakRssMB, run.trackedPeakMB, run.estimatedPeakMB,
+				run.eval.Valid() ? run.eval.badNonocc[1] * 100.f : NAN);
+		}
+	}
+
+	FILE *fid = fopen(reportPath.c_str(), "w");
+	if (fid == NULL) {
+		printf("cannot open %s for writing.\n", reportPath.c_str());
+		return 1;
+	}
+	fprintf(fid, "{\"threads\": %d, \"runs\": [\n", omp_get_max_threads());
+	for (int i = 0; i < runs.size(); i++) {
+		fprintf(fid, "%s%s\n", runs[i].ToJson().c_str(), i + 1 < runs.size() ? "," : "");
+	}
+	fprintf(fid, "]}\n");
+	fclose(fid);
+	printf("\nwrote %d runs to %s\n", (int)runs.size(), reportPath.c_str());
+
+	if (!baselinePath.empty()) {
+		return CompareWithBaseline(runs, baselinePath, timeTolerance);
+	}
+	return 0;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+
+
+// One pipeline run on one dataset, as recorded by RunBenchmark.
+struct BenchmarkRun {
+	std::string pipeline, dataset;
+	std::string plan;											// StereoPlan::Describe of the configuration it ran with
+	int threads;
+	double totalSeconds;
+	double peakRssMB;											// process peak, reset before the run where the OS allows it
+	double trackedPeakMB, estimatedPeakMB;						// peak of the tracked buffers, and as predicted by EstimatePeakBytes
+	std::vector<std::pair<std::string, double> > stages;		// wall time per Timer stage, summed over repeats
+	std::vector<std::pair<std::string, double> > stagePeaks;	// peak MB of the tracked buffers per Timer stage, max over repeats
+	EvaluationResult eval;
+	std::string ToJson() const;
+};
+
+
+// Runs the selected pipelines on the selected datasets headless and writes a JSON report.
+// With --baseline, compares against an earlier report and returns 1 on a regression.
+// With --mem-budget, every run uses the fastest configuration that fits the budget (see PlanStereo),
+// and runs that do not fit in any configuration are skipped.
+//
+// PatchMatchStereo --benchmark [--pipelines wta,patchmatch,laplacian,ransac] [--datasets all|cones,teddy,...]
+//                  [--threads n] [--out report.json] [--baseline baseline.json] [--tolerance 0.1]
+//                  [--mem-budget MB]
+int RunBenchmark(int argc, char **argv);
+
+
+// Times single kernels on synthetic inputs over a range of image sizes and disparity counts,
+// reporting median and percentile times and throughput. Variants of the same kernel are
+// printed side by side with their speedup over the first one.
+//
+// PatchMatchStereo --microbench [--kernels name,...] [--variants name,...] [--sizes 120x160,240x320]
+//                  [--ndisps 16,64] [--warmup n] [--reps n] [--threads n] [--pin core] [--out results.csv]
+int RunMicroBenchmark(int argc, char **argv);
+
+// One of "wta", "patchmatch", "laplacian", "ransac".
+bool IsPipelineName(const std::string& name);
+// Runs a pipeline on a pair of size nrows x ncols with ndisps disparities and returns the
+// disparities of the left view. Set g_batchMode to skip the windows and result files.
+VECBITMAP<float> RunPipeline(const std::string& pipeline, cv::Mat& imL, cv::Mat& imR);
+
+// Splits a comma separated option value, dropping empty items.
+std::vector<std::string> SplitList(const std::string& list);
+// Dataset ids of a comma separated list of folder names, "all" for every dataset.
+std::vector<int> ParseDatasetList(const std::string& list);
@@ -0,0 +1,256 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string>
+
+#include <omp.h>
+#include "BinaryFile.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+
+#define VBM_CHECKSUM_CHUNK		(1 << 20)
+#define VBM_FNV_OFFSET			14695981039346656037ull
+#define VBM_FNV_PRIME			1099511628211ull
+
+static unsigned long long HashChunk(const unsigned char *p, size_t bytes)
+{
+	// FNV-1a over 64-bit words, the tail byte by byte
+	unsigned long long h = VBM_FNV_OFFSET;
+	size_t i = 0;
+	for (; i + 8 <= bytes; i += 8) {
+		unsigned long long word;
+		memcpy(&word, p + i, 8);
+		h = (h ^ word) * VBM_FNV_PRIME;
+	}
+	for (; i < bytes; i++) {
+		h = (h ^ p[i]) * VBM_FNV_PRIME;
+	}
+	return h;
+}
+
+unsigned long long VbmChecksum(const void *data, size_t bytes)
+{
+	// Chunks are hashed in parallel and their hashes combined in order,
+	// so the result does not depend on the number of threads.
+	const unsigned char *p = (const unsigned char *)data;
+	long long nchunks = (bytes + VBM_CHECKSUM_CHUNK - 1) / VBM_CHECKSUM_CHUNK;
+	unsigned long long *chunkHashes = new unsigned long long[nchunks + 1];
+	#pragma omp parallel for
+	for (long long i = 0; i < nchunks; i++) {
+		size_t start = (size_t)i * VBM_CHECKSUM_CHUNK;
+		chunkHashes[i] = HashChunk(p + start, std::min((size_t)VBM_CHECKSUM_CHUNK, bytes - start));
+	}
+	chunkHashes[nchunks] = bytes;
+	unsigned long long h = HashChunk((const unsigned char *)chunkHashes, (nchunks + 1) * sizeof(unsigned long long));
+	delete[] chunkHashes;
+	return h;
+}
+
+const char *VbmElemTypeName(unsigned int type)
+{
+	static const char *names[] = { "unknown", "uint8", "bool", "int32", "int64", "float32", "float64", "Plane" };
+	return type < sizeof(names) / sizeof(names[0]) ? names[type] : "invalid";
+}
+
+static long long FileSize(FILE *fid)
+{
+#ifdef _WIN32
+	_fseeki64(fid, 0, SEEK_END);
+	long long size = _ftelli64(fid);
+	_fseeki64(fid, 0, SEEK_SET);
+#else
+	fseeko(fid, 0, SEEK_END);
+	long long size = ftello(fid);
+	fseeko(fid, 0, SEEK_SET);
+#endif
+	return size;
+}
+
+static bool SeekTo(FILE *fid, unsigned long long offset)
+{
+#ifdef _WIN32
+	return _fseeki64(fid, (long long)offset, SEEK_SET) == 0;
+#else
+	return fseeko(fid, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+static bool CheckHeader(VbmHeader& header, const std::string& filename, unsigned int elemType, unsigned int elemSize, long long fileSize)
+{
+	const char *name = filename.c_str();
+	if (memcmp(header.magic, VBM_MAGIC, sizeof(header.magic)) != 0) {
+		printf("%s is not a VECBITMAP file (raw dump of an older build?).\n", name);
+		return false;
+	}
+	if (header.endianTag != VBM_ENDIAN_TAG) {
+		printf("%s was written on a machine of the other byte order.\n", name);
+		return false;
+	}
+	if (header.version > VBM_VERSION) {
+		printf("%s has format version %u, this build reads up to %d.\n", name, header.version, VBM_VERSION);
+		return false;
+	}
+	if (header.elemSize != elemSize || (elemType != VBM_UNKNOWN && header.elemType != elemType)) {
+		printf("%s holds %s elements of %u bytes, expected %s of %u bytes.\n", name,
+			VbmElemTypeName(header.elemType), header.elemSize, VbmElemTypeName(elemType), elemSize);
+		return false;
+	}
+	if (header.h < 0 || header.w < 0 || header.n < 0
+		|| header.payloadBytes != (unsigned long long)header.h * header.w * header.n * header.elemSize) {
+		printf("%s has an inconsistent size (%d x %d x %d).\n", name, header.h, header.w, header.n);
+		return false;
+	}
+	if (header.payloadOffset < VBM_HEADER_SIZE || header.payloadOffset % VBM_HEADER_SIZE != 0
+		|| header.payloadOffset + header.payloadBytes > (unsigned long long)fileSize) {
+		printf("%s is truncated or corrupt.\n", name);
+		return false;
+	}
+	header.params[VBM_PARAMS_SIZE - 1] = '\0';
+	return true;
+}
+
+bool VbmWriteFile(const std::string& filename, VbmHeader& header, const void *data)
+{
+	memcpy(header.magic, VBM_MAGIC, sizeof(header.magic));
+	header.version = VBM_VERSION;
+	header.endianTag = VBM_ENDIAN_TAG;
+	header.reserved = 0;
+	header.payloadOffset = VBM_HEADER_SIZE;
+	header.payloadBytes = (unsigned long long)header.h * header.w * header.n * header.elemSize;
+	header.checksum = VbmChecksum(data, header.payloadBytes);
+
+	FILE *fid = fopen(filename.c_str(), "wb");
+	if (fid == NULL) {
+		printf("cannot open %s for writing.\n", filename.c_str());
+		return false;
+	}
+	char block[VBM_HEADER_SIZE];
+	memset(block, 0, sizeof(block));
+	memcpy(block, &header, sizeof(header));
+	bool ok = fwrite(block, 1, VBM_HEADER_SIZE, fid) == VBM_HEADER_SIZE
+		&& fwrite(data, 1, header.payloadBytes, fid) == header.payloadBytes;
+	ok = (fclose(fid) == 0) && ok;
+	if (!ok) {
+		printf("failed writing %s.\n", filename.c_str());
+	}
+	return ok;
+}
+
+bool VbmReadHeader(FILE *fid, const std::string& filename, VbmHeader& header, unsigned int elemType, unsigned int elemSize)
+{
+	long long fileSize = FileSize(fid);
+	if (fread(&header, sizeof(header), 1, fid) != 1) {
+		printf("%s is too short to be a VECBITMAP file.\n", filename.c_str());
+		return false;
+	}
+	return CheckHeader(header, filename, elemType, elemSize, fileSize);
+}
+
+bool VbmReadPayload(FILE *fid, const std::string& filename, const VbmHeader& header, void *data)
+{
+	if (!SeekTo(fid, header.payloadOffset) || fread(data, 1, header.payloadBytes, fid) != header.payloadBytes) {
+		printf("failed reading %s.\n", filename.c_str());
+		return false;
+	}
+	if (VbmChecksum(data, header.payloadBytes) != header.checksum) {
+		printf("checksum mismatch in %s.\n", filename.c_str());
+		return false;
+	}
+	return true;
+}
+
+
+VbmMapping::VbmMapping()
+{
+	base = NULL;
+	size = 0;
+#ifdef _WIN32
+	file = section = NULL;
+#else
+	fd = -1;
+#endif
+}
+
+VbmMapping::~VbmMapping()
+{
+#ifdef _WIN32
+	if (base)		UnmapViewOfFile(base);
+	if (section)	CloseHandle((HANDLE)section);
+	if (file)		CloseHandle((HANDLE)file);
+#else
+	if (base)		munmap(base, size);
+	if (fd >= 0)	close(fd);
+#endif
+}
+
+VbmMapping *VbmMapRaw(const std::string& filename, size_t minSize)
+{
+	VbmMapping *m = new VbmMapping;
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	LARGE_INTEGER fileSize;
+	if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &fileSize)) {
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+		printf("cannot open %s.\n", filename.c_str());
+		delete m;
+		return NULL;
+	}
+	m->file = file;
+	m->size = (size_t)fileSize.QuadPart;
+	if (m->size >= minSize) {
+		m->section = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+		if (m->section) {
+			m->base = MapViewOfFile((HANDLE)m->section, FILE_MAP_COPY, 0, 0, 0);
+		}
+	}
+#else
+	struct stat st;
+	m->fd = open(filename.c_str(), O_RDONLY);
+	if (m->fd < 0 || fstat(m->fd, &st) != 0) {
+		printf("cannot open %s.\n", filename.c_str());
+		delete m;
+		return NULL;
+	}
+	m->size = (size_t)st.st_size;
+	if (m->size >= minSize) {
+		m->base = mmap(NULL, m->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, m->fd, 0);
+		if (m->base == MAP_FAILED) {
+			m->base = NULL;
+		}
+	}
+#endif
+	if (m->base == NULL) {
+		printf("cannot map %s.\n", filename.c_str());
+		delete m;
+		return NULL;
+	}
+	return m;
+}
+
+VbmMapping *VbmMapFile(const std::string& filename, VbmHeader& header, unsigned int elemType, unsigned int elemSize, bool verify)
+{
+	VbmMapping *m = VbmMapRaw(filename, sizeof(VbmHeader));
+	if (m == NULL) {
+		return NULL;
+	}
+	memcpy(&header, m->base, sizeof(header));
+	if (!CheckHeader(header, filename, elemType, elemSize, (long long)m->size)) {
+		delete m;
+		return NULL;
+	}
+	if (verify && VbmChecksum((char *)m->base + header.payloadOffset, header.payloadBytes) != header.checksum) {
+		printf("checksum mismatch in %s.\n", filename.c_str());
+		delete m;
+		return NULL;
+	}
+	return m;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+
+
+// Container of one VECBITMAP: a VBM_HEADER_SIZE byte header followed by the raw elements.
+// The payload starts on a page boundary, so a mapped file can be used in place.
+// Files are written in the byte order of the machine; readers reject files of the other order.
+#define VBM_MAGIC			"VECBMAP"
+#define VBM_VERSION			1
+#define VBM_HEADER_SIZE		4096
+#define VBM_ENDIAN_TAG		0x01020304u
+#define VBM_PARAMS_SIZE		2048
+
+enum VbmElemType {
+	VBM_UNKNOWN = 0,		// any other T, only checked by size
+	VBM_UINT8,
+	VBM_BOOL,
+	VBM_INT32,
+	VBM_INT64,
+	VBM_FLOAT32,
+	VBM_FLOAT64,
+	VBM_PLANE,				// Plane: a, b, c, nx, ny, nz as floats
+};
+
+struct VbmHeader {
+	char magic[8];
+	unsigned int version;
+	unsigned int endianTag;
+	unsigned int elemType;
+	unsigned int elemSize;
+	int h, w, n;
+	int reserved;
+	unsigned long long payloadOffset;
+	unsigned long long payloadBytes;
+	unsigned long long checksum;		// VbmChecksum of the payload
+	char params[VBM_PARAMS_SIZE];		// parameters of the run that produced the data, "key=value" lines
+};
+
+// A file mapped copy-on-write: writes through the mapping change memory only, never the file.
+struct VbmMapping {
+	void *base;
+	size_t size;
+#ifdef _WIN32
+	void *file, *section;
+#else
+	int fd;
+#endif
+	VbmMapping();
+	~VbmMapping();
+};
+
+
+unsigned long long VbmChecksum(const void *data, size_t bytes);
+const char *VbmElemTypeName(unsigned int type);
+
+// All of these print the reason and return false (or NULL) on failure.
+bool VbmWriteFile(const std::string& filename, VbmHeader& header, const void *data);
+bool VbmReadHeader(FILE *fid, const std::string& filename, VbmHeader& header, unsigned int elemType, unsigned int elemSize);
+bool VbmReadPayload(FILE *fid, const std::string& filename, const VbmHeader& header, void *data);
+VbmMapping *VbmMapRaw(const std::string& filename, size_t minSize);		// any file of at least minSize bytes
+VbmMapping *VbmMapFile(const std::string& filename, VbmHeader& header, unsigned int elemType, unsigned int elemSize, bool verify);
@@ -0,0 +1,58 @@
+#include <cmath>
+#include <algorithm>
+
+#include <omp.h>
+#include "ColorConversion.h"
+
+
+struct SrgbGammaTable {
+	float linear[256];		// sRGB byte value with the gamma removed, in [0, 1]
+	SrgbGammaTable()
+	{
+		for (int v = 0; v < 256; v++) {
+			double c = v / 255.0;
+			linear[v] = (c <= 0.04045) ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+		}
+	}
+};
+
+static const SrgbGammaTable g_srgbGamma;
+
+void ConvertArgbToLab(const unsigned int *argb, int npixels, float *lvec, float *avec, float *bvec)
+{
+	// Same formulas as SLIC::RGB2LAB, with the rows of the sRGB -> XYZ matrix
+	// already divided by the reference white.
+	const float Xr = 0.950456f, Yr = 1.f, Zr = 1.088754f;
+	const float M[3][3] = {
+		{ 0.4124564f / Xr, 0.3575761f / Xr, 0.1804375f / Xr },
+		{ 0.2126729f / Yr, 0.7151522f / Yr, 0.0721750f / Yr },
+		{ 0.0193339f / Zr, 0.1191920f / Zr, 0.9503041f / Zr } };
+	const float epsilon = 0.008856f;
+	const float kappa = 903.3f;
+	const float *linear = g_srgbGamma.linear;
+
+	#pragma omp parallel for
+	for (int start = 0; start < npixels; start += COLOR_BLOCK_SIZE) {
+		const int n = std::min(COLOR_BLOCK_SIZE, npixels - start);
+		float r[COLOR_BLOCK_SIZE], g[COLOR_BLOCK_SIZE], b[COLOR_BLOCK_SIZE];
+		float xr[COLOR_BLOCK_SIZE], yr[COLOR_BLOCK_SIZE], zr[COLOR_BLOCK_SIZE];
+
+		for (int k = 0; k < n; k++) {
+			unsigned int c = argb[start + k];
+			r[k] = linear[(c >> 16) & 0xFF];
+			g[k] = linear[(c >>  8) & 0xFF];
+			b[k] = linear[(c      ) & 0xFF];
+		}
+		ApplyColorMatrix(M, r, g, b, xr, yr, zr, n);
+
+		float *L = lvec + start, *A = avec + start, *B = bvec + start;
+		for (int k = 0; k < n; k++) {
+			float fx = (xr[k] > epsilon) ? CubeRoot(xr[k]) : (kappa * xr[k] + 16.f) / 116.f;
+			float fy = (yr[k] > epsilon) ? CubeRoot(yr[k]) : (kappa * yr[k] + 16.f) / 116.f;
+			float fz = (zr[k] > epsilon) ? CubeRoot(zr[k]) : (kappa * zr[k] + 16.f) / 116.f;
+			L[k] = 116.f * fy - 16.f;
+			A[k] = 500.f * (fx - fy);
+			B[k] = 200.f * (fy - fz);
+		}
+	}
+}
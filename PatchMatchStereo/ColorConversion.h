@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstring>
+
+
+// Fast color space conversion shared by SLIC (sRGB -> CIELAB) and the mean shift
+// segmenter (RGB -> CIELUV). Pixels go through in blocks of COLOR_BLOCK_SIZE: the
+// bytes are unpacked into float arrays first, then the matrix multiply and the
+// cube root run as branch-free loops over the block, which the compiler vectorizes.
+#define COLOR_BLOCK_SIZE	256
+
+inline float CubeRoot(float t)
+{
+	// Initial guess from the exponent bits, refined by three Newton steps.
+	// Valid for t >= 0 (returns a tiny positive value for t = 0).
+	unsigned int i;
+	memcpy(&i, &t, sizeof(i));
+	i = i / 3 + 709921077;
+	float y;
+	memcpy(&y, &i, sizeof(y));
+	y = (2.f * y + t / (y * y)) * (1.f / 3.f);
+	y = (2.f * y + t / (y * y)) * (1.f / 3.f);
+	y = (2.f * y + t / (y * y)) * (1.f / 3.f);
+	return y;
+}
+
+inline void ApplyColorMatrix(const float M[3][3], const float *c0, const float *c1, const float *c2,
+	float *x, float *y, float *z, int n)
+{
+	for (int k = 0; k < n; k++) {
+		x[k] = M[0][0] * c0[k] + M[0][1] * c1[k] + M[0][2] * c2[k];
+		y[k] = M[1][0] * c0[k] + M[1][1] * c1[k] + M[1][2] * c2[k];
+		z[k] = M[2][0] * c0[k] + M[2][1] * c1[k] + M[2][2] * c2[k];
+	}
+}
+
+// ARGB pixels as packed by SLIC (R in bits 16-23) to CIELAB, D65 white, into separate L, a, b planes.
+void ConvertArgbToLab(const unsigned int *argb, int npixels, float *lvec, float *avec, float *bvec);
@@ -0,0 +1,230 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <memory>
+#include <future>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <omp.h>
+#include "Utilities.h"
+#include "Benchmark.h"
+#include "BinaryFile.h"
+#include "DatasetPack.h"
+
+
+static const char *packImageNames[PACK_NIMAGES] = { "im2", "im6", "disp2", "nonocc", "all", "disc" };
+
+static cv::Mat *DatasetImages(StereoDataset& ds, int k)
+{
+	cv::Mat *images[PACK_NIMAGES] = { &ds.L, &ds.R, &ds.gt, &ds.oc, &ds.all, &ds.disc };
+	return images[k];
+}
+
+static long long SourceBytes(int id, int k)
+{
+	FILE *fid = fopen((folders[id] + packImageNames[k] + ".png").c_str(), "rb");
+	if (fid == NULL) {
+		return -1;
+	}
+	fseek(fid, 0, SEEK_END);
+	long long size = ftell(fid);
+	fclose(fid);
+	return size;
+}
+
+static cv::Mat FirstChannel(const cv::Mat& img)
+{
+	if (img.empty() || img.channels() == 1) {
+		return img;
+	}
+	std::vector<cv::Mat> channels;
+	cv::split(img, channels);
+	return channels[0];
+}
+
+static bool LoadPngs(int id, StereoDataset& ds)
+{
+	for (int k = 0; k < PACK_NIMAGES; k++) {
+		cv::Mat img = cv::imread(folders[id] + packImageNames[k] + ".png");
+		*DatasetImages(ds, k) = (k < 2 ? img : FirstChannel(img));
+	}
+	if (ds.L.empty() || ds.R.empty()) {
+		printf("cannot read %sim2.png/im6.png\n", folders[id].c_str());
+		return false;
+	}
+	return true;
+}
+
+static bool LoadPack(int id, StereoDataset& ds)
+{
+	std::string filename = folders[id] + PACK_FILENAME;
+	FILE *fid = fopen(filename.c_str(), "rb");
+	if (fid == NULL) {
+		return false;		// no pack, not an error
+	}
+	fclose(fid);
+
+	std::unique_ptr<VbmMapping> m(VbmMapRaw(filename, sizeof(PackHeader)));
+	if (!m) {
+		return false;
+	}
+	PackHeader header;
+	memcpy(&header, m->base, sizeof(header));
+	if (memcmp(header.magic, PACK_MAGIC, sizeof(header.magic)) != 0 || header.version != PACK_VERSION
+		|| header.endianTag != VBM_ENDIAN_TAG || header.nimages != PACK_NIMAGES) {
+		printf("%s is not a pack of this build, decoding the PNGs.\n", filename.c_str());
+		return false;
+	}
+
+	for (int k = 0; k < PACK_NIMAGES; k++) {
+		PackEntry& e = header.entries[k];
+		if (e.sourceBytes != SourceBytes(id, k)) {
+			printf("%s is older than %s.png, decoding the PNGs.\n", filename.c_str(), packImageNames[k]);
+			return false;
+		}
+		if (e.bytes != (unsigned long long)e.rows * e.cols * e.channels || e.offset + e.bytes > m->size) {
+			printf("%s is truncated or corrupt, decoding the PNGs.\n", filename.c_str());
+			return false;
+		}
+		const char *pixels = (const char *)m->base + e.offset;
+		if (VbmChecksum(pixels, e.bytes) != e.checksum) {
+			printf("checksum mismatch in %s, decoding the PNGs.\n", filename.c_str());
+			return false;
+		}
+		// Copied out, so the images do not depend on the lifetime of the mapping.
+		cv::Mat img;
+		if (e.bytes > 0) {
+			img.create(e.rows, e.cols, CV_8UC(e.channels));
+			memcpy(img.data, pixels, e.bytes);
+		}
+		*DatasetImages(ds, k) = img;
+	}
+	return !ds.L.empty() && !ds.R.empty();
+}
+
+bool StereoDataset::Load(int id)
+{
+	StereoDataset ds;
+	if (!LoadPack(id, ds) && !LoadPngs(id, ds)) {
+		return false;
+	}
+	ds.folderId = id;
+	*this = ds;
+	return true;
+}
+
+bool PackDataset(int id)
+{
+	StereoDataset ds;
+	if (!LoadPngs(id, ds)) {
+		return false;
+	}
+
+	PackHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+	header.version = PACK_VERSION;
+	header.endianTag = VBM_ENDIAN_TAG;
+	header.nimages = PACK_NIMAGES;
+
+	unsigned long long offset = VBM_HEADER_SIZE;
+	for (int k = 0; k < PACK_NIMAGES; k++) {
+		cv::Mat img = DatasetImages(ds, k)->clone();		// continuous
+		*DatasetImages(ds, k) = img;
+		PackEntry& e = header.entries[k];
+		strncpy(e.name, packImageNames[k], sizeof(e.name) - 1);
+		e.rows = img.rows;
+		e.cols = img.cols;
+		e.channels = img.empty() ? 0 : img.channels();
+		e.offset = offset;
+		e.bytes = (unsigned long long)img.total() * img.elemSize();
+		e.checksum = VbmChecksum(img.data, e.bytes);
+		e.sourceBytes = SourceBytes(id, k);
+		offset += (e.bytes + VBM_HEADER_SIZE - 1) / VBM_HEADER_SIZE * VBM_HEADER_SIZE;
+	}
+
+	std::string filename = folders[id] + PACK_FILENAME;
+	FILE *fid = fopen(filename.c_str(), "wb");
+	if (fid == NULL) {
+		printf("cannot open %s for writing.\n", filename.c_str());
+		return false;
+	}
+	std::vector<char> zeros(VBM_HEADER_SIZE, 0);
+	bool ok = fwrite(&header, sizeof(header), 1, fid) == 1
+		&& fwrite(&zeros[0], 1, VBM_HEADER_SIZE - sizeof(header), fid) == VBM_HEADER_SIZE - sizeof(header);
+	for (int k = 0; k < PACK_NIMAGES && ok; k++) {
+		PackEntry& e = header.entries[k];
+		size_t padding = (VBM_HEADER_SIZE - e.bytes % VBM_HEADER_SIZE) % VBM_HEADER_SIZE;
+		ok = fwrite(DatasetImages(ds, k)->data, 1, e.bytes, fid) == e.bytes
+			&& fwrite(&zeros[0], 1, padding, fid) == padding;
+	}
+	ok = (fclose(fid) == 0) && ok;
+	if (!ok) {
+		printf("failed writing %s.\n", filename.c_str());
+		return false;
+	}
+	printf("wrote %s (%.1f MB)\n", filename.c_str(), offset / 1048576.0);
+	return true;
+}
+
+int RunPackDatasets(int argc, char **argv)
+{
+	std::vector<int> datasets;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--datasets" && i + 1 < argc) {
+			datasets = ParseDatasetList(argv[++i]);
+		}
+		else {
+			printf("unknown option %s\n", arg.c_str());
+			return 1;
+		}
+	}
+	if (datasets.empty()) {
+		datasets = ParseDatasetList("all");
+	}
+
+	int nfailed = 0;
+	for (int k = 0; k < datasets.size(); k++) {
+		nfailed += !PackDataset(datasets[k]);
+	}
+	return nfailed > 0;
+}
+
+
+static StereoDataset LoadDataset(int id)
+{
+	StereoDataset ds;
+	ds.Load(id);
+	return ds;
+}
+
+DatasetPrefetcher::DatasetPrefetcher(const std::vector<int>& ids_) : ids(ids_), next(0)
+{
+	Start();
+}
+
+void DatasetPrefetcher::Start()
+{
+	if (next < ids.size()) {
+		pending = std::async(std::launch::async, LoadDataset, ids[next++]);
+	}
+}
+
+bool DatasetPrefetcher::Next(StereoDataset& ds)
+{
+	while (pending.valid()) {
+		ds = pending.get();
+		Start();
+		if (ds.folderId >= 0) {
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <future>
+
+
+// Pre-decoded images of one dataset folder, stored as folder/PACK_FILENAME: a header followed by
+// the raw pixels of every image, each starting on a page boundary so the file can be mapped.
+// Written by PatchMatchStereo --pack; used instead of the PNGs whenever it is present and current.
+#define PACK_FILENAME		"dataset.pack"
+#define PACK_MAGIC			"STEREOPK"
+#define PACK_VERSION		1
+#define PACK_NIMAGES		6
+
+struct PackEntry {
+	char name[16];						// source PNG without extension
+	int rows, cols, channels;
+	int reserved;
+	unsigned long long offset, bytes;
+	unsigned long long checksum;		// VbmChecksum of the pixels
+	long long sourceBytes;				// size of the PNG it was decoded from, to detect stale packs
+};
+
+struct PackHeader {
+	char magic[8];
+	unsigned int version;
+	unsigned int endianTag;
+	int nimages;
+	int reserved;
+	PackEntry entries[PACK_NIMAGES];
+};
+
+// Stereo pair and evaluation masks of one dataset, read from its pack if there is a current one,
+// otherwise decoded from the PNGs.
+struct StereoDataset {
+	int folderId;						// -1 until loaded
+	cv::Mat L, R;						// im2, im6 (3 channels)
+	cv::Mat gt, oc, all, disc;			// first channel of disp2, nonocc, all, disc
+	StereoDataset() : folderId(-1) {}
+	bool Load(int id);
+};
+
+// Decodes the PNGs of folders[id] and writes its pack.
+bool PackDataset(int id);
+
+// PatchMatchStereo --pack [--datasets all|cones,teddy,...]
+int RunPackDatasets(int argc, char **argv);
+
+// Loads the datasets of a list in order on a background thread, one ahead of the consumer,
+// so the next pair is read while the current one is processed.
+class DatasetPrefetcher {
+public:
+	DatasetPrefetcher(const std::vector<int>& ids);
+	// Waits for the next dataset that loads; false when the list is exhausted.
+	bool Next(StereoDataset& ds);
+private:
+	std::vector<int> ids;
+	int next;
+	std::future<StereoDataset> pending;
+	void Start();
+};
@@ -0,0 +1,238 @@
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <map>
+
+#include <opencv2/core/core.hpp>
+
+#include <omp.h>
+#include "Utilities.h"
+#include "MemoryTracker.h"
+
+
+static std::atomic<long long> trackedCurrent(0);
+static std::atomic<long long> trackedPeak(0);
+static std::vector<long long> outerPeaks;		// peaks of the enclosing stages, only touched by tic/toc
+
+#define POOL_MIN_BYTES		(1 << 20)		// smaller buffers are not worth taking the lock
+
+static std::atomic<bool> poolEnabled(false);
+static std::mutex poolMutex;
+static std::multimap<long long, char *> pooled;		// kept buffers by size
+static long long pooledBytes = 0;
+static long long poolLimit = -1;
+
+long long g_memoryBudgetBytes = 0;
+StereoPlan g_plan;
+
+void MemoryTracker::Allocated(long long bytes)
+{
+	long long now = (trackedCurrent += bytes);
+	long long peak = trackedPeak.load();
+	while (now > peak && !trackedPeak.compare_exchange_weak(peak, now)) {
+	}
+}
+
+void MemoryTracker::Freed(long long bytes)
+{
+	trackedCurrent -= bytes;
+}
+
+long long MemoryTracker::Current()
+{
+	return trackedCurrent.load();
+}
+
+long long MemoryTracker::Peak()
+{
+	return trackedPeak.load();
+}
+
+void MemoryTracker::ResetPeak()
+{
+	trackedPeak = trackedCurrent.load();
+}
+
+void MemoryTracker::BeginStage()
+{
+	outerPeaks.push_back(trackedPeak.load());
+	ResetPeak();
+}
+
+long long MemoryTracker::EndStage()
+{
+	long long stagePeak = trackedPeak.load();
+	if (!outerPeaks.empty()) {
+		trackedPeak = std::max(stagePeak, outerPeaks.back());
+		outerPeaks.pop_back();
+	}
+	return stagePeak;
+}
+
+void MemoryTracker::ResetStages()
+{
+	outerPeaks.clear();
+	ResetPeak();
+}
+
+
+std::string StereoPlan::Describe() const
+{
+	const char *storage[] = { "float table", "quantized table", "on the fly" };
+	return std::string("weights ") + storage[weights] + ", coupling " + (lazyCoupling ? "lazy" : "materialized");
+}
+
+void BufferPool::Enable(bool enable)
+{
+	poolEnabled = enable;
+	if (!enable) {
+		Clear();
+	}
+}
+
+bool BufferPool::Enabled()
+{
+	return poolEnabled;
+}
+
+void *BufferPool::Acquire(long long bytes)
+{
+	if (poolEnabled && bytes >= POOL_MIN_BYTES) {
+		std::lock_guard<std::mutex> lock(poolMutex);
+		std::multimap<long long, char *>::iterator it = pooled.find(bytes);
+		if (it != pooled.end()) {
+			char *p = it->second;
+			pooled.erase(it);
+			pooledBytes -= bytes;
+			return p;
+		}
+	}
+	return new char[bytes];
+}
+
+void BufferPool::Return(void *p, long long bytes)
+{
+	if (poolEnabled && bytes >= POOL_MIN_BYTES) {
+		std::lock_guard<std::mutex> lock(poolMutex);
+		if (poolLimit < 0 || pooledBytes + bytes <= poolLimit) {
+			pooled.insert(std::make_pair(bytes, (char *)p));
+			pooledBytes += bytes;
+			return;
+		}
+	}
+	delete[] (char *)p;
+}
+
+void BufferPool::Clear()
+{
+	std::lock_guard<std::mutex> lock(poolMutex);
+	for (std::multimap<long long, char *>::iterator it = pooled.begin(); it != pooled.end(); ++it) {
+		delete[] it->second;
+	}
+	pooled.clear();
+	pooledBytes = 0;
+}
+
+void BufferPool::SetLimit(long long bytes)
+{
+	std::lock_guard<std::mutex> lock(poolMutex);
+	poolLimit = bytes;
+	// largest first, they are the fewest to free
+	while (poolLimit >= 0 && pooledBytes > poolLimit) {
+		std::multimap<long long, char *>::iterator it = --pooled.end();
+		pooledBytes -= it->first;
+		delete[] it->second;
+		pooled.erase(it);
+	}
+}
+
+long long BufferPool::PooledBytes()
+{
+	std::lock_guard<std::mutex> lock(poolMutex);
+	return pooledBytes;
+}
+
+
+long long EstimatePeakBytes(const std::string& pipeline, int rows, int cols, int ndisps, const StereoPlan& plan)
+{
+	// Dominant buffers of each pipeline at its peak, per pixel. Buffers below a few floats
+	// per pixel (images, masks, label maps) are covered by the margin.
+	const double P = (double)rows * cols;
+	const double levels = (int)(ndisps / granularity);		// cost volume depth at the sub-pixel granularity
+	const double entryBytes[] = { sizeof(float), sizeof(unsigned short), 0 };
+	const double weights = patch_w * patch_w * entryBytes[plan.weights];		// support window weights per pixel
+	const double margin = 32;
+
+	// ComputeAdGradientCostVolume: the volume and, while it is built, the color/gradient features of both images.
+	// ComputeAdCensusCostVolume: the census tensor and the combined volume, and the census images.
+	const double census = 2 * ndisps * sizeof(float) + 2 * sizeof(long long);
+	double bytes;
+	if (pipeline == "wta") {
+		// both volumes at integer granularity, the features of the second one, two disparity maps
+		bytes = P * (2 * ndisps * sizeof(float) + 2 * 5 * sizeof(float) + 2 * sizeof(float));
+	}
+	else if (pipeline == "patchmatch") {
+		// volumes, weights, planes, costs and disparities of both views
+		bytes = P * (2 * levels * sizeof(float) + 2 * weights
+			+ 2 * sizeof(Plane) + 4 * sizeof(float) + 2 * sizeof(bool));
+	}
+	else if (pipeline == "laplacian") {
+		// The census volume of the initialization is gone before the PatchMatchState is filled.
+		// Unless the coupling is lazy, every theta step copies the volumes of the state, so both
+		// views hold two volumes each. Multigrid hierarchy (five floats per pixel on all levels),
+		// u and v of both views.
+		double coupled = (plan.lazyCoupling ? 2 : 4) * levels * sizeof(float);
+		bytes = P * std::max(census, coupled + 2 * weights
+			+ 2 * sizeof(Plane) + 8 * sizeof(float) + 5 * sizeof(float) * 4 / 3 + 4 * sizeof(float));
+	}
+	else if (pipeline == "ransac") {
+		// AD-gradient volumes of both views and the copy of the left one kept for the mouse callbacks,
+		// and the smoothness Laplacian (up to 9 nonzeros per row) with the two copies kept by
+		// SmoothCostCache. Before, the census volumes of the initialization, one at a time.
+		double laplacian = 9 * (sizeof(double) + sizeof(int));
+		bytes = P * std::max(2 * levels * sizeof(float) + census,
+			3 * levels * sizeof(float) + 2 * sizeof(Plane) + 2 * sizeof(float) + 3 * laplacian + sizeof(double));
+	}
+	else {
+		return -1;
+	}
+	return (long long)(bytes + margin * P);
+}
+
+bool PlanStereo(const std::string& pipeline, int rows, int cols, int ndisps)
+{
+	// Leaner configurations in order of increasing run time per byte saved: expanding a quantized
+	// window is a lookup per entry, the lazy coupling adds a few flops to every cost lookup, and
+	// on-the-fly weights compute the color distances of every window again. A step is only taken
+	// if it lowers the prediction, i.e. if the pipeline has that alternative.
+	StereoPlan plan;
+	long long estimate = EstimatePeakBytes(pipeline, rows, cols, ndisps, plan);
+	for (int step = 0; step < 3 && g_memoryBudgetBytes > 0 && estimate > g_memoryBudgetBytes; step++) {
+		StereoPlan leaner = plan;
+		if (step == 0)	leaner.weights = WEIGHTS_QUANTIZED_TABLE;
+		if (step == 1)	leaner.lazyCoupling = true;
+		if (step == 2)	leaner.weights = WEIGHTS_ON_THE_FLY;
+		long long leanerEstimate = EstimatePeakBytes(pipeline, rows, cols, ndisps, leaner);
+		if (leanerEstimate < estimate) {
+			plan = leaner;
+			estimate = leanerEstimate;
+		}
+	}
+	g_plan = plan;
+
+	printf("%s on %d x %d, %d disparities: %s, predicted peak %.0f MB", pipeline.c_str(), rows, cols, ndisps,
+		plan.Describe().c_str(), estimate / 1048576.0);
+	if (g_memoryBudgetBytes > 0) {
+		printf(", budget %.0f MB", g_memoryBudgetBytes / 1048576.0);
+	}
+	printf("\n");
+	if (g_memoryBudgetBytes > 0 && estimate > g_memoryBudgetBytes) {
+		printf("refusing to run %s: not even its leanest configuration fits the memory budget.\n", pipeline.c_str());
+		return false;
+	}
+	return true;
+}
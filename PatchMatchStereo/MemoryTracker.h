@@ -0,0 +1,89 @@
+#pragma once
+
+#include <string>
+
+
+// Bytes held by the large buffers of the pipelines: the data of every VECBITMAP that owns it,
+// and the buffers registered with TrackedBytes (Eigen matrices, triplet lists).
+// Besides the overall peak, Timer::tic/toc keep the peak of every stage.
+class MemoryTracker {
+public:
+	static void Allocated(long long bytes);
+	static void Freed(long long bytes);
+	static long long Current();
+	static long long Peak();
+	static void ResetPeak();			// to the current usage
+	static void BeginStage();
+	static long long EndStage();		// peak of the stage, which also counts towards the enclosing one
+	static void ResetStages();			// forgets the open stages, see Timer::Reset
+};
+
+// Source of the VECBITMAP buffers. When enabled (PatchMatchStereo --serve), released buffers of at
+// least POOL_MIN_BYTES are kept and handed out again for the same size, so the jobs of one image size
+// stop allocating after the first. Buffers are raw memory, VECBITMAP only holds plain element types.
+// The kept buffers are not counted by MemoryTracker; SetLimit bounds them, e.g. to what the memory
+// budget leaves next to the predicted peak of a job.
+class BufferPool {
+public:
+	static void Enable(bool enable);
+	static bool Enabled();
+	static void *Acquire(long long bytes);
+	static void Return(void *p, long long bytes);
+	static void Clear();				// frees the kept buffers, e.g. when the image size changes
+	static void SetLimit(long long bytes);	// frees kept buffers down to bytes, and keeps no more; -1 for no limit
+	static long long PooledBytes();
+};
+
+// Registers a buffer that is not a VECBITMAP for as long as the object lives.
+struct TrackedBytes {
+	long long bytes;
+	explicit TrackedBytes(long long bytes_ = 0) : bytes(0) { Set(bytes_); }
+	~TrackedBytes() { Set(0); }
+	void Set(long long bytes_)
+	{
+		if (bytes_ > bytes)	MemoryTracker::Allocated(bytes_ - bytes);
+		else				MemoryTracker::Freed(bytes - bytes_);
+		bytes = bytes_;
+	}
+private:
+	TrackedBytes(const TrackedBytes&);
+	TrackedBytes& operator=(const TrackedBytes&);
+};
+
+template<class SparseMatrixType>
+long long SparseBytes(const SparseMatrixType& m)
+{
+	// values and inner indices, plus the outer index
+	return (long long)m.nonZeros() * (sizeof(typename SparseMatrixType::Scalar) + sizeof(int))
+		+ (long long)(m.outerSize() + 1) * sizeof(int);
+}
+
+// Storage of the adaptive support weights of the patch_w x patch_w window around every pixel.
+enum WeightStorage {
+	WEIGHTS_FLOAT_TABLE,			// a float per window entry and pixel
+	WEIGHTS_QUANTIZED_TABLE,		// the integer color distance of every entry, 16 bits, turned into weights by a lookup
+	WEIGHTS_ON_THE_FLY,				// no table, every window is computed again when it is visited
+};
+
+// Run-time configuration of the pipelines, choosing between ways to get the same result with
+// different memory/speed trade-offs. The default is the fastest one.
+struct StereoPlan {
+	WeightStorage weights;			// patchmatch, laplacian
+	bool lazyCoupling;				// laplacian: add the coupling term inside the plane cost instead of to copies of the volumes
+	StereoPlan() : weights(WEIGHTS_FLOAT_TABLE), lazyCoupling(false) {}
+	std::string Describe() const;
+};
+
+// Configuration the pipelines run with, set by PlanStereo.
+extern StereoPlan g_plan;
+
+// Predicted peak of the tracked buffers of a pipeline ("wta", "patchmatch", "laplacian", "ransac")
+// in a configuration, for an image size. Returns -1 for an unknown pipeline.
+long long EstimatePeakBytes(const std::string& pipeline, int rows, int cols, int ndisps, const StereoPlan& plan = StereoPlan());
+
+// Budget for the tracked buffers, 0 for none.
+extern long long g_memoryBudgetBytes;
+
+// Sets g_plan to the fastest configuration of the pipeline whose predicted peak fits g_memoryBudgetBytes,
+// and logs it with the prediction. False, with a message, if not even the leanest one fits.
+bool PlanStereo(const std::string& pipeline, int rows, int cols, int ndisps);
@@ -0,0 +1,587 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include <stack>
+#include <string>
+#include <random>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <Eigen/SparseCore>
+#include <Eigen/SparseCholesky>
+
+#include <omp.h>
+#include "Utilities.h"
+#include "Benchmark.h"
+#include "Multigrid.h"
+#include "NelderMead.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sched.h>
+#endif
+
+
+extern int nrows, ncols;
+
+// Kernels defined next to their pipelines.
+double ComputePlaneCost(int yc, int xc, Plane& coeff_try, VECBITMAP<float>& dsi, VECBITMAP<float>& w);
+double ComputePlaneCost(Plane& coeff, VECBITMAP<float>& dsi, RegionIndex& regions, int id);
+VECBITMAP<float> ComputeColGradFeature(cv::Mat& img);
+VECBITMAP<float> ComputeCensusTensor(VECBITMAP<unsigned char>& imL, VECBITMAP<unsigned char>& imR, int sign);
+void WeightedMedianFilter(int yc, int xc, VECBITMAP<float>& disp, VECBITMAP<float>& weights, VECBITMAP<bool>& valid, bool useInvalidPixels);
+void CrossCheck(VECBITMAP<float>& dispL, VECBITMAP<float>& dispR, VECBITMAP<bool>& validL, VECBITMAP<bool>& validR);
+int FromSegmentMapToLabelMap(cv::Mat& segmap, VECBITMAP<int>& labelmap, RegionIndex& regions);
+Eigen::SparseMatrix<double> PrecomputeSparseLTL(cv::Mat& cvImg);
+VECBITMAP<float> SolveSecondOrderSmootheness(VECBITMAP<float>& dv, float theta, Eigen::SparseMatrix<double>& LTL);
+
+#define MICRO_DEFAULT_WARMUP		2
+#define MICRO_DEFAULT_REPS			15
+#define MICRO_CANDIDATES			4096		// plane candidates / filtered pixels per run of the per-pixel kernels
+#define MICRO_SEGMENT_SIZE			16			// side of the square segments of the synthetic segmentation
+#define MICRO_NM_ITERS				100
+
+// Results are summed into this so that the compiler cannot drop the kernels.
+static volatile double microSink;
+
+
+struct MicroConfig {
+	int rows, cols, ndisps;
+};
+
+// Synthetic inputs of one configuration and the run of one kernel on them.
+class MicroCase {
+public:
+	double work;				// units processed by one Run()
+	MicroCase() : work(0) {}
+	virtual ~MicroCase() {}
+	virtual void Run() = 0;
+};
+
+typedef MicroCase *(*MicroFactory)(const MicroConfig& cfg);
+
+struct MicroKernel {
+	const char *kernel;			// kernels with the same name are compared with each other
+	const char *variant;
+	const char *unit;			// what the throughput counts
+	MicroFactory create;
+};
+
+
+// Stereo pair with a textured left image and the right image shifted by a third of the disparity range.
+static void MakeStereoPair(const MicroConfig& cfg, cv::Mat& imL, cv::Mat& imR)
+{
+	std::mt19937 rng(1234);
+	imL.create(cfg.rows, cfg.cols, CV_8UC3);
+	imR.create(cfg.rows, cfg.cols, CV_8UC3);
+	for (int y = 0; y < cfg.rows; y++) {
+		for (int x = 0; x < cfg.cols; x++) {
+			for (int c = 0; c < 3; c++) {
+				imL.at<cv::Vec3b>(y, x)[c] = (unsigned char)((x * (c + 1) + y * 3) % 200 + rng() % 56);
+			}
+		}
+	}
+	int shift = cfg.ndisps / 3;
+	for (int y = 0; y < cfg.rows; y++) {
+		for (int x = 0; x < cfg.cols; x++) {
+			imR.at<cv::Vec3b>(y, x) = imL.at<cv::Vec3b>(y, std::min(cfg.cols - 1, x + shift));
+		}
+	}
+}
+
+static void FillRandom(VECBITMAP<float>& m, float lo, float hi, int seed)
+{
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<float> dist(lo, hi);
+	for (int i = 0; i < m.w * m.h * m.n; i++) {
+		m.data[i] = dist(rng);
+	}
+}
+
+static void SetGlobals(const MicroConfig& cfg)
+{
+	nrows = cfg.rows;
+	ncols = cfg.cols;
+	ndisps = cfg.ndisps;
+	dmax = ndisps - 1;
+}
+
+
+class WindowPlaneCostCase : public MicroCase {
+public:
+	VECBITMAP<float> dsi, weights;
+	std::vector<Plane> planes;
+	std::vector<int> ys, xs;
+	WindowPlaneCostCase(const MicroConfig& cfg)
+		: dsi(cfg.rows, cfg.cols, (int)(cfg.ndisps / granularity)), weights(patch_w, patch_w)
+	{
+		FillRandom(dsi, 0.f, 1.f, 1);
+		FillRandom(weights, 0.f, 1.f, 2);
+		std::mt19937 rng(3);
+		for (int i = 0; i < MICRO_CANDIDATES; i++) {
+			int y = rng() % cfg.rows, x = rng() % cfg.cols;
+			Plane p;
+			p.RandomAssign(y, x, dmax, rng);
+			planes.push_back(p);
+			ys.push_back(y);
+			xs.push_back(x);
+		}
+		work = MICRO_CANDIDATES;
+	}
+	void Run()
+	{
+		double sum = 0;
+		#pragma omp parallel for reduction(+:sum)
+		for (int i = 0; i < MICRO_CANDIDATES; i++) {
+			sum += ComputePlaneCost(ys[i], xs[i], planes[i], dsi, weights);
+		}
+		microSink = microSink + sum;
+	}
+};
+
+// Synthetic segmentation of MICRO_SEGMENT_SIZE squares with a random plane per segment.
+class SegmentPlaneCostCase : public MicroCase {
+public:
+	VECBITMAP<float> dsi;
+	VECBITMAP<int> labelmap;
+	RegionIndex regions;
+	std::vector<Plane> planes;
+	int nlabels;
+	bool scalar;
+	SegmentPlaneCostCase(const MicroConfig& cfg, bool scalar_)
+		: dsi(cfg.rows, cfg.cols, (int)(cfg.ndisps / granularity)), labelmap(cfg.rows, cfg.cols), scalar(scalar_)
+	{
+		FillRandom(dsi, 0.f, 1.f, 1);
+		cv::Mat segmap(cfg.rows, cfg.cols, CV_8UC3);
+		for (int y = 0; y < cfg.rows; y++) {
+			for (int x = 0; x < cfg.cols; x++) {
+				int id = (y / MICRO_SEGMENT_SIZE) * 4096 + x / MICRO_SEGMENT_SIZE;
+				segmap.at<cv::Vec3b>(y, x) = cv::Vec3b(id & 0xFF, (id >> 8) & 0xFF, 0);
+			}
+		}
+		nlabels = FromSegmentMapToLabelMap(segmap, labelmap, regions);
+		std::mt19937 rng(3);
+		for (int id = 0; id < nlabels; id++) {
+			int y, x;
+			regions.PixelAt(id, regions.Size(id) / 2, y, x);
+			Plane p;
+			p.RandomAssign(y, x, dmax, rng);
+			planes.push_back(p);
+		}
+		work = (double)cfg.rows * cfg.cols;
+	}
+	// Reference: one pixel at a time, as the segment cost was computed before the blocked kernel.
+	static double ScalarCost(Plane& coeff, VECBITMAP<float>& dsi, RegionIndex& regions, int id)
+	{
+		double cost = 0;
+		for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+			for (int x = r->x0; x < r->x1; x++) {
+				float d = coeff.a * x + coeff.b * r->y + coeff.c;
+				if (d < 0 || d > dmax) {
+					cost += BAD_PLANE_PENALTY;
+				}
+				else {
+					cost += dsi.get(r->y, x)[(int)(d / granularity + 0.5f)];
+				}
+			}
+		}
+		return cost;
+	}
+	void Run()
+	{
+		double sum = 0;
+		#pragma omp parallel for reduction(+:sum) schedule(dynamic, 16)
+		for (int id = 0; id < nlabels; id++) {
+			sum += scalar ? ScalarCost(planes[id], dsi, regions, id) : ComputePlaneCost(planes[id], dsi, regions, id);
+		}
+		microSink = microSink + sum;
+	}
+};
+
+class AdGradientCostVolumeCase : public MicroCase {
+public:
+	cv::Mat imL, imR;
+	int ndisps;
+	AdGradientCostVolumeCase(const MicroConfig& cfg) : ndisps(cfg.ndisps)
+	{
+		MakeStereoPair(cfg, imL, imR);
+		work = (double)cfg.rows * cfg.cols * (int)(cfg.ndisps / granularity);
+	}
+	void Run()
+	{
+		VECBITMAP<float> dsi = ComputeAdGradientCostVolume(imL, imR, ndisps, -1, granularity);
+		microSink = microSink + dsi.data[0];
+	}
+};
+
+class ColGradFeatureCase : public MicroCase {
+public:
+	cv::Mat imL, imR;
+	ColGradFeatureCase(const MicroConfig& cfg)
+	{
+		MakeStereoPair(cfg, imL, imR);
+		work = (double)cfg.rows * cfg.cols;
+	}
+	void Run()
+	{
+		VECBITMAP<float> colgrad = ComputeColGradFeature(imL);
+		microSink = microSink + colgrad.data[0];
+	}
+};
+
+class CensusTensorCase : public MicroCase {
+public:
+	cv::Mat grayL, grayR;
+	CensusTensorCase(const MicroConfig& cfg)
+	{
+		cv::Mat imL, imR;
+		MakeStereoPair(cfg, imL, imR);
+		cv::cvtColor(imL, grayL, CV_BGR2GRAY);
+		cv::cvtColor(imR, grayR, CV_BGR2GRAY);
+		work = (double)cfg.rows * cfg.cols * cfg.ndisps;
+	}
+	void Run()
+	{
+		VECBITMAP<unsigned char> L(nrows, ncols, 1, grayL.data);
+		VECBITMAP<unsigned char> R(nrows, ncols, 1, grayR.data);
+		VECBITMAP<float> dsi = ComputeCensusTensor(L, R, -1);
+		microSink = microSink + dsi.data[0];
+	}
+};
+
+class PrecomputeWeightsCase : public MicroCase {
+public:
+	cv::Mat imL, imR;
+	PrecomputeWeightsCase(const MicroConfig& cfg)
+	{
+		MakeStereoPair(cfg, imL, imR);
+		work = (double)cfg.rows * cfg.cols;
+	}
+	void Run()
+	{
+		VECBITMAP<float> weights = PrecomputeWeights(imL);
+		microSink = microSink + weights.data[0];
+	}
+};
+
+class WeightedMedianFilterCase : public MicroCase {
+public:
+	VECBITMAP<float> disp, weights;
+	VECBITMAP<bool> valid;
+	std::vector<int> ys, xs;
+	std::vector<float> original;		// disparities of the filtered pixels before the first run
+	WeightedMedianFilterCase(const MicroConfig& cfg)
+		: disp(cfg.rows, cfg.cols), weights(patch_w, patch_w), valid(cfg.rows, cfg.cols)
+	{
+		FillRandom(disp, 0.f, (float)dmax, 1);
+		FillRandom(weights, 0.f, 1.f, 2);
+		std::mt19937 rng(3);
+		for (int i = 0; i < cfg.rows * cfg.cols; i++) {
+			valid.data[i] = (rng() % 4 != 0);
+		}
+		for (int i = 0; i < MICRO_CANDIDATES; i++) {
+			ys.push_back(rng() % cfg.rows);
+			xs.push_back(rng() % cfg.cols);
+			original.push_back(disp[ys[i]][xs[i]]);
+		}
+		work = MICRO_CANDIDATES;
+	}
+	void Run()
+	{
+		// Filtered values go back into disp, as in PostProcess, so the pixels are filtered in order.
+		// The filter only writes the pixel it filters; those are reset so every run sees the same input.
+		for (int i = 0; i < MICRO_CANDIDATES; i++) {
+			disp[ys[i]][xs[i]] = original[i];
+		}
+		for (int i = 0; i < MICRO_CANDIDATES; i++) {
+			WeightedMedianFilter(ys[i], xs[i], disp, weights, valid, false);
+		}
+		microSink = microSink + disp.data[0];
+	}
+};
+
+class CrossCheckCase : public MicroCase {
+public:
+	VECBITMAP<float> dispL, dispR;
+	VECBITMAP<bool> validL, validR;
+	CrossCheckCase(const MicroConfig& cfg)
+		: dispL(cfg.rows, cfg.cols), dispR(cfg.rows, cfg.cols), validL(cfg.rows, cfg.cols), validR(cfg.rows, cfg.cols)
+	{
+		FillRandom(dispL, 0.f, (float)dmax, 1);
+		FillRandom(dispR, 0.f, (float)dmax, 2);
+		work = (double)cfg.rows * cfg.cols;
+	}
+	void Run()
+	{
+		CrossCheck(dispL, dispR, validL, validR);
+		microSink = microSink + validL.data[0];
+	}
+};
+
+// Fits a plane to one synthetic segment with the 3-D simplex, as the plane-fitting refinement does.
+class NelderMeadCase : public MicroCase {
+public:
+	SegmentPlaneCostCase segments;
+	struct SegmentCost {
+		SegmentPlaneCostCase *s;
+		int id;
+		float operator()(float *abc)
+		{
+			Plane p;
+			p.SetAbc(abc);
+			return ComputePlaneCost(p, s->dsi, s->regions, id);
+		}
+	};
+	NelderMeadCase(const MicroConfig& cfg) : segments(cfg, false)
+	{
+		work = segments.nlabels;
+	}
+	void Run()
+	{
+		double sum = 0;
+		#pragma omp parallel for reduction(+:sum) schedule(dynamic, 16)
+		for (int id = 0; id < segments.nlabels; id++) {
+			float x[4 * 3];
+			Plane& p = segments.planes[id];
+			for (int i = 0; i < 4; i++) {
+				x[3 * i + 0] = p.a + (i == 1 ? 0.1f : 0.f);
+				x[3 * i + 1] = p.b + (i == 2 ? 0.1f : 0.f);
+				x[3 * i + 2] = p.c + (i == 3 ? 5.f : 0.f);
+			}
+			SegmentCost f = { &segments, id };
+			NelderMeadOptimize<3>(x, f, MICRO_NM_ITERS);
+			sum += x[2];
+		}
+		microSink = microSink + sum;
+	}
+};
+
+class SecondOrderCase : public MicroCase {
+public:
+	cv::Mat imL, imR;
+	VECBITMAP<float> v;
+	Eigen::SparseMatrix<double> LTL;
+	MGHierarchy mg;
+	bool multigrid;
+	SecondOrderCase(const MicroConfig& cfg, bool multigrid_) : v(cfg.rows, cfg.cols), multigrid(multigrid_)
+	{
+		MakeStereoPair(cfg, imL, imR);
+		FillRandom(v, 0.f, (float)dmax, 1);
+		if (multigrid) {
+			mg = PrecomputeMultigridHierarchy(imL);
+		}
+		else {
+			LTL = PrecomputeSparseLTL(imL);
+		}
+		work = (double)cfg.rows * cfg.cols;
+	}
+	void Run()
+	{
+		VECBITMAP<float> u = multigrid ? SolveSecondOrderSmoothenessMG(v, 1.f, mg) : SolveSecondOrderSmootheness(v, 1.f, LTL);
+		microSink = microSink + u.data[0];
+	}
+};
+
+static MicroCase *CreateWindowPlaneCost(const MicroConfig& cfg)		{ return new WindowPlaneCostCase(cfg); }
+static MicroCase *CreateSegmentCostScalar(const MicroConfig& cfg)	{ return new SegmentPlaneCostCase(cfg, true); }
+static MicroCase *CreateSegmentCostBlocked(const MicroConfig& cfg)	{ return new SegmentPlaneCostCase(cfg, false); }
+static MicroCase *CreateAdGradientCostVolume(const MicroConfig& cfg)	{ return new AdGradientCostVolumeCase(cfg); }
+static MicroCase *CreateColGradFeature(const MicroConfig& cfg)		{ return new ColGradFeatureCase(cfg); }
+static MicroCase *CreateCensusTensor(const MicroConfig& cfg)			{ return new CensusTensorCase(cfg); }
+static MicroCase *CreatePrecomputeWeights(const MicroConfig& cfg)	{ return new PrecomputeWeightsCase(cfg); }
+static MicroCase *CreateWeightedMedianFilter(const MicroConfig& cfg)	{ return new WeightedMedianFilterCase(cfg); }
+static MicroCase *CreateCrossCheck(const MicroConfig& cfg)			{ return new CrossCheckCase(cfg); }
+static MicroCase *CreateNelderMead(const MicroConfig& cfg)			{ return new NelderMeadCase(cfg); }
+static MicroCase *CreateSecondOrderCholesky(const MicroConfig& cfg)	{ return new SecondOrderCase(cfg, false); }
+static MicroCase *CreateSecondOrderMultigrid(const MicroConfig& cfg)	{ return new SecondOrderCase(cfg, true); }
+
+// New variants of a kernel are added here under the same kernel name.
+static const MicroKernel microKernels[] = {
+	{ "ComputePlaneCost",				"window",		"candidates",	CreateWindowPlaneCost },
+	{ "SegmentPlaneCost",				"scalar",		"pixels",		CreateSegmentCostScalar },
+	{ "SegmentPlaneCost",				"blocked",		"pixels",		CreateSegmentCostBlocked },
+	{ "ComputeAdGradientCostVolume",	"default",		"costs",		CreateAdGradientCostVolume },
+	{ "ComputeColGradFeature",			"default",		"pixels",		CreateColGradFeature },
+	{ "ComputeCensusTensor",			"default",		"costs",		CreateCensusTensor },
+	{ "PrecomputeWeights",				"default",		"pixels",		CreatePrecomputeWeights },
+	{ "WeightedMedianFilter",			"default",		"pixels",		CreateWeightedMedianFilter },
+	{ "CrossCheck",						"default",		"pixels",		CreateCrossCheck },
+	{ "NelderMeadOptimize",				"plane",		"segments",		CreateNelderMead },
+	{ "SolveSecondOrderSmootheness",	"cholesky",		"pixels",		CreateSecondOrderCholesky },
+	{ "SolveSecondOrderSmootheness",	"multigrid",	"pixels",		CreateSecondOrderMultigrid },
+};
+static const int nMicroKernels = sizeof(microKernels) / sizeof(microKernels[0]);
+
+
+static bool PinToCore(int core)
+{
+#ifdef _WIN32
+	return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << core) != 0;
+#else
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(core, &set);
+	return sched_setaffinity(0, sizeof(set), &set) == 0;
+#endif
+}
+
+// Nearest-rank percentile of sorted times.
+static double Percentile(const std::vector<double>& sorted, double p)
+{
+	int k = (int)(p * (sorted.size() - 1) + 0.5);
+	return sorted[k];
+}
+
+static bool Selected(const std::vector<std::string>& list, const char *name)
+{
+	return list.empty() || std::find(list.begin(), list.end(), std::string(name)) != list.end();
+}
+
+int RunMicroBenchmark(int argc, char **argv)
+{
+	std::vector<std::string> kernels, variants;
+	std::vector<MicroConfig> configs;
+	std::vector<int> ndispsList;
+	int warmup = MICRO_DEFAULT_WARMUP, reps = MICRO_DEFAULT_REPS, pin = -1;
+	std::string outPath;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (i + 1 >= argc) {
+			printf("missing value for %s\n", arg.c_str());
+			return 1;
+		}
+		std::string value = argv[++i];
+		if (arg == "--kernels") {
+			kernels = SplitList(value);
+		}
+		else if (arg == "--variants") {
+			variants = SplitList(value);
+		}
+		else if (arg == "--sizes") {
+			std::vector<std::string> sizes = SplitList(value);
+			for (int k = 0; k < sizes.size(); k++) {
+				MicroConfig cfg = { 0, 0, 0 };
+				if (sscanf(sizes[k].c_str(), "%dx%d", &cfg.rows, &cfg.cols) != 2) {
+					printf("bad size %s, expected rowsxcols\n", sizes[k].c_str());
+					return 1;
+				}
+				configs.push_back(cfg);
+			}
+		}
+		else if (arg == "--ndisps") {
+			std::vector<std::string> list = SplitList(value);
+			for (int k = 0; k < list.size(); k++) {
+				ndispsList.push_back(atoi(list[k].c_str()));
+			}
+		}
+		else if (arg == "--warmup") {
+			warmup = atoi(value.c_str());
+		}
+		else if (arg == "--reps") {
+			reps = std::max(1, atoi(value.c_str()));
+		}
+		else if (arg == "--threads") {
+			omp_set_num_threads(atoi(value.c_str()));
+		}
+		else if (arg == "--pin") {
+			pin = atoi(value.c_str());
+		}
+		else if (arg == "--out") {
+			outPath = value;
+		}
+		else {
+			printf("unknown option %s\n", arg.c_str());
+			return 1;
+		}
+	}
+	if (configs.empty()) {
+		MicroConfig small = { 120, 160, 0 }, large = { 240, 320, 0 };
+		configs.push_back(small);
+		configs.push_back(large);
+	}
+	if (ndispsList.empty()) {
+		ndispsList.push_back(16);
+		ndispsList.push_back(64);
+	}
+	if (pin >= 0) {
+		// A pinned run measures one core, so the kernels run single-threaded.
+		if (!PinToCore(pin)) {
+			printf("cannot pin to core %d\n", pin);
+			return 1;
+		}
+		omp_set_num_threads(1);
+	}
+
+	FILE *fout = NULL;
+	if (!outPath.empty()) {
+		fout = fopen(outPath.c_str(), "w");
+		if (fout == NULL) {
+			printf("cannot open %s for writing.\n", outPath.c_str());
+			return 1;
+		}
+		fprintf(fout, "kernel,variant,rows,cols,ndisps,patch_w,threads,median_ms,p10_ms,p90_ms,min_ms,throughput,unit,speedup\n");
+	}
+
+	printf("patch_w = %d, threads = %d, warmup = %d, reps = %d%s\n", patch_w, omp_get_max_threads(), warmup, reps, pin >= 0 ? ", pinned" : "");
+	printf("%-28s %-10s %9s %6s %10s %10s %10s %14s %8s\n", "kernel", "variant", "size", "ndisps", "median_ms", "p10_ms", "p90_ms", "throughput/s", "speedup");
+
+	for (int c = 0; c < configs.size(); c++) {
+		for (int n = 0; n < ndispsList.size(); n++) {
+			MicroConfig cfg = configs[c];
+			cfg.ndisps = ndispsList[n];
+			SetGlobals(cfg);
+
+			const char *referenceKernel = "";
+			double referenceMedian = 0;
+			for (int k = 0; k < nMicroKernels; k++) {
+				const MicroKernel& mk = microKernels[k];
+				if (!Selected(kernels, mk.kernel) || !Selected(variants, mk.variant)) {
+					continue;
+				}
+
+				MicroCase *mc = mk.create(cfg);
+				for (int i = 0; i < warmup; i++) {
+					mc->Run();
+				}
+				std::vector<double> times(reps);
+				for (int i = 0; i < reps; i++) {
+					double start = omp_get_wtime();
+					mc->Run();
+					times[i] = omp_get_wtime() - start;
+				}
+				std::sort(times.begin(), times.end());
+				double median = Percentile(times, 0.5);
+
+				// The first selected variant of a kernel is the reference of the others.
+				if (strcmp(referenceKernel, mk.kernel) != 0) {
+					referenceKernel = mk.kernel;
+					referenceMedian = median;
+				}
+				double speedup = referenceMedian / median;
+				double throughput = mc->work / median;
+
+				char size[32];
+				sprintf(size, "%dx%d", cfg.rows, cfg.cols);
+				printf("%-28s %-10s %9s %6d %10.3f %10.3f %10.3f %10.3g %-3s %8.2f\n", mk.kernel, mk.variant, size, cfg.ndisps,
+					median * 1e3, Percentile(times, 0.1) * 1e3, Percentile(times, 0.9) * 1e3, throughput, mk.unit, speedup);
+				if (fout) {
+					fprintf(fout, "%s,%s,%d,%d,%d,%d,%d,%.4f,%.4f,%.4f,%.4f,%.6g,%s,%.3f\n", mk.kernel, mk.variant, cfg.rows, cfg.cols,
+						cfg.ndisps, patch_w, omp_get_max_threads(), median * 1e3, Percentile(times, 0.1) * 1e3, Percentile(times, 0.9) * 1e3,
+						times[0] * 1e3, throughput, mk.unit, speedup);
+				}
+				delete mc;
+			}
+		}
+	}
+
+	if (fout) {
+		fclose(fout);
+	}
+	return 0;
+}
@@ -0,0 +1,364 @@
+#include <cstdio>
+#include <cassert>
+#include <cstdlib>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <vector>
+#include <stack>
+#include <memory>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <Eigen/SparseCore>
+#include <Eigen/SparseCholesky>
+
+#include <omp.h>
+#include "Utilities.h"
+#include "Multigrid.h"
+
+
+extern int nrows, ncols;
+
+// The second-order stencil couples pixels two apart along each axis, so plain red-black
+// ordering does not decouple it. Colouring by (x + 3y) mod 5 gives every neighbour
+// (+-1, +-2 horizontally, +-1, +-2 vertically) a different colour than the centre pixel,
+// so all pixels of one colour can be relaxed in parallel.
+#define MG_NCOLORS			5
+#define MG_PRE_SMOOTH		2
+#define MG_POST_SMOOTH		2
+#define MG_MAX_CYCLES		30
+#define MG_TOLERANCE		1e-4
+#define MG_COARSEST_SIZE	1024
+
+
+typedef Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>> CoarseSolver;
+
+static void AllocateBuffers(MGLevel& L)
+{
+	L.u.assign(L.h * L.w, 0.f);
+	L.b.assign(L.h * L.w, 0.f);
+	L.r.assign(L.h * L.w, 0.f);
+}
+
+static void CoarsenLevel(MGLevel& F, MGLevel& C)
+{
+	// Rediscretize the operator on a grid of twice the spacing. The weights are averaged over
+	// the 2x2 children. With averaging restriction the coarse operator has to represent
+	// R*A*P, and the unscaled second difference on spacing 2h is 4 times larger than on h,
+	// hence the factor 1/16 for the squared term. The theta*I term is unchanged.
+	C.h = (F.h + 1) / 2;
+	C.w = (F.w + 1) / 2;
+	C.wx.assign(C.h * C.w, 0.f);
+	C.wy.assign(C.h * C.w, 0.f);
+
+	for (int Y = 0; Y < C.h; Y++) {
+		for (int X = 0; X < C.w; X++) {
+			float sx = 0, sy = 0;
+			int cnt = 0;
+			for (int y = 2 * Y; y < std::min(2 * Y + 2, F.h); y++) {
+				for (int x = 2 * X; x < std::min(2 * X + 2, F.w); x++) {
+					sx += F.wx[y * F.w + x];
+					sy += F.wy[y * F.w + x];
+					cnt++;
+				}
+			}
+			if (X > 0 && X < C.w - 1) {
+				C.wx[Y * C.w + X] = sx / cnt / 16.f;
+			}
+			if (Y > 0 && Y < C.h - 1) {
+				C.wy[Y * C.w + X] = sy / cnt / 16.f;
+			}
+		}
+	}
+	AllocateBuffers(C);
+}
+
+void PrecomputeMultigridHierarchy(cv::Mat& img, MGHierarchy& mg)
+{
+	void ComputeSecondOrderWeights(cv::Mat& cvImg, VECBITMAP<float>& wLR, VECBITMAP<float>& wUD);
+
+	VECBITMAP<float> wLR(nrows, ncols), wUD(nrows, ncols);
+	ComputeSecondOrderWeights(img, wLR, wUD);
+
+	// The levels of a hierarchy of the same size are overwritten in place, the vectors keep their storage.
+	if (mg.levels.empty() || mg.levels[0].h != nrows || mg.levels[0].w != ncols) {
+		mg = MGHierarchy();
+		mg.levels.resize(1);
+	}
+	int nlevels = 1;
+	MGLevel& fine = mg.levels[0];
+	fine.h = nrows;
+	fine.w = ncols;
+	fine.wx.assign(wLR.data, wLR.data + nrows * ncols);
+	fine.wy.assign(wUD.data, wUD.data + nrows * ncols);
+	AllocateBuffers(fine);
+
+	while (mg.levels[nlevels - 1].h * mg.levels[nlevels - 1].w > MG_COARSEST_SIZE
+		&& std::min(mg.levels[nlevels - 1].h, mg.levels[nlevels - 1].w) >= 6) {
+		if (nlevels == mg.levels.size()) {
+			mg.levels.push_back(MGLevel());
+		}
+		CoarsenLevel(mg.levels[nlevels - 1], mg.levels[nlevels]);
+		nlevels++;
+	}
+	mg.levels.resize(nlevels);
+
+	printf("multigrid levels: %d, coarsest grid %dx%d\n",
+		(int)mg.levels.size(), mg.levels.back().h, mg.levels.back().w);
+}
+
+MGHierarchy PrecomputeMultigridHierarchy(cv::Mat& img)
+{
+	MGHierarchy mg;
+	PrecomputeMultigridHierarchy(img, mg);
+	return mg;
+}
+
+long long MultigridBytes(const MGHierarchy& mg)
+{
+	long long floats = 0;
+	for (int i = 0; i < mg.levels.size(); i++) {
+		const MGLevel& L = mg.levels[i];
+		floats += L.wx.size() + L.wy.size() + L.u.size() + L.b.size() + L.r.size();
+	}
+	return floats * sizeof(float);
+}
+
+inline float ApplyOperator(MGLevel& L, float *u, int y, int x, float theta)
+{
+	// (L1'W1L1 u)_j = sum over i in {j-1, j, j+1} of L1(i, j) * w_i * (2u_i - u_{i-1} - u_{i+1}),
+	// where only rows i with a complete stencil exist. Same for the vertical term.
+	const int w = L.w, h = L.h, j = y * w + x;
+	const float *wx = &L.wx[0], *wy = &L.wy[0];
+	float Au = theta * u[j];
+
+	if (x > 0 && x < w - 1)	Au += 2 * wx[j] * (2 * u[j] - u[j - 1] - u[j + 1]);
+	if (x > 1)				Au -= wx[j - 1] * (2 * u[j - 1] - u[j - 2] - u[j]);
+	if (x < w - 2)			Au -= wx[j + 1] * (2 * u[j + 1] - u[j] - u[j + 2]);
+
+	if (y > 0 && y < h - 1)	Au += 2 * wy[j] * (2 * u[j] - u[j - w] - u[j + w]);
+	if (y > 1)				Au -= wy[j - w] * (2 * u[j - w] - u[j - 2 * w] - u[j]);
+	if (y < h - 2)			Au -= wy[j + w] * (2 * u[j + w] - u[j] - u[j + 2 * w]);
+
+	return Au;
+}
+
+inline float OperatorDiagonal(MGLevel& L, int y, int x, float theta)
+{
+	const int w = L.w, h = L.h, j = y * w + x;
+	float diag = theta + 4 * L.wx[j] + 4 * L.wy[j];
+	if (x > 0)		diag += L.wx[j - 1];
+	if (x < w - 1)	diag += L.wx[j + 1];
+	if (y > 0)		diag += L.wy[j - w];
+	if (y < h - 1)	diag += L.wy[j + w];
+	return diag;
+}
+
+static void Smooth(MGLevel& L, float theta, int nsweeps)
+{
+	float *u = &L.u[0], *b = &L.b[0];
+	for (int sweep = 0; sweep < nsweeps; sweep++) {
+		for (int color = 0; color < MG_NCOLORS; color++) {
+			#pragma omp parallel for
+			for (int y = 0; y < L.h; y++) {
+				// first x on this row with (x + 3y) % 5 == color
+				int x0 = ((color - 3 * y) % MG_NCOLORS + MG_NCOLORS) % MG_NCOLORS;
+				for (int x = x0; x < L.w; x += MG_NCOLORS) {
+					int j = y * L.w + x;
+					float Au = ApplyOperator(L, u, y, x, theta);
+					u[j] += (b[j] - Au) / OperatorDiagonal(L, y, x, theta);
+				}
+			}
+		}
+	}
+}
+
+static double ComputeResidual(MGLevel& L, float theta)
+{
+	float *u = &L.u[0], *b = &L.b[0], *r = &L.r[0];
+	double rnorm = 0;
+	#pragma omp parallel for reduction(+:rnorm)
+	for (int y = 0; y < L.h; y++) {
+		for (int x = 0; x < L.w; x++) {
+			int j = y * L.w + x;
+			r[j] = b[j] - ApplyOperator(L, u, y, x, theta);
+			rnorm += (double)r[j] * r[j];
+		}
+	}
+	return sqrt(rnorm);
+}
+
+static void Restrict(MGLevel& F, MGLevel& C)
+{
+	// Average the fine residual over the 2x2 children.
+	#pragma omp parallel for
+	for (int Y = 0; Y < C.h; Y++) {
+		for (int X = 0; X < C.w; X++) {
+			float sum = 0;
+			int cnt = 0;
+			for (int y = 2 * Y; y < std::min(2 * Y + 2, F.h); y++) {
+				for (int x = 2 * X; x < std::min(2 * X + 2, F.w); x++) {
+					sum += F.r[y * F.w + x];
+					cnt++;
+				}
+			}
+			C.b[Y * C.w + X] = sum / cnt;
+			C.u[Y * C.w + X] = 0.f;
+		}
+	}
+}
+
+static void ProlongAndCorrect(MGLevel& C, MGLevel& F)
+{
+	// Bilinear interpolation between cell centres.
+	#pragma omp parallel for
+	for (int y = 0; y < F.h; y++) {
+		float fy = (y + 0.5f) / 2.f - 0.5f;
+		int Y0 = (int)floor(fy);
+		float ty = fy - Y0;
+		int Y1 = std::min(Y0 + 1, C.h - 1);
+		Y0 = std::max(Y0, 0);
+		for (int x = 0; x < F.w; x++) {
+			float fx = (x + 0.5f) / 2.f - 0.5f;
+			int X0 = (int)floor(fx);
+			float tx = fx - X0;
+			int X1 = std::min(X0 + 1, C.w - 1);
+			X0 = std::max(X0, 0);
+			float e = (1 - ty) * ((1 - tx) * C.u[Y0 * C.w + X0] + tx * C.u[Y0 * C.w + X1])
+				+ ty * ((1 - tx) * C.u[Y1 * C.w + X0] + tx * C.u[Y1 * C.w + X1]);
+			F.u[y * F.w + x] += e;
+		}
+	}
+}
+
+// The sparsity pattern of the coarsest system only depends on the size of the grid, so its
+// symbolic analysis is reused for every theta and every image of a size.
+static std::unique_ptr<CoarseSolver> keptCoarseSolver;
+static int analyzedH = -1, analyzedW = -1;
+
+void ReleaseMultigridCaches()
+{
+	keptCoarseSolver.reset();
+	analyzedH = -1;
+	analyzedW = -1;
+}
+
+static void FactorizeCoarsest(MGLevel& L, float theta, CoarseSolver& solver)
+{
+	// The coarsest grid is small enough for a direct solve. This also takes care of the
+	// near-null space of the second-order operator (affine functions), which relaxation
+	// cannot reduce when theta is small.
+	const int N = L.h * L.w;
+	const int w = L.w;
+	std::vector<Eigen::Triplet<double>> coefficients;
+	coefficients.reserve(19 * N);
+	for (int y = 0, i = 0; y < L.h; y++) {
+		for (int x = 0; x < L.w; x++, i++) {
+			coefficients.push_back(Eigen::Triplet<double>(i, i, theta));
+			if (x > 0 && x < L.w - 1) {
+				int idx[3] = { i - 1, i, i + 1 };
+				double c[3] = { -1, 2, -1 };
+				for (int k = 0; k < 3; k++)
+					for (int l = 0; l < 3; l++)
+						coefficients.push_back(Eigen::Triplet<double>(idx[k], idx[l], L.wx[i] * c[k] * c[l]));
+			}
+			if (y > 0 && y < L.h - 1) {
+				int idx[3] = { i - w, i, i + w };
+				double c[3] = { -1, 2, -1 };
+				for (int k = 0; k < 3; k++)
+					for (int l = 0; l < 3; l++)
+						coefficients.push_back(Eigen::Triplet<double>(idx[k], idx[l], L.wy[i] * c[k] * c[l]));
+			}
+		}
+	}
+	Eigen::SparseMatrix<double> A(N, N);
+	A.setFromTriplets(coefficients.begin(), coefficients.end());
+	if (L.h != analyzedH || L.w != analyzedW) {
+		solver.analyzePattern(A);
+		analyzedH = L.h;
+		analyzedW = L.w;
+	}
+	solver.factorize(A);
+}
+
+static void SolveCoarsest(MGLevel& L, CoarseSolver& solver)
+{
+	const int N = L.h * L.w;
+	Eigen::VectorXd b(N);
+	for (int i = 0; i < N; i++) {
+		b[i] = L.b[i];
+	}
+	Eigen::VectorXd u = solver.solve(b);
+	for (int i = 0; i < N; i++) {
+		L.u[i] = u[i];
+	}
+}
+
+static void VCycle(MGHierarchy& mg, int l, float theta, CoarseSolver& coarseSolver)
+{
+	MGLevel& L = mg.levels[l];
+	if (l + 1 == mg.levels.size()) {
+		SolveCoarsest(L, coarseSolver);
+		return;
+	}
+
+	Smooth(L, theta, MG_PRE_SMOOTH);
+	ComputeResidual(L, theta);
+	Restrict(L, mg.levels[l + 1]);
+	VCycle(mg, l + 1, theta, coarseSolver);
+	ProlongAndCorrect(mg.levels[l + 1], L);
+	Smooth(L, theta, MG_POST_SMOOTH);
+}
+
+VECBITMAP<float> SolveSecondOrderSmoothenessMG(VECBITMAP<float>& dv, float theta, MGHierarchy& mg, int ncycles)
+{
+	// Solves the same system as SolveSecondOrderSmootheness with multigrid V-cycles.
+	// If ncycles > 0, exactly ncycles V-cycles are run ("good enough" mode for early theta steps),
+	// otherwise cycles are repeated until the relative residual drops below MG_TOLERANCE.
+	assert(theta > 0);
+	const int N = nrows * ncols;
+	MGLevel& fine = mg.levels[0];
+
+	// u stays close to v, so v is a good initial guess.
+	double bnorm = 0;
+	for (int i = 0; i < N; i++) {
+		fine.b[i] = theta * dv.data[i];
+		fine.u[i] = dv.data[i];
+		bnorm += (double)fine.b[i] * fine.b[i];
+	}
+	bnorm = std::max(1e-12, sqrt(bnorm));
+
+	if (!keptCoarseSolver) {
+		keptCoarseSolver.reset(new CoarseSolver);
+		analyzedH = -1;
+		analyzedW = -1;
+	}
+	CoarseSolver& coarseSolver = *keptCoarseSolver;
+	FactorizeCoarsest(mg.levels.back(), theta, coarseSolver);
+
+	bool fixedCycles = (ncycles > 0);
+	int maxcycles = fixedCycles ? ncycles : MG_MAX_CYCLES;
+	int cycle = 0;
+	double rnorm = 0;
+	for (cycle = 0; cycle < maxcycles; cycle++) {
+		VCycle(mg, 0, theta, coarseSolver);
+		if (!fixedCycles) {
+			rnorm = ComputeResidual(fine, theta);
+			if (rnorm <= MG_TOLERANCE * bnorm) {
+				cycle++;
+				break;
+			}
+		}
+	}
+	if (!fixedCycles) {
+		printf("multigrid: %d V-cycles, relative residual %e\n", cycle, rnorm / bnorm);
+	}
+
+	VECBITMAP<float> du(nrows, ncols);
+	memcpy(du.data, &fine.u[0], N * sizeof(float));
+	return du;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <vector>
+
+
+// One level of the geometric multigrid hierarchy for the system
+// (L1'W1L1 + L2'W2L2 + theta*I) u = theta*v, where L1/L2 are the horizontal/vertical
+// second-order difference operators and W1/W2 the image-dependent weights (see PrecomputeSparseLTL).
+// The operator is never assembled; it is applied from the per-pixel weights wx, wy.
+struct MGLevel {
+	int h, w;
+	std::vector<float> wx, wy;		// second-order weights, zero where the stencil leaves the grid
+	std::vector<float> u, b, r;		// solution, right-hand side and residual buffers
+};
+
+struct MGHierarchy {
+	std::vector<MGLevel> levels;	// levels[0] is the full resolution grid
+};
+
+
+MGHierarchy PrecomputeMultigridHierarchy(cv::Mat& img);
+// Same, into mg. If mg holds the hierarchy of an image of the same size, its buffers are reused.
+void PrecomputeMultigridHierarchy(cv::Mat& img, MGHierarchy& mg);
+long long MultigridBytes(const MGHierarchy& mg);
+VECBITMAP<float> SolveSecondOrderSmoothenessMG(VECBITMAP<float>& dv, float theta, MGHierarchy& mg, int ncycles = 0);
+// Frees the factorization of the coarsest grid that SolveSecondOrderSmoothenessMG keeps between calls.
+void ReleaseMultigridCaches();
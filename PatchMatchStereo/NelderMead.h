@@ -0,0 +1,150 @@
+#pragma once
+
+#include <cassert>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+
+// Nelder-Mead simplex minimization with the dimension N fixed at compile time
+// (3 for planes, 6 for quadratic surfaces). The cost is any callable float(float*),
+// so it carries its own context and several optimizations can run concurrently.
+
+template<int N>
+struct NMPoint {
+	float cost;
+	float data[N];
+	NMPoint operator+(const NMPoint& m) const { NMPoint ret(*this); for (int i = 0; i < N; i++) { ret.data[i] += m.data[i]; } return ret; }
+	NMPoint operator-(const NMPoint& m) const { NMPoint ret(*this); for (int i = 0; i < N; i++) { ret.data[i] -= m.data[i]; } return ret; }
+	NMPoint operator*(float c) const          { NMPoint ret(*this); for (int i = 0; i < N; i++) { ret.data[i] *= c; } return ret; }
+	NMPoint operator/(float c) const          { NMPoint ret(*this); for (int i = 0; i < N; i++) { ret.data[i] /= c; } return ret; }
+	NMPoint& operator+=(const NMPoint& m)     { for (int i = 0; i < N; i++) { this->data[i] += m.data[i]; } return *this; }
+};
+
+template<int N>
+inline void ReplaceVertex(NMPoint<N> *vertices, int idx, const NMPoint<N>& item)
+{
+	// Only strictly worse vertices are moved, so equal costs are allowed.
+	vertices[idx] = item;
+	while (idx > 0 && vertices[idx - 1].cost > vertices[idx].cost) {
+		std::swap(vertices[idx - 1], vertices[idx]);
+		idx--;
+	}
+}
+
+template<int N>
+inline void ReorderVertexList(NMPoint<N> *vertices, int nitems)
+{
+	// Use simple insertion sort
+	for (int i = 1; i < nitems; i++) {
+		for (int j = i; j > 0 && vertices[j - 1].cost > vertices[j].cost; j--) {
+			std::swap(vertices[j - 1], vertices[j]);
+		}
+	}
+}
+
+template<int N>
+inline NMPoint<N> ComputeGeometricCenter(NMPoint<N> *vertices, int nitems)
+{
+	NMPoint<N> sum(vertices[0]);
+	for (int i = 1; i < nitems; i++) {
+		sum += vertices[i];
+	}
+	return sum / nitems;
+}
+
+template<int N>
+inline float SimplexDiameter(NMPoint<N> *vertices)
+{
+	// Largest coordinate difference between the best vertex and any other vertex.
+	float diam = 0;
+	for (int i = 1; i < N + 1; i++) {
+		for (int k = 0; k < N; k++) {
+			diam = std::max(diam, std::abs(vertices[i].data[k] - vertices[0].data[k]));
+		}
+	}
+	return diam;
+}
+
+// x holds the N + 1 initial vertices (N floats each) and receives the final simplex, best vertex first.
+// Stops when the cost spread of the simplex drops below ftol or the simplex shrinks below xtol.
+// Returns 0 on convergence and -1 if maxiters was reached.
+template<int N, class CostFunc>
+int NelderMeadOptimize(float *x, CostFunc& feval, int maxiters, float ftol = 1.f, float xtol = 1e-6f)
+{
+	int	retCode			= -1;
+	const float alpha	= 1;
+	const float gamma	= 2;
+	const float rho		= -0.5;
+	const float sigma	= 0.5;
+
+	NMPoint<N> xo, xr, xe, xc, xBest, xWorst;
+	NMPoint<N> vertices[N + 1];
+
+	for (int i = 0; i < N + 1; i++) {
+		memcpy(vertices[i].data, x + i * N, N * sizeof(float));
+		vertices[i].cost = feval(vertices[i].data);
+	}
+	ReorderVertexList(vertices, N + 1);
+
+	float cost_before = vertices[0].cost;
+
+	// FIXME: add bound constraints
+
+	for (int iter = 0; iter < maxiters; iter++) {
+
+		// The list is ordered now
+		xBest  = vertices[0];
+		xWorst = vertices[N];
+		if (xWorst.cost - xBest.cost < ftol || SimplexDiameter(vertices) < xtol) {
+			retCode = 0;
+			break;
+		}
+		xo = ComputeGeometricCenter(vertices, N);
+
+		// Reflection
+		xr = xo + (xo - xWorst) * alpha;
+		xr.cost = feval(xr.data);
+		if (xBest.cost <= xr.cost && xr.cost < xWorst.cost) {
+			ReplaceVertex(vertices, N, xr);
+			continue;
+		}
+
+		// Expansion
+		if (xr.cost < xBest.cost) {
+			xe = xo + (xo - xWorst) * gamma;
+			xe.cost = feval(xe.data);
+			if (xe.cost < xr.cost) {
+				ReplaceVertex(vertices, N, xe);
+			}
+			else {
+				ReplaceVertex(vertices, N, xr);
+			}
+			continue;
+		}
+
+		// Contraction
+		xc = xo + (xo - xWorst) * rho;
+		xc.cost = feval(xc.data);
+		if (xc.cost < xWorst.cost) {
+			ReplaceVertex(vertices, N, xc);
+			continue;
+		}
+
+		// Reduction
+		for (int i = 1; i < N + 1; i++) {
+			vertices[i] = xBest + (vertices[i] - xBest) * sigma;
+			vertices[i].cost = feval(vertices[i].data);
+		}
+		ReorderVertexList(vertices, N + 1);
+	}
+
+	float cost_after = vertices[0].cost;
+	assert(cost_after <= cost_before);
+
+	for (int i = 0; i < N + 1; i++) {
+		memcpy(x + i * N, vertices[i].data, N * sizeof(float));
+	}
+
+	return retCode;
+}
@@ -1,12 +1,16 @@
 
 #include <cstdlib>
 #include <cmath>
+#include <cfloat>
+#include <climits>
 #include <cstring>
 #include <ctime>
 #include <algorithm>
+#include <iterator>
 #include <vector>
 #include <stack>
 #include <list>
+#include <random>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -14,9 +18,11 @@
 
 #include <Eigen/SparseCore>
 #include <Eigen/SparseCholesky>
+#include <Eigen/Dense>
 
 #include <omp.h>
 #include "Utilities.h"
+#include "NelderMead.h"
 #include "msImageProcessor.h"
 #include "SLIC.h"
 
@@ -24,21 +30,23 @@
 extern int nrows, ncols;
 extern int g_seletedRegionId, g_OPTIMZE_TYPE;
 extern Plane g_selectedPlane;
-std::vector<std::vector<cv::Point2d>> g_regionList;
+RegionIndex g_regions;
 VECBITMAP<int> g_labelmap;
 VECBITMAP<Plane> g_coeffsL_ransac, g_coeffsL_neldermead;
 VECBITMAP<float> g_dsiL;
 
-inline double ranf()	// ranf() is uniform in 0..1
-{
-	double a = rand();
-	return a / RAND_MAX;
-}
-
 struct CurvedSegment
 {
 	std::vector<int> adjacentList;
-	std::vector<cv::Point2d> pointList;
+};
+
+// Region adjacency graph in CSR form. The neighbours of segment i are
+// neighbors[offsets[i]] .. neighbors[offsets[i + 1] - 1], sorted ascending.
+struct RegionAdjacencyGraph
+{
+	std::vector<int> offsets;
+	std::vector<int> neighbors;
+	int Degree(int i) { return offsets[i + 1] - offsets[i]; }
 };
 
 float l1_dist(const cv::Vec3b &a, const cv::Vec3b &b)
@@ -57,32 +65,13 @@ float l1_distf(const cv::Vec3f &a, const cv::Vec3f &b)
 	return l1;
 }
 
-double BoxMuller(double m, double s)	// normal random variate generator 
-{										// mean m, standard deviation s 
-	double x1, x2, w, y1;
-	static double y2;
-	static int use_last = 0;
-
-	if (use_last)										// use value from previous call 
-	{
-		y1 = y2;
-		use_last = 0;
-	}
-	else
-	{
-		do {
-			x1 = 2.0 * ranf() - 1.0;
-			x2 = 2.0 * ranf() - 1.0;
-			w = x1 * x1 + x2 * x2;
-		} while (w >= 1.0);
-
-		w = sqrt((-2.0 * log(w)) / w);
-		y1 = x1 * w;
-		y2 = x2 * w;
-		use_last = 1;
+inline float GaussianRand(float m, float s, std::mt19937& rng)	// normal random variate, mean m, standard deviation s
+{
+	if (s <= 0) {
+		return m;
 	}
-
-	return(m + y1 * s);
+	std::normal_distribution<float> dist(m, s);
+	return dist(rng);
 }
 
 struct QuadraticSurface {
@@ -90,28 +79,28 @@ struct QuadraticSurface {
 	QuadraticSurface() {}
 	QuadraticSurface(float A_, float B_, float C_, float D_, float E_, float F_)
 		: A(A_), B(B_), C(C_), D(D_), E(E_), F(F_) {}
-	void RandomPerturbTo(float *buf)
+	void RandomPerturbTo(float *buf, std::mt19937& rng)
 	{
-		buf[0] = BoxMuller(A, 0.001);
-		buf[1] = BoxMuller(B, 0.001);
-		buf[2] = BoxMuller(C, 0);
-		buf[3] = BoxMuller(D, 0.015);
-		buf[4] = BoxMuller(E, 0.015);
-		buf[5] = BoxMuller(F, 5);
-
-		//buf[0] = BoxMuller(A, 0.001);
-		//buf[1] = BoxMuller(B, 0.001);
-		//buf[2] = BoxMuller(C, 0);
-		//buf[3] = BoxMuller(D, 0.015);
-		//buf[4] = BoxMuller(E, 0.015);
-		//buf[5] = BoxMuller(F, 2);
-
-		//buf[0] = BoxMuller(A, 0.00);
-		//buf[1] = BoxMuller(B, 0.00);
-		//buf[2] = BoxMuller(C, 0.00);
-		//buf[3] = BoxMuller(D, 0.00);
-		//buf[4] = BoxMuller(E, 0.00);
-		//buf[5] = BoxMuller(F, 0.00);
+		buf[0] = GaussianRand(A, 0.001, rng);
+		buf[1] = GaussianRand(B, 0.001, rng);
+		buf[2] = GaussianRand(C, 0, rng);
+		buf[3] = GaussianRand(D, 0.015, rng);
+		buf[4] = GaussianRand(E, 0.015, rng);
+		buf[5] = GaussianRand(F, 5, rng);
+
+		//buf[0] = GaussianRand(A, 0.001, rng);
+		//buf[1] = GaussianRand(B, 0.001, rng);
+		//buf[2] = GaussianRand(C, 0, rng);
+		//buf[3] = GaussianRand(D, 0.015, rng);
+		//buf[4] = GaussianRand(E, 0.015, rng);
+		//buf[5] = GaussianRand(F, 2, rng);
+
+		//buf[0] = GaussianRand(A, 0.00, rng);
+		//buf[1] = GaussianRand(B, 0.00, rng);
+		//buf[2] = GaussianRand(C, 0.00, rng);
+		//buf[3] = GaussianRand(D, 0.00, rng);
+		//buf[4] = GaussianRand(E, 0.00, rng);
+		//buf[5] = GaussianRand(F, 0.00, rng);
 	}
 	void SetFromArray(float *arr) {
 		A = arr[0];
@@ -136,8 +125,10 @@ struct QuadraticSurface {
 	}
 };
 
-int meanShiftSegmentation(const cv::Mat &img, const float colorRadius, const int spatialRadius, const int minRegion, cv::Mat& result)
+int meanShiftSegmentation(const cv::Mat &img, const float colorRadius, const int spatialRadius, const int minRegion, cv::Mat& result,
+	SpeedUpLevel speedUpLevel)
 {
+	// speedUpLevel trades accuracy for time, see msImageProcessor::Filter. All levels run on all cores.
 	const int width = img.cols, height = img.rows;
 	cv::Mat rgb;
 	cv::cvtColor(img, rgb, cv::COLOR_BGR2RGB);
@@ -149,7 +140,7 @@ int meanShiftSegmentation(const cv::Mat &img, const float colorRadius, const int
 		return -1;
 	}
 
-	ms.Filter(spatialRadius, colorRadius, NO_SPEEDUP);
+	ms.Filter(spatialRadius, colorRadius, speedUpLevel);
 	ms.FuseRegions(colorRadius, minRegion);
 	if (ms.ErrorStatus)
 	{
@@ -201,7 +192,7 @@ int slicSegmentation(const cv::Mat &img, const int numPreferedRegions, const int
 	int		k = numPreferedRegions;	// Desired number of superpixels.
 	double	m = compactness;		// Compactness factor. use a value ranging from 10 to 40 depending on your needs. Default is 10
 	SLIC segment;
-	segment.DoSuperpixelSegmentation_ForGivenNumberOfSuperpixels(pbuff, width, height, klabels, numlabels, k, m);
+	segment.DoSuperpixelSegmentation_ForGivenNumberOfSuperpixels_Parallel(pbuff, width, height, klabels, numlabels, k, m);
 	//segment.DrawContoursAroundSegments(pbuff, klabels, width, height, 0xff0000);
 	VECBITMAP<int> labelmap(nrows, ncols, 1, klabels);
 
@@ -230,100 +221,293 @@ int slicSegmentation(const cv::Mat &img, const int numPreferedRegions, const int
 
 inline bool InBound(float y, float x) { return 0 <= y && y < nrows && 0 <= x && x < ncols; }
 
-int FromSegmentMapToLabelMap(cv::Mat& segmap, VECBITMAP<int>& labelmap)
+inline int FindRoot(int *parent, int i)
+{
+	while (parent[i] != i) {
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
+}
+
+inline void UnionRoots(int *parent, int i, int j)
 {
-	const int dx[] = { -1, 0, +1, 0 };
-	const int dy[] = { 0, -1, 0, +1 };
+	// The smaller pixel index becomes the root, so every root is the first pixel
+	// of its region in raster order.
+	i = FindRoot(parent, i);
+	j = FindRoot(parent, j);
+	if (i < j)		parent[j] = i;
+	else if (j < i)	parent[i] = j;
+}
 
-	VECBITMAP<bool> visited(nrows, ncols);
-	memset(visited.data, 0, nrows * ncols * sizeof(bool));
-	int label = -1;
-	std::stack<cv::Point2d> stack;
+int FromSegmentMapToLabelMap(cv::Mat& segmap, VECBITMAP<int>& labelmap, RegionIndex& regions)
+{
+	// Two-pass union-find labelling of the 4-connected regions of equal color.
+	// Rows are split into one strip per thread, labelled independently and merged at the strip borders.
+	// Labels are numbered in raster order of first appearance, same as a serial flood fill.
+	// The pixels of each region are emitted as scanline runs in the same pass.
+	const int npixels = nrows * ncols;
+	int nthreads = std::max(1, std::min(omp_get_max_threads(), nrows));
+	std::vector<int> stripBegin(nthreads + 1);
+	for (int t = 0; t <= nthreads; t++) {
+		stripBegin[t] = (long long)nrows * t / nthreads;
+	}
 
-	for (int y = 0; y < nrows; y++) {
+	VECBITMAP<int> color(nrows, ncols);
+	std::vector<int> parent(npixels);
+
+	#pragma omp parallel for schedule(static, 1)
+	for (int t = 0; t < nthreads; t++) {
+		for (int y = stripBegin[t]; y < stripBegin[t + 1]; y++) {
+			for (int x = 0; x < ncols; x++) {
+				const cv::Vec3b &c = segmap.at<cv::Vec3b>(y, x);
+				color[y][x] = c[0] | (c[1] << 8) | (c[2] << 16);
+				int i = y * ncols + x;
+				parent[i] = i;
+				if (x > 0 && color[y][x - 1] == color[y][x]) {
+					UnionRoots(&parent[0], i, i - 1);
+				}
+				if (y > stripBegin[t] && color[y - 1][x] == color[y][x]) {
+					UnionRoots(&parent[0], i, i - ncols);
+				}
+			}
+		}
+	}
+
+	for (int t = 1; t < nthreads; t++) {
+		int y = stripBegin[t];
 		for (int x = 0; x < ncols; x++) {
-			if (!visited[y][x]) {
-				label++;
-				stack.push(cv::Point2d(x, y));
-				
-				while (!stack.empty()) {
-					cv::Point2d c = stack.top();
-					stack.pop();
-					int yc = c.y;
-					int xc = c.x;
-					labelmap[yc][xc] = label;
-					visited[yc][xc] = true;
-					for (int dir = 0; dir < 4; dir++) {
-						int new_x = xc + dx[dir];
-						int new_y = yc + dy[dir];
-						if (InBound(new_y, new_x) && !visited[new_y][new_x] && segmap.at<cv::Vec3b>(new_y, new_x) == segmap.at<cv::Vec3b>(yc, xc)) {
-							stack.push(cv::Point2d(new_x, new_y));
-						}
-					}
+			if (color[y - 1][x] == color[y][x]) {
+				UnionRoots(&parent[0], y * ncols + x, (y - 1) * ncols + x);
+			}
+		}
+	}
+
+	// Number the roots in raster order, then resolve every pixel to its root's label
+	std::vector<int> rootLabel(npixels);
+	int nlabels = 0;
+	for (int i = 0; i < npixels; i++) {
+		if (parent[i] == i) {
+			rootLabel[i] = nlabels++;
+		}
+	}
+
+	// Resolve every pixel to its root's label, counting the runs each strip contributes to each region.
+	// A strip only keeps (label, count) pairs of the labels it contains, sorted by label.
+	std::vector<std::vector<std::pair<int, int>>> localRuns(nthreads);
+	#pragma omp parallel for schedule(static, 1)
+	for (int t = 0; t < nthreads; t++) {
+		std::vector<int> runLabels;
+		for (int y = stripBegin[t]; y < stripBegin[t + 1]; y++) {
+			for (int x = 0; x < ncols; x++) {
+				int r = y * ncols + x;
+				while (parent[r] != r) {
+					r = parent[r];
+				}
+				int label = rootLabel[r];
+				labelmap[y][x] = label;
+				if (x == 0 || labelmap[y][x - 1] != label) {
+					runLabels.push_back(label);
 				}
 			}
 		}
+		std::sort(runLabels.begin(), runLabels.end());
+		for (int k = 0; k < runLabels.size(); k++) {
+			if (localRuns[t].empty() || localRuns[t].back().first != runLabels[k]) {
+				localRuns[t].push_back(std::make_pair(runLabels[k], 0));
+			}
+			localRuns[t].back().second++;
+		}
 	}
 
-	return label + 1;
+	// Each strip fills its slice of every region's runs, which keeps them in raster order
+	regions.runOffsets.assign(nlabels + 1, 0);
+	for (int t = 0; t < nthreads; t++) {
+		for (int k = 0; k < localRuns[t].size(); k++) {
+			regions.runOffsets[localRuns[t][k].first + 1] += localRuns[t][k].second;
+		}
+	}
+	for (int l = 0; l < nlabels; l++) {
+		regions.runOffsets[l + 1] += regions.runOffsets[l];
+	}
+	std::vector<int> nextRun(regions.runOffsets.begin(), regions.runOffsets.end() - 1);
+	for (int t = 0; t < nthreads; t++) {
+		for (int k = 0; k < localRuns[t].size(); k++) {
+			int n = localRuns[t][k].second;
+			localRuns[t][k].second = nextRun[localRuns[t][k].first];
+			nextRun[localRuns[t][k].first] += n;
+		}
+	}
+	regions.runs.resize(regions.runOffsets[nlabels]);
+
+	#pragma omp parallel for schedule(static, 1)
+	for (int t = 0; t < nthreads; t++) {
+		for (int y = stripBegin[t]; y < stripBegin[t + 1]; y++) {
+			for (int x = 0; x < ncols;) {
+				int label = labelmap[y][x];
+				std::vector<std::pair<int, int>>::iterator slot =
+					std::lower_bound(localRuns[t].begin(), localRuns[t].end(), std::make_pair(label, INT_MIN));
+				RegionRun &run = regions.runs[slot->second++];
+				run.y = y;
+				run.x0 = x;
+				while (x < ncols && labelmap[y][x] == label) {
+					x++;
+				}
+				run.x1 = x;
+			}
+		}
+	}
+
+	regions.pixelOffsets.assign(nlabels + 1, 0);
+	for (int l = 0; l < nlabels; l++) {
+		int size = 0;
+		for (RegionRun *r = regions.RunsBegin(l); r != regions.RunsEnd(l); r++) {
+			r->start = size;
+			size += r->x1 - r->x0;
+		}
+		regions.pixelOffsets[l + 1] = regions.pixelOffsets[l] + size;
+	}
+
+	return nlabels;
 }
 
-void RandomPermute(std::vector<cv::Point2d>& pointList, int k)
+// Segment cost kernels. Along a horizontal run the disparity is stepped incrementally from block to block,
+// and each block of COST_KERNEL_LANES pixels is evaluated in fixed-size loops the compiler can vectorize.
+// The cost vectors of consecutive pixels in a run are adjacent in the dsi, so the lookups are nearly sequential.
+#define COST_KERNEL_LANES	8
+
+inline float BlockDataCost(const float *d, const float *costs, int nlevels, int m)
 {
-	int n = pointList.size();
-	for (int i = 0; i < k; i++) {
-		int j = rand() % n;
-		std::swap(pointList[i], pointList[j]);
+	// d holds the disparities of the block, costs points to the dsi entry of its first pixel.
+	// Only the first m lanes are inside the run.
+	int level[COST_KERNEL_LANES];
+	bool valid[COST_KERNEL_LANES];
+	for (int k = 0; k < COST_KERNEL_LANES; k++) {
+		valid[k] = (d[k] >= 0 && d[k] <= dmax);
+		level[k] = (valid[k] ? d[k] : 0.f) / granularity + 0.5f;
 	}
+	float cost = 0;
+	for (int k = 0; k < m; k++) {
+		cost += valid[k] ? costs[k * nlevels + level[k]] : BAD_PLANE_PENALTY;
+	}
+	return cost;
 }
 
-double ComputePlaneCost(Plane& coeff, VECBITMAP<float>& dsi, std::vector<cv::Point2d>& pointList)
+double ComputePlaneCost(Plane& coeff, VECBITMAP<float>& dsi, RegionIndex& regions, int id)
 {
 	double cost = 0;
-	int regionSize = pointList.size();
-	for (int i = 0; i < regionSize; i++) {
-		int y = pointList[i].y;
-		int x = pointList[i].x;
-		float d = coeff.a * x + coeff.b * y + coeff.c;
-		int level = d / granularity + 0.5;
-		if (d < 0 || d > dmax) {
-			cost += BAD_PLANE_PENALTY;
-		}
-		else {
-			cost += dsi.get(y, x)[level];
+	float d[COST_KERNEL_LANES];
+	for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+		const int len = r->x1 - r->x0;
+		const float *costs = dsi.get(r->y, r->x0);
+		double db = coeff.a * r->x0 + coeff.b * r->y + coeff.c;		// disparity at the start of the block
+		for (int k0 = 0; k0 < len; k0 += COST_KERNEL_LANES) {
+			float fdb = db, a = coeff.a;
+			for (int k = 0; k < COST_KERNEL_LANES; k++) {
+				d[k] = fdb + a * k;
+			}
+			cost += BlockDataCost(d, costs + k0 * dsi.n, dsi.n, std::min(COST_KERNEL_LANES, len - k0));
+			db += COST_KERNEL_LANES * coeff.a;
 		}
 	}
 	return cost;
 }
 
-struct NM_OPT_PARAM {
-	float x0, y0;
-	VECBITMAP<float> *dsi;
-	VECBITMAP<float> *disp;
-	std::vector<cv::Point2d> *pointList;
-	Eigen::SparseMatrix<double> *L;
+struct SmoothCostCache
+{
+	// Keeps v = L*u and sum |v| of the current disparity map u. Changing u on one segment only
+	// changes the rows of L that have a nonzero in a segment column (the segment and its one-pixel
+	// border), so the smoothness cost of a candidate can be evaluated in O(segment size).
+	Eigen::SparseMatrix<double> Lcol;						// to find the rows touched by a pixel
+	Eigen::SparseMatrix<double, Eigen::RowMajor> Lrow;		// to evaluate a single row
+	std::vector<double> Lu;
+	double total;
+	std::vector<int> rows;			// rows touched by the current segment
+	std::vector<bool> marked;
+
+	SmoothCostCache(Eigen::SparseMatrix<double>& L) : Lcol(L), Lrow(L), total(0)
+	{
+		Lu.assign(L.rows(), 0);
+		marked.assign(L.rows(), false);
+	}
+	double RowDot(int i, VECBITMAP<float>& disp)
+	{
+		double v = 0;
+		for (Eigen::SparseMatrix<double, Eigen::RowMajor>::InnerIterator it(Lrow, i); it; ++it) {
+			v += it.value() * disp.data[it.col()];
+		}
+		return v;
+	}
+	void Update(VECBITMAP<float>& disp)
+	{
+		// Full recomputation, needed whenever disp changed outside the current segment.
+		total = 0;
+		for (int i = 0; i < Lrow.rows(); i++) {
+			Lu[i] = RowDot(i, disp);
+			total += fabs(Lu[i]);
+		}
+	}
+	void SetSegment(RegionIndex& regions, int id)
+	{
+		rows.clear();
+		for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+			for (int j = r->y * ncols + r->x0; j < r->y * ncols + r->x1; j++) {
+				for (Eigen::SparseMatrix<double>::InnerIterator it(Lcol, j); it; ++it) {
+					if (!marked[it.row()]) {
+						marked[it.row()] = true;
+						rows.push_back(it.row());
+					}
+				}
+			}
+		}
+		for (int k = 0; k < rows.size(); k++) {
+			marked[rows[k]] = false;
+		}
+	}
+	double Evaluate(VECBITMAP<float>& disp)
+	{
+		// Smoothness cost of disp, assuming it differs from the cached state only on the current segment.
+		double cost = total;
+		for (int k = 0; k < rows.size(); k++) {
+			int i = rows[k];
+			cost += fabs(RowDot(i, disp)) - fabs(Lu[i]);
+		}
+		return cost;
+	}
+	void Commit(VECBITMAP<float>& disp)
+	{
+		for (int k = 0; k < rows.size(); k++) {
+			int i = rows[k];
+			double v = RowDot(i, disp);
+			total += fabs(v) - fabs(Lu[i]);
+			Lu[i] = v;
+		}
+	}
 };
-NM_OPT_PARAM nm_opt_struct;
 
-double ComputeQuadraticSurfaceCost(QuadraticSurface& coeff, VECBITMAP<float>& dsi, std::vector<cv::Point2d>& pointList)
+double ComputeQuadraticSurfaceCost(QuadraticSurface& coeff, VECBITMAP<float>& dsi, RegionIndex& regions, int id, int x0, int y0)
 {
+	// The surface is centralized at (x0, y0). Along a run y is fixed, so
+	// d(x) = A*x^2 + (C*y + D)*x + (B*y^2 + E*y + F) is stepped with forward differences:
+	// d(x + k) = d(x) + k*(s(x) + A*k), with slope s(x) = 2*A*x + C*y + D.
+	const int L = COST_KERNEL_LANES;
 	double cost = 0;
-	int regionSize = pointList.size();
-	int x0 = nm_opt_struct.x0;
-	int y0 = nm_opt_struct.y0;
-	//printf("regionSize = %d\n", regionSize);
-	for (int i = 0; i < regionSize; i++) {
-		int y = pointList[i].y;
-		int x = pointList[i].x;
-		float d = coeff.A * x * x + coeff.B * y * y + coeff.C * x * y
-		        + coeff.D * x     + coeff.E * y     + coeff.F;
-		int level = d / granularity + 0.5;
-		//printf("(%d, %d)   i = %d   d = %f   level = %d\n", y, x, i, d, level);
-		if (d < 0 || d > dmax) {
-			cost += BAD_PLANE_PENALTY;
-		}
-		else {
-			cost += dsi.get(y + y0, x + x0)[level];
+	float d[COST_KERNEL_LANES];
+	for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+		const int len = r->x1 - r->x0;
+		const float *costs = dsi.get(r->y, r->x0);
+		double y = r->y - y0, x = r->x0 - x0;
+		double lin = coeff.C * y + coeff.D;
+		double db = (coeff.A * x + lin) * x + (coeff.B * y + coeff.E) * y + coeff.F;
+		double sb = 2 * coeff.A * x + lin;
+		for (int k0 = 0; k0 < len; k0 += L) {
+			float fdb = db, fsb = sb, A = coeff.A;
+			for (int k = 0; k < L; k++) {
+				d[k] = fdb + k * (fsb + A * k);
+			}
+			cost += BlockDataCost(d, costs + k0 * dsi.n, dsi.n, std::min(L, len - k0));
+			db += L * (sb + coeff.A * L);
+			sb += 2 * coeff.A * L;
 		}
 	}
 	return cost;
@@ -363,36 +547,43 @@ double ComputeSmoothCost(Eigen::SparseMatrix<double>& L, VECBITMAP<float>& disp)
 	return smoothness;
 }
 
-inline float nm_compute_plane_cost(float *abc, int n = 3)
-{
-	Plane coeff;
-	coeff.SetAbc(abc);
-	return ComputePlaneCost(coeff, *nm_opt_struct.dsi, *nm_opt_struct.pointList);
-}
+// Cost functions for NelderMeadOptimize<N>. Each one carries its own context,
+// so different segments can be optimized in parallel.
+struct NMPlaneCost {
+	VECBITMAP<float> *dsi;
+	RegionIndex *regions;
+	int id;
+	float operator()(float *abc)
+	{
+		Plane coeff;
+		coeff.SetAbc(abc);
+		return ComputePlaneCost(coeff, *dsi, *regions, id);
+	}
+};
 
-inline float nm_compute_quadratic_surface_cost(float *abcdef, int n = 6)
-{
-	const float maxPixelCost = (1.0f - alpha) * tau_col + alpha * tau_grad;
-	float lambda = 2.0f * maxPixelCost / (float)dmax;
-
-	QuadraticSurface coeff;
-	coeff.SetFromArray(abcdef);
-	float dataCost = ComputeQuadraticSurfaceCost(coeff, *nm_opt_struct.dsi, *nm_opt_struct.pointList);
-	return dataCost;
-
-	//Eigen::SparseMatrix<double>& L = *nm_opt_struct.L;
-	//VECBITMAP<float> &disp = *nm_opt_struct.disp;
-	//std::vector<cv::Point2d>& pointList = *nm_opt_struct.pointList;
-	//int x0 = nm_opt_struct.x0, y0 = nm_opt_struct.y0;
-	//for (int i = 0; i < pointList.size(); i++) {
-	//	int y = pointList[i].y, x = pointList[i].x;
-	//	float d = coeff.A * x * x + coeff.B * y * y + coeff.C * x * y
-	//		+ coeff.D * x + coeff.E * y + coeff.F;
-	//	disp[y + y0][x + x0] = d;
-	//}
-	//float smoothCost = ComputeSmoothCost(L, disp);
-	//return dataCost + lambda * smoothCost;
-}
+struct NMQuadraticSurfaceCost {
+	VECBITMAP<float> *dsi;
+	RegionIndex *regions;
+	int id;
+	int x0, y0;		// center of the surface parametrization
+	float operator()(float *abcdef)
+	{
+		QuadraticSurface coeff;
+		coeff.SetFromArray(abcdef);
+		float dataCost = ComputeQuadraticSurfaceCost(coeff, *dsi, *regions, id, x0, y0);
+		return dataCost;
+
+		//const float maxPixelCost = (1.0f - alpha) * tau_col + alpha * tau_grad;
+		//float lambda = 2.0f * maxPixelCost / (float)dmax;
+		//for (RegionRun *r = regions->RunsBegin(id); r != regions->RunsEnd(id); r++) {
+		//	for (int x = r->x0; x < r->x1; x++) {
+		//		(*disp)[r->y][x] = coeff.ToDisparity(r->y - y0, x - x0);
+		//	}
+		//}
+		//float smoothCost = ComputeSmoothCost(*L, *disp);
+		//return dataCost + lambda * smoothCost;
+	}
+};
 
 double PixelwiseSecondOrderCost(int y, int x, VECBITMAP<float>& disp, cv::Mat& img)
 {
@@ -414,78 +605,82 @@ double PixelwiseSecondOrderCost(int y, int x, VECBITMAP<float>& disp, cv::Mat& i
 	return cost;
 }
 
-double ComputeSegmentSmoothnessCost(int id, std::vector<CurvedSegment>& segmentList, VECBITMAP<int>& labelmap, VECBITMAP<float>& disp, cv::Mat& img)
+double ComputeSegmentSmoothnessCost(int id, RegionIndex& regions, VECBITMAP<int>& labelmap, VECBITMAP<float>& disp, cv::Mat& img)
 {
-	std::vector<cv::Point2d>& pointList = segmentList[id].pointList;
-	int segmentSize = pointList.size();
 	double cost = 0;
 
-	for (int i = 0; i < segmentSize; i++) {
-		int y = pointList[i].y, x = pointList[i].x;
-		int a = labelmap[y][x];
-
-		bool isBorder = false;
-		for (int i = -1; i <= +1; i++) {
-			for (int j = -1; j <= +1; j++) {
-				//if (0 <= y + i && y + i < nrows && 0 <= x + j && x + j < ncols) {
-				if (InBound(y + i, x + j)) {
-					int b = labelmap[y + i][x + j];
-					if (a != b) {
-						cost += PixelwiseSecondOrderCost(y + i, x + j, disp, img);
-						isBorder = true;
+	for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+		int y = r->y;
+		for (int x = r->x0; x < r->x1; x++) {
+			int a = labelmap[y][x];
+
+			bool isBorder = false;
+			for (int i = -1; i <= +1; i++) {
+				for (int j = -1; j <= +1; j++) {
+					//if (0 <= y + i && y + i < nrows && 0 <= x + j && x + j < ncols) {
+					if (InBound(y + i, x + j)) {
+						int b = labelmap[y + i][x + j];
+						if (a != b) {
+							cost += PixelwiseSecondOrderCost(y + i, x + j, disp, img);
+							isBorder = true;
+						}
 					}
 				}
 			}
-		}
 
-		cost += PixelwiseSecondOrderCost(y, x, disp, img);
+			cost += PixelwiseSecondOrderCost(y, x, disp, img);
+		}
 	}
 }
 
-inline float nm_compute_segment_cost(float *abc, int n = 3)
-{
-	const float maxPixelCost = (1.0f - alpha) * tau_col + alpha * tau_grad;
-	float lambda = 80.0f * maxPixelCost / (float)dmax;
-	Plane coeff;
-	coeff.SetAbc(abc);
-	float dataCost = ComputePlaneCost(coeff, *nm_opt_struct.dsi, *nm_opt_struct.pointList);
-
-	//return dataCost;
-	//float smoothCost = ComputeSegmentSmoothCost(dsi, segmentList, id);
-
-	Eigen::SparseMatrix<double>& L = *nm_opt_struct.L;
-	VECBITMAP<float> &disp = *nm_opt_struct.disp;
-	std::vector<cv::Point2d>& pointList = *nm_opt_struct.pointList;
-	for (int i = 0; i < pointList.size(); i++) {
-		int y = pointList[i].y, x = pointList[i].x;
-		disp[y][x] = coeff.ToDisparity(y, x);
-	}
-	float smoothCost = ComputeSmoothCost(L, disp);
-	return dataCost + lambda * smoothCost;
-}
+struct NMSegmentCost {
+	VECBITMAP<float> *dsi;
+	VECBITMAP<float> *disp;
+	RegionIndex *regions;
+	int id;
+	SmoothCostCache *smooth;
+	float operator()(float *abc)
+	{
+		const float maxPixelCost = (1.0f - alpha) * tau_col + alpha * tau_grad;
+		float lambda = 80.0f * maxPixelCost / (float)dmax;
+		Plane coeff;
+		coeff.SetAbc(abc);
+		float dataCost = ComputePlaneCost(coeff, *dsi, *regions, id);
 
-void NelderMeadEstimate(std::vector<cv::Point2d>& pointList, VECBITMAP<float>& dsi, VECBITMAP<float>& disp, VECBITMAP<Plane>& coeffs)
-{
+		//return dataCost;
+		//float smoothCost = ComputeSegmentSmoothCost(dsi, segmentList, id);
 
-	int NelderMeadOptimize(float *x, int dims, float(*feval)(float*, int), int maxiters = 0);
+		for (RegionRun *r = regions->RunsBegin(id); r != regions->RunsEnd(id); r++) {
+			for (int x = r->x0; x < r->x1; x++) {
+				(*disp)[r->y][x] = coeff.ToDisparity(r->y, x);
+			}
+		}
+		float smoothCost = smooth->Evaluate(*disp);
+		return dataCost + lambda * smoothCost;
+	}
+};
 
+void NelderMeadEstimate(RegionIndex& regions, int id, VECBITMAP<float>& dsi, VECBITMAP<float>& disp, VECBITMAP<Plane>& coeffs, std::mt19937& rng)
+{
 	const int MIN_SAMPLE_SIZE = 5;
-	const int regionSize = pointList.size();
+	const int regionSize = regions.Size(id);
 
 	if (regionSize < MIN_SAMPLE_SIZE) {
-		for (int i = 0; i < regionSize; i++) {
-			int y = pointList[i].y;
-			int x = pointList[i].x;
-			coeffs[y][x].RandomAssign(y, x, dmax);
+		for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+			int y = r->y;
+			for (int x = r->x0; x < r->x1; x++) {
+				coeffs[y][x].RandomAssign(y, x, dmax, rng);
+			}
 		}
 		return;
 	}
 
-	for (int i = 0; i < pointList.size(); i++) {
-		int y = pointList[i].y;
-		int x = pointList[i].x;
-		float wta_d = disp[y][x];
-		coeffs[y][x].RandomAssignNormal(y, x, dmax, wta_d);
+	for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+		int y = r->y;
+		for (int x = r->x0; x < r->x1; x++) {
+			float wta_d = disp[y][x];
+			coeffs[y][x].RandomAssignNormal(y, x, dmax, wta_d, rng);
+		}
 	}
 
 
@@ -493,13 +688,12 @@ void NelderMeadEstimate(std::vector<cv::Point2d>& pointList, VECBITMAP<float>& d
 	int max_iters = std::min(regionSize, 20);
 	for (int iter = 0; iter < max_iters; iter++) {
 		// initialize simplex vertices
-		RandomPermute(pointList, 4);
 		int i;
 		if (iter == 0) { i = 0; }
 		else { i = 1; }
 		for (; i < 4; i++) {
-			int y = pointList[i].y;
-			int x = pointList[i].x;
+			int y, x;
+			regions.PixelAt(id, rng() % regionSize, y, x);
 			vertices[3 * i + 0] = coeffs[y][x].a;
 			vertices[3 * i + 1] = coeffs[y][x].b;
 			vertices[3 * i + 2] = coeffs[y][x].c;
@@ -515,18 +709,17 @@ void NelderMeadEstimate(std::vector<cv::Point2d>& pointList, VECBITMAP<float>& d
 		//	int y = pointList[i].y;
 		//	int x = pointList[i].x;
 		//	Plane coeff;
-		//	coeff.RandomAssign(y, x, dmax);
+		//	coeff.RandomAssign(y, x, dmax, rng);
 		//	vertices[3 * i + 0] = coeff.a;
 		//	vertices[3 * i + 1] = coeff.b;
 		//	vertices[3 * i + 2] = coeff.c;
 		//}
 
 		// invoke nelder-mead
-		nm_opt_struct.dsi = &dsi;
-		nm_opt_struct.pointList = &pointList;
-		float cost_before = nm_compute_plane_cost(vertices);
-		NelderMeadOptimize(vertices, 3, nm_compute_plane_cost, 30);
-		float cost_after = nm_compute_plane_cost(vertices);
+		NMPlaneCost feval = { &dsi, &regions, id };
+		float cost_before = feval(vertices);
+		NelderMeadOptimize<3>(vertices, feval, 30);
+		float cost_after = feval(vertices);
 
 		if (cost_after - cost_before > 0) {
 			printf("BUG: energy increased!\n");
@@ -535,112 +728,220 @@ void NelderMeadEstimate(std::vector<cv::Point2d>& pointList, VECBITMAP<float>& d
 	
 	
 
-	for (int i = 0; i < regionSize; i++) {
-		int y = pointList[i].y;
-		int x = pointList[i].x;
-		coeffs[y][x].a = vertices[0];
-		coeffs[y][x].b = vertices[1];
-		coeffs[y][x].c = vertices[2];
+	for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+		int y = r->y;
+		for (int x = r->x0; x < r->x1; x++) {
+			coeffs[y][x].a = vertices[0];
+			coeffs[y][x].b = vertices[1];
+			coeffs[y][x].c = vertices[2];
+		}
 	}
 }
 
-void RansacEstimate(std::vector<cv::Point2d>& pointList, VECBITMAP<float>& dsi, VECBITMAP<float>& disp, VECBITMAP<Plane>& coeffs)
+#define RANSAC_SAMPLE_SIZE		5
+#define RANSAC_MAX_RETRIES		200
+#define RANSAC_CONFIDENCE		0.99
+#define RANSAC_INLIER_THRESH	1.0f
+
+bool SolvePlaneNormalEquations(int *xs, int *ys, float *ds, int n, Plane& coeff)
 {
-	const int MIN_SAMPLE_SIZE = 5;
-	const int regionSize = pointList.size();
+	// Least squares fit of d = a*x + b*y + c, solving the 3x3 normal equations (A'A) [a b c]' = A'd
+	// in closed form. Coordinates are taken relative to the first sample for conditioning.
+	// Returns false if the samples are (nearly) collinear.
+	double sxx = 0, sxy = 0, syy = 0, sx = 0, sy = 0;
+	double sxd = 0, syd = 0, sd = 0;
+	for (int i = 0; i < n; i++) {
+		double x = xs[i] - xs[0], y = ys[i] - ys[0], d = ds[i];
+		sxx += x * x;	sxy += x * y;	syy += y * y;
+		sx += x;		sy += y;
+		sxd += x * d;	syd += y * d;	sd += d;
+	}
 
-	if (regionSize < MIN_SAMPLE_SIZE) {
-		for (int i = 0; i < regionSize; i++) {
-			int y = pointList[i].y;
-			int x = pointList[i].x;
-			coeffs[y][x].RandomAssign(y, x, dmax);
+	double c00 = syy * n - sy * sy;
+	double c01 = sx * sy - sxy * n;
+	double c02 = sxy * sy - syy * sx;
+	double c11 = sxx * n - sx * sx;
+	double c12 = sxy * sx - sxx * sy;
+	double c22 = sxx * syy - sxy * sxy;
+	double det = sxx * c00 + sxy * c01 + sx * c02;
+	if (fabs(det) <= 1e-9 * std::max(1.0, sxx * syy * n)) {
+		return false;
+	}
+
+	// Inverse of the symmetric matrix through its cofactors.
+	double a = (c00 * sxd + c01 * syd + c02 * sd) / det;
+	double b = (c01 * sxd + c11 * syd + c12 * sd) / det;
+	double c = (c02 * sxd + c12 * syd + c22 * sd) / det;
+	coeff.a = a;
+	coeff.b = b;
+	coeff.c = c - a * xs[0] - b * ys[0];
+	return true;
+}
+
+double ComputePlaneCostAndInliers(Plane& coeff, VECBITMAP<float>& dsi, VECBITMAP<float>& disp, RegionIndex& regions, int id, int& ninliers)
+{
+	// Same kernel as ComputePlaneCost, also counting the pixels within RANSAC_INLIER_THRESH of disp.
+	double cost = 0;
+	float d[COST_KERNEL_LANES];
+	ninliers = 0;
+	for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+		const int len = r->x1 - r->x0;
+		const float *costs = dsi.get(r->y, r->x0);
+		const float *drow = &disp[r->y][r->x0];
+		double db = coeff.a * r->x0 + coeff.b * r->y + coeff.c;
+		for (int k0 = 0; k0 < len; k0 += COST_KERNEL_LANES) {
+			int m = std::min(COST_KERNEL_LANES, len - k0);
+			float fdb = db, a = coeff.a;
+			for (int k = 0; k < COST_KERNEL_LANES; k++) {
+				d[k] = fdb + a * k;
+			}
+			cost += BlockDataCost(d, costs + k0 * dsi.n, dsi.n, m);
+			for (int k = 0; k < m; k++) {
+				ninliers += (fabs(d[k] - drow[k0 + k]) <= RANSAC_INLIER_THRESH);
+			}
+			db += COST_KERNEL_LANES * coeff.a;
+		}
+	}
+	return cost;
+}
+
+void RansacEstimate(RegionIndex& regions, int id, VECBITMAP<float>& dsi, VECBITMAP<float>& disp, VECBITMAP<Plane>& coeffs, std::mt19937& rng)
+{
+	const int regionSize = regions.Size(id);
+
+	if (regionSize < RANSAC_SAMPLE_SIZE) {
+		for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+			int y = r->y;
+			for (int x = r->x0; x < r->x1; x++) {
+				coeffs[y][x].RandomAssign(y, x, dmax, rng);
+			}
 		}
 		return;
 	}
 
-	cv::Mat A(MIN_SAMPLE_SIZE, 3, CV_64F);
-	cv::Mat b(MIN_SAMPLE_SIZE, 1, CV_64F);
-	cv::Mat c(3, 1, CV_64F);
+	std::uniform_int_distribution<int> pick(0, regionSize - 1);
+	int xs[RANSAC_SAMPLE_SIZE], ys[RANSAC_SAMPLE_SIZE], idx[RANSAC_SAMPLE_SIZE];
+	float ds[RANSAC_SAMPLE_SIZE];
 
 	Plane bestcoeff;
 	double bestcost = DBL_MAX;
-
-	for (int retry = 0; retry < 200; retry++) {
-
-		RandomPermute(pointList, MIN_SAMPLE_SIZE);
-		for (int i = 0; i < MIN_SAMPLE_SIZE; i++) {
-			int y = pointList[i].y;
-			int x = pointList[i].x;
-			A.at<double>(i, 0) = x;
-			A.at<double>(i, 1) = y;
-			A.at<double>(i, 2) = 1;
-			b.at<double>(i, 0) = disp[y][x];
+	int maxretries = RANSAC_MAX_RETRIES;
+
+	for (int retry = 0; retry < maxretries; retry++) {
+
+		// Draw distinct samples.
+		for (int i = 0; i < RANSAC_SAMPLE_SIZE; i++) {
+			bool duplicate;
+			do {
+				idx[i] = pick(rng);
+				duplicate = false;
+				for (int j = 0; j < i; j++) {
+					duplicate |= (idx[j] == idx[i]);
+				}
+			} while (duplicate);
+			regions.PixelAt(id, idx[i], ys[i], xs[i]);
+			ds[i] = disp[ys[i]][xs[i]];
 		}
 
-		//printf("solving\n");
-		cv::solve(A, b, c, cv::DECOMP_SVD);
-		//printf("finished.\n");
 		Plane coeff;
-		coeff.a = c.at<double>(0, 0);
-		coeff.b = c.at<double>(1, 0);
-		coeff.c = c.at<double>(2, 0);
+		if (!SolvePlaneNormalEquations(xs, ys, ds, RANSAC_SAMPLE_SIZE, coeff)) {
+			continue;
+		}
 
-		double cost = ComputePlaneCost(coeff, dsi, pointList);
+		int ninliers;
+		double cost = ComputePlaneCostAndInliers(coeff, dsi, disp, regions, id, ninliers);
 		if (cost < bestcost) {
 			bestcost = cost;
 			bestcoeff = coeff;
+
+			// Number of trials after which an all-inlier sample has been drawn with
+			// probability RANSAC_CONFIDENCE, given the inlier ratio of the best plane.
+			double w = (double)ninliers / regionSize;
+			double pAllInliers = pow(w, RANSAC_SAMPLE_SIZE);
+			if (pAllInliers >= 1.0) {
+				break;
+			}
+			if (pAllInliers > 0) {
+				double ntrials = log(1.0 - RANSAC_CONFIDENCE) / log(1.0 - pAllInliers);
+				maxretries = std::min((double)RANSAC_MAX_RETRIES, ceil(ntrials));
+			}
+		}
+	}
+
+	if (bestcost == DBL_MAX) {
+		// Degenerate segment (e.g. all pixels on a line), fall back to a fronto-parallel plane.
+		std::vector<float> dlist;
+		dlist.reserve(regionSize);
+		for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+			dlist.insert(dlist.end(), &disp[r->y][r->x0], &disp[r->y][r->x1]);
 		}
+		std::nth_element(dlist.begin(), dlist.begin() + regionSize / 2, dlist.end());
+		bestcoeff = Plane(0.f, 0.f, dlist[regionSize / 2], 0.f, 0.f, 1.f);
 	}
 
-	for (int i = 0; i < regionSize; i++) {
-		int y = pointList[i].y;
-		int x = pointList[i].x;
-		coeffs[y][x] = bestcoeff;
+	for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+		int y = r->y;
+		for (int x = r->x0; x < r->x1; x++) {
+			coeffs[y][x] = bestcoeff;
+		}
 	}
 }
 
-void NelderMeadImproveNonlinear(std::vector<cv::Point2d>& pointList, VECBITMAP<float>& dsi, VECBITMAP<float>& disp, VECBITMAP<Plane>& coeffs, Eigen::SparseMatrix<double> &L)
+void SegmentMedianCenter(RegionIndex& regions, int id, int& x0, int& y0)
 {
+	// Runs are in raster order, so the median row is simply that of the middle pixel
+	const int regionSize = regions.Size(id);
+	std::vector<int> xcoord;
+	xcoord.reserve(regionSize);
+	for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+		for (int x = r->x0; x < r->x1; x++) {
+			xcoord.push_back(x);
+		}
+	}
+	nth_element(xcoord.begin(), xcoord.begin() + regionSize / 2, xcoord.end());
+	x0 = *(xcoord.begin() + regionSize / 2);
+	int xmid;
+	regions.PixelAt(id, regionSize / 2, y0, xmid);
+}
 
-	int NelderMeadOptimize(float *x, int dims, float(*feval)(float*, int), int maxiters = 0);
+// Plane the surface fit of region id starts from. Taken by value from a pixel of the region: the
+// median center need not lie in a non-convex region, and other threads write the pixels of theirs.
+static Plane SegmentSeedPlane(RegionIndex& regions, int id, VECBITMAP<Plane>& coeffs)
+{
+	int y, x;
+	regions.PixelAt(id, regions.Size(id) / 2, y, x);
+	return coeffs[y][x];
+}
 
+void NelderMeadImproveNonlinear(RegionIndex& regions, int id, VECBITMAP<float>& dsi, VECBITMAP<float>& disp, VECBITMAP<Plane>& coeffs, Eigen::SparseMatrix<double> &L, std::mt19937& rng)
+{
 	const int MIN_SAMPLE_SIZE = 5;
-	const int regionSize = pointList.size();
+	const int regionSize = regions.Size(id);
 
 	if (regionSize < MIN_SAMPLE_SIZE) {
-		for (int i = 0; i < regionSize; i++) {
-			int y = pointList[i].y;
-			int x = pointList[i].x;
-			coeffs[y][x].RandomAssign(y, x, dmax);
+		for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+			int y = r->y;
+			for (int x = r->x0; x < r->x1; x++) {
+				coeffs[y][x].RandomAssign(y, x, dmax, rng);
+			}
 		}
 		return;
 	}
 
-	std::vector<int> xcoord(regionSize);
-	std::vector<int> ycoord(regionSize);
-	for (int i = 0; i < regionSize; i++) {
-		xcoord[i] = pointList[i].x;
-		ycoord[i] = pointList[i].y;
-	}
-	nth_element(xcoord.begin(), xcoord.begin() + regionSize / 2, xcoord.end());
-	nth_element(ycoord.begin(), ycoord.begin() + regionSize / 2, ycoord.end());
-	int x0 = *(xcoord.begin() + regionSize / 2);
-	int y0 = *(ycoord.begin() + regionSize / 2);
+	int x0, y0;
+	SegmentMedianCenter(regions, id, x0, y0);
 
 	// Do centralization for the ease of optimization
 	// If not centralized, to obtained a fairly symmetric quadratic surface my require large pertubation
 	// of the value of D, E, F, which depends on the scale of current coordinates. seems not stable.
-	std::vector<cv::Point2d> centralizedPointList(regionSize);
-	for (int i = 0; i < regionSize; i++) {
-		centralizedPointList[i].x = pointList[i].x - x0;
-		centralizedPointList[i].y = pointList[i].y - y0;
-	}
+	// The surface is parametrized around (x0, y0).
 
 	//printf("finish centalization.\n");
 	float a, b, c, A, B, C, D, E, F;
-	a = coeffs[y0][x0].a;
-	b = coeffs[y0][x0].b;
-	c = coeffs[y0][x0].c;
+	Plane seed = SegmentSeedPlane(regions, id, coeffs);
+	a = seed.a;
+	b = seed.b;
+	c = seed.c;
 	A = B = C = 0;
 	D = a; E = b;
 	F = c + D*x0 + E*y0;
@@ -656,7 +957,7 @@ void NelderMeadImproveNonlinear(std::vector<cv::Point2d>& pointList, VECBITMAP<f
 
 		// initialize simplex vertices
 		for (int i = 1; i < 7; i++) {
-			initplane.RandomPerturbTo(&vertices[6 * i]);
+			initplane.RandomPerturbTo(&vertices[6 * i], rng);
 		}
 		//for (int i = 0; i < 7; i++) {
 		//	initplane.SetToArray(&vertices[6 * i]);
@@ -666,18 +967,13 @@ void NelderMeadImproveNonlinear(std::vector<cv::Point2d>& pointList, VECBITMAP<f
 
 
 		// invoke nelder-mead
-		nm_opt_struct.L = &L;
-		nm_opt_struct.disp = &disp;
-		nm_opt_struct.dsi = &dsi;
-		nm_opt_struct.pointList = &centralizedPointList;
-		nm_opt_struct.x0 = x0;
-		nm_opt_struct.y0 = y0;
+		NMQuadraticSurfaceCost feval = { &dsi, &regions, id, x0, y0 };
 		//printf("fin\n");
-		float cost_before = nm_compute_quadratic_surface_cost(vertices);
+		float cost_before = feval(vertices);
 		//printf("invoking..\n");
-		NelderMeadOptimize(vertices, 6, nm_compute_quadratic_surface_cost, 30);
+		NelderMeadOptimize<6>(vertices, feval, 30);
 		//printf("after invoking..\n");
-		float cost_after = nm_compute_quadratic_surface_cost(vertices);
+		float cost_after = feval(vertices);
 
 		if (cost_after - cost_before > 0) {
 			printf("BUG: energy increased!\n");
@@ -687,19 +983,170 @@ void NelderMeadImproveNonlinear(std::vector<cv::Point2d>& pointList, VECBITMAP<f
 	//printf("surface neldermead done.\n");
 	QuadraticSurface bestsurface(vertices[0], vertices[1], vertices[2], vertices[3], vertices[4], vertices[5]);
 
-	for (int i = 0; i < regionSize; i++) {
-		int y = centralizedPointList[i].y;
-		int x = centralizedPointList[i].x;
-		if (!InBound(y + y0, x + x0)) {
-			printf("OUT OF BOUND BUG!\n");
+	for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+		for (int x = r->x0; x < r->x1; x++) {
+			disp[r->y][x] = bestsurface.ToDisparity(r->y - y0, x - x0);
 		}
-		disp[y + y0][x + x0] = bestsurface.ToDisparity(y, x);
 	}
 
 }
 
 
 
+void ComputeWtaConfidence(VECBITMAP<float>& dsi, VECBITMAP<float>& wta, VECBITMAP<float>& conf)
+{
+	// Winner-takes-all disparity and a peak-ratio confidence in [0, 1]: one minus the ratio of the best cost
+	// to the best cost more than one level away from it.
+	#pragma omp parallel for
+	for (int y = 0; y < nrows; y++) {
+		for (int x = 0; x < ncols; x++) {
+			float *cost = dsi.get(y, x);
+			int best = 0;
+			for (int k = 1; k < dsi.n; k++) {
+				if (cost[k] < cost[best]) {
+					best = k;
+				}
+			}
+			float second = FLT_MAX;
+			for (int k = 0; k < dsi.n; k++) {
+				if (abs(k - best) > 1) {
+					second = std::min(second, cost[k]);
+				}
+			}
+			wta[y][x] = best * granularity;
+			conf[y][x] = (second == FLT_MAX) ? 1.f : std::max(0.f, 1.f - cost[best] / std::max(second, 1e-6f));
+		}
+	}
+}
+
+#define USE_IRLS_QUADRATIC_FIT				// comment out to fit quadratic surfaces with Nelder-Mead restarts
+#define IRLS_MAX_ITERS		10
+#define IRLS_SIGMA			1.0f		// scale of the Cauchy weight, in pixels
+#define IRLS_RIDGE			1e-6		// keeps A, B, C determined on thin segments
+#define IRLS_TOL			1e-3		// stop once the fit moves less than this at the corners of the segment's bounding box, in pixels
+
+bool IrlsFitQuadraticSurface(RegionIndex& regions, int id, VECBITMAP<float>& wta, VECBITMAP<float>& conf,
+	int x0, int y0, QuadraticSurface& surface)
+{
+	// Robust least-squares fit of the surface (centralized at (x0, y0)) to the WTA disparities.
+	// Each pass accumulates the weighted moments m[i][j] = sum w x^i y^j (i + j <= 4) and
+	// sum w d x^i y^j (i + j <= 2); the 6x6 normal equations are assembled from them in O(1).
+	// Weights are the WTA confidences, times a Cauchy weight on the residual after the first pass.
+	const int px[6] = { 2, 0, 1, 1, 0, 0 };		// exponents of x and y for A, B, C, D, E, F
+	const int py[6] = { 0, 2, 1, 0, 1, 0 };
+	float coeffs[6];
+
+	// Bounding box of the segment; runs are in raster order, so only x needs a pass
+	int ymin = regions.RunsBegin(id)->y, ymax = (regions.RunsEnd(id) - 1)->y;
+	int xmin = INT_MAX, xmax = INT_MIN;
+	for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+		xmin = std::min(xmin, r->x0);
+		xmax = std::max(xmax, r->x1 - 1);
+	}
+	const int corners[4][2] = { { ymin, xmin }, { ymin, xmax }, { ymax, xmin }, { ymax, xmax } };
+
+	for (int iter = 0; iter < IRLS_MAX_ITERS; iter++) {
+		double m[5][5] = { 0 }, md[3][3] = { 0 };
+		for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+			double y = r->y - y0;
+			double sx[5] = { 0 }, sxd[3] = { 0 };		// row sums of w x^i and w d x^i
+			for (int xx = r->x0; xx < r->x1; xx++) {
+				double x = xx - x0;
+				double d = wta[r->y][xx];
+				double w = conf[r->y][xx];
+				if (iter > 0) {
+					double res = (surface.ToDisparity(y, x) - d) / IRLS_SIGMA;
+					w /= 1.0 + res * res;
+				}
+				double x2 = x * x;
+				sx[0] += w;		sx[1] += w * x;		sx[2] += w * x2;
+				sx[3] += w * x2 * x;	sx[4] += w * x2 * x2;
+				sxd[0] += w * d;	sxd[1] += w * d * x;	sxd[2] += w * d * x2;
+			}
+			double yj = 1;
+			for (int j = 0; j <= 4; j++) {
+				for (int i = 0; i + j <= 4; i++) {
+					m[i][j] += sx[i] * yj;
+				}
+				for (int i = 0; i + j <= 2; i++) {
+					md[i][j] += sxd[i] * yj;
+				}
+				yj *= y;
+			}
+		}
+
+		if (m[0][0] <= 0) {
+			return false;
+		}
+		Eigen::Matrix<double, 6, 6> M;
+		Eigen::Matrix<double, 6, 1> v;
+		for (int p = 0; p < 6; p++) {
+			for (int q = 0; q < 6; q++) {
+				M(p, q) = m[px[p] + px[q]][py[p] + py[q]];
+			}
+			v(p) = md[px[p]][py[p]];
+		}
+		for (int p = 0; p < 3; p++) {
+			M(p, p) += IRLS_RIDGE * (M(p, p) + m[0][0]);
+		}
+		Eigen::LDLT<Eigen::Matrix<double, 6, 6>> ldlt(M);
+		Eigen::Matrix<double, 6, 1> sol = ldlt.solve(v);
+		if (ldlt.info() != Eigen::Success || !sol.allFinite()) {
+			return false;
+		}
+
+		for (int p = 0; p < 6; p++) {
+			coeffs[p] = sol(p);
+		}
+		QuadraticSurface prev = surface;
+		surface.SetFromArray(coeffs);
+
+		// Largest change of the fit at the corners of the segment's bounding box
+		if (iter > 0) {
+			double change = 0;
+			for (int k = 0; k < 4; k++) {
+				float y = corners[k][0] - y0, x = corners[k][1] - x0;
+				change = std::max(change, (double)fabs(surface.ToDisparity(y, x) - prev.ToDisparity(y, x)));
+			}
+			if (change < IRLS_TOL) {
+				break;
+			}
+		}
+	}
+	return true;
+}
+
+void IrlsImproveNonlinear(RegionIndex& regions, int id, VECBITMAP<float>& dsi, VECBITMAP<float>& wta, VECBITMAP<float>& conf,
+	VECBITMAP<float>& disp, VECBITMAP<Plane>& coeffs)
+{
+	// Fast alternative to NelderMeadImproveNonlinear. The surface is fitted to the WTA disparities by IRLS;
+	// the dsi cost only decides between the fit and the current plane. Only the pixels of region id are written.
+	const int regionSize = regions.Size(id);
+	if (regionSize < 6) {
+		return;
+	}
+
+	int x0, y0;
+	SegmentMedianCenter(regions, id, x0, y0);
+
+	Plane plane = SegmentSeedPlane(regions, id, coeffs);
+	QuadraticSurface initplane(0, 0, 0, plane.a, plane.b, plane.c + plane.a * x0 + plane.b * y0);
+	QuadraticSurface surface = initplane;
+	if (!IrlsFitQuadraticSurface(regions, id, wta, conf, x0, y0, surface)) {
+		return;
+	}
+
+	double cost_plane = ComputeQuadraticSurfaceCost(initplane, dsi, regions, id, x0, y0);
+	double cost_surface = ComputeQuadraticSurfaceCost(surface, dsi, regions, id, x0, y0);
+	QuadraticSurface& best = (cost_surface <= cost_plane ? surface : initplane);
+
+	for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+		for (int x = r->x0; x < r->x1; x++) {
+			disp[r->y][x] = best.ToDisparity(r->y - y0, x - x0);
+		}
+	}
+}
+
 int CurvedSegment_ConstructLaplacian(const cv::Mat &imL, const int width, const int height, Eigen::SparseMatrix<double> &L)
 {
 	cv::Mat img;
@@ -712,6 +1159,7 @@ int CurvedSegment_ConstructLaplacian(const cv::Mat &imL, const int width, const
 
 	std::vector<Eigen::Triplet<double>> coefficients;
 	coefficients.reserve(length * 9);
+	TrackedBytes tripletBytes(9LL * length * sizeof(Eigen::Triplet<double>));
 	for (int y = 0, i = 0; y < height; y++)
 	{
 		for (int x = 0; x < width; x++, i++)
@@ -818,36 +1266,41 @@ int CurvedSegment_ConstructLaplacian(const cv::Mat &imL, const int width, const
 	return 1;
 }
 
-void OptimizeCurvedSegment(CurvedSegment& seg, VECBITMAP<float>& dsi, VECBITMAP<float>& disp,
-	VECBITMAP<Plane>& coeffs, Eigen::SparseMatrix<double>& L)
+void OptimizeCurvedSegment(RegionIndex& regions, int id, VECBITMAP<float>& dsi, VECBITMAP<float>& disp,
+	VECBITMAP<Plane>& coeffs, SmoothCostCache& smooth)
 {
-	std::vector<cv::Point2d>& pointList = seg.pointList;
-
-	int NelderMeadOptimize(float *x, int dims, float(*feval)(float*, int), int maxiters = 0);
+	std::mt19937 rng(rand());
 
 	const int MIN_SAMPLE_SIZE = 5;
-	const int regionSize = pointList.size();
+	const int regionSize = regions.Size(id);
 
-	int y = pointList[0].y, x = pointList[0].x;
+	int y, x;
+	regions.PixelAt(id, 0, y, x);
 	Plane currentPlane = coeffs[y][x];
 
 	if (regionSize < MIN_SAMPLE_SIZE) {
-		for (int i = 0; i < regionSize; i++) {
-			int y = pointList[i].y;
-			int x = pointList[i].x;
-			coeffs[y][x].RandomAssign(y, x, dmax);
+		for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+			int y = r->y;
+			for (int x = r->x0; x < r->x1; x++) {
+				coeffs[y][x].RandomAssign(y, x, dmax);
+			}
 		}
 		printf("!!!!!!\n");
 		return;
 	}
 
-	for (int i = 0; i < pointList.size(); i++) {
-		int y = pointList[i].y;
-		int x = pointList[i].x;
-		float wta_d = disp[y][x];
-		coeffs[y][x].RandomAssignNormal(y, x, dmax, wta_d);
+	for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+		int y = r->y;
+		for (int x = r->x0; x < r->x1; x++) {
+			float wta_d = disp[y][x];
+			coeffs[y][x].RandomAssignNormal(y, x, dmax, wta_d);
+		}
 	}
 
+	// disp may have been edited anywhere since the last call.
+	smooth.Update(disp);
+	smooth.SetSegment(regions, id);
+
 	//printf("1111111\n");
 	float vertices[3 * 4];
 	vertices[0] = currentPlane.a;
@@ -856,29 +1309,25 @@ void OptimizeCurvedSegment(CurvedSegment& seg, VECBITMAP<float>& dsi, VECBITMAP<
 	int max_iters = std::min(regionSize, 10);
 	for (int iter = 0; iter < max_iters; iter++) {
 		// initialize simplex vertices
-		RandomPermute(pointList, 4);
 		int i = 1;
 		/*if (iter == 0) { i = 0; }
 		else { i = 1; }*/
 		for (; i < 4; i++) {
-			int y = pointList[i].y;
-			int x = pointList[i].x;
+			int y, x;
+			regions.PixelAt(id, rng() % regionSize, y, x);
 			vertices[3 * i + 0] = coeffs[y][x].a;
 			vertices[3 * i + 1] = coeffs[y][x].b;
 			vertices[3 * i + 2] = coeffs[y][x].c;
 		}
 
 		// invoke nelder-mead
-		nm_opt_struct.dsi = &dsi;
-		nm_opt_struct.pointList = &pointList;
-		nm_opt_struct.disp = &disp;
-		nm_opt_struct.L = &L;
+		NMSegmentCost feval = { &dsi, &disp, &regions, id, &smooth };
 		//printf("22222\n");
-		float cost_before = nm_compute_segment_cost(vertices);
+		float cost_before = feval(vertices);
 		//printf("3333\n");
-		NelderMeadOptimize(vertices, 3, nm_compute_segment_cost, 30);
+		NelderMeadOptimize<3>(vertices, feval, 30);
 		//printf("4444\n");
-		float cost_after = nm_compute_segment_cost(vertices);
+		float cost_after = feval(vertices);
 		printf("before->after: %.1f -> %.1f\n", cost_before, cost_after);
 
 		if (cost_after - cost_before > 0) {
@@ -888,56 +1337,44 @@ void OptimizeCurvedSegment(CurvedSegment& seg, VECBITMAP<float>& dsi, VECBITMAP<
 
 
 
-	for (int i = 0; i < regionSize; i++) {
-		int y = pointList[i].y;
-		int x = pointList[i].x;
-		coeffs[y][x].a = vertices[0];
-		coeffs[y][x].b = vertices[1];
-		coeffs[y][x].c = vertices[2];
+	for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+		int y = r->y;
+		for (int x = r->x0; x < r->x1; x++) {
+			coeffs[y][x].a = vertices[0];
+			coeffs[y][x].b = vertices[1];
+			coeffs[y][x].c = vertices[2];
 	
-		disp[y][x] = coeffs[y][x].ToDisparity(y, x);
+			disp[y][x] = coeffs[y][x].ToDisparity(y, x);
+		}
 	}
-
+	smooth.Commit(disp);
 }
 
-void OptimizeCurvedSegmentNonlinear(CurvedSegment& seg, VECBITMAP<float>& dsi, VECBITMAP<float>& disp,
+void OptimizeCurvedSegmentNonlinear(RegionIndex& regions, int id, VECBITMAP<float>& dsi, VECBITMAP<float>& disp,
 	VECBITMAP<Plane>& coeffs, Eigen::SparseMatrix<double>& L)
 {
-	std::vector<cv::Point2d>& pointList = seg.pointList;
-
-	int NelderMeadOptimize(float *x, int dims, float(*feval)(float*, int), int maxiters = 0);
+	std::mt19937 rng(rand());
 
 	const int MIN_SAMPLE_SIZE = 5;
-	const int regionSize = pointList.size();
+	const int regionSize = regions.Size(id);
 
 	if (regionSize < MIN_SAMPLE_SIZE) {
-		for (int i = 0; i < regionSize; i++) {
-			int y = pointList[i].y;
-			int x = pointList[i].x;
-			coeffs[y][x].RandomAssign(y, x, dmax);
+		for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+			int y = r->y;
+			for (int x = r->x0; x < r->x1; x++) {
+				coeffs[y][x].RandomAssign(y, x, dmax);
+			}
 		}
 		return;
 	}
 
-	std::vector<int> xcoord(regionSize);
-	std::vector<int> ycoord(regionSize);
-	for (int i = 0; i < regionSize; i++) {
-		xcoord[i] = pointList[i].x;
-		ycoord[i] = pointList[i].y;
-	}
-	nth_element(xcoord.begin(), xcoord.begin() + regionSize / 2, xcoord.end());
-	nth_element(ycoord.begin(), ycoord.begin() + regionSize / 2, ycoord.end());
-	int x0 = *(xcoord.begin() + regionSize / 2);
-	int y0 = *(ycoord.begin() + regionSize / 2);
+	int x0, y0;
+	SegmentMedianCenter(regions, id, x0, y0);
 
 	// Do centralization for the ease of optimization
 	// If not centralized, to obtained a fairly symmetric quadratic surface my require large pertubation
 	// of the value of D, E, F, which depends on the scale of current coordinates. seems not stable.
-	std::vector<cv::Point2d> centralizedPointList(regionSize);
-	for (int i = 0; i < regionSize; i++) {
-		centralizedPointList[i].x = pointList[i].x - x0;
-		centralizedPointList[i].y = pointList[i].y - y0;
-	}
+	// The surface is parametrized around (x0, y0).
 
 	//printf("finish centalization.\n");
 	float a, b, c, A, B, C, D, E, F;
@@ -959,7 +1396,7 @@ void OptimizeCurvedSegmentNonlinear(CurvedSegment& seg, VECBITMAP<float>& dsi, V
 
 		// initialize simplex vertices
 		for (int i = 1; i < 7; i++) {
-			initplane.RandomPerturbTo(&vertices[6 * i]);
+			initplane.RandomPerturbTo(&vertices[6 * i], rng);
 		}
 		//for (int i = 0; i < 7; i++) {
 		//	initplane.SetToArray(&vertices[6 * i]);
@@ -969,18 +1406,13 @@ void OptimizeCurvedSegmentNonlinear(CurvedSegment& seg, VECBITMAP<float>& dsi, V
 
 
 		// invoke nelder-mead
-		nm_opt_struct.L = &L;
-		nm_opt_struct.disp = &disp;
-		nm_opt_struct.dsi = &dsi;
-		nm_opt_struct.pointList = &centralizedPointList;
-		nm_opt_struct.x0 = x0;
-		nm_opt_struct.y0 = y0;
+		NMQuadraticSurfaceCost feval = { &dsi, &regions, id, x0, y0 };
 		//printf("fin\n");
-		float cost_before = nm_compute_quadratic_surface_cost(vertices);
+		float cost_before = feval(vertices);
 		//printf("invoking..\n");
-		NelderMeadOptimize(vertices, 6, nm_compute_quadratic_surface_cost, 30);
+		NelderMeadOptimize<6>(vertices, feval, 30);
 		//printf("after invoking..\n");
-		float cost_after = nm_compute_quadratic_surface_cost(vertices);
+		float cost_after = feval(vertices);
 		printf("before->after: %.1f -> %.1f\n", cost_before, cost_after);
 
 		if (cost_after - cost_before > 0) {
@@ -992,53 +1424,100 @@ void OptimizeCurvedSegmentNonlinear(CurvedSegment& seg, VECBITMAP<float>& dsi, V
 	QuadraticSurface bestsurface(vertices[0], vertices[1], vertices[2], vertices[3], vertices[4], vertices[5]);
 	printf("A = %f\nB = %f\nC = %f\nD = %f\nE = %f\nF = %f\n", vertices[0], vertices[1], vertices[2], vertices[3], vertices[4], vertices[5]);
 
-	for (int i = 0; i < regionSize; i++) {
-		int y = centralizedPointList[i].y;
-		int x = centralizedPointList[i].x;
-		if (!InBound(y + y0, x + x0)) {
-			printf("OUT OF BOUND BUG!\n");
+	for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+		for (int x = r->x0; x < r->x1; x++) {
+			disp[r->y][x] = bestsurface.ToDisparity(r->y - y0, x - x0);
 		}
-		disp[y + y0][x + x0] = bestsurface.ToDisparity(y, x);
 	}
 
 }
 
-void ConstructCurvedSegmentList(std::vector<CurvedSegment>& curvedSegmentList, std::vector<std::vector<cv::Point2d>>& regionList, VECBITMAP<int>& labelmap)
+#define RAG_BAND_ROWS	16		// rows whose boundary pixel pairs are collected before they are merged into the edges
+
+static void MergeEdgeKeys(std::vector<long long>& keys, std::vector<long long>& edges)
 {
-	int nsegments = regionList.size();
-	curvedSegmentList.resize(nsegments);
-	VECBITMAP<int> adjacentTable(nsegments, nsegments);
-	memset(adjacentTable.data, 0, nsegments * nsegments * sizeof(int));
+	// Adds keys to the sorted, duplicate-free edges and empties keys.
+	std::sort(keys.begin(), keys.end());
+	keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+	std::vector<long long> merged;
+	merged.reserve(edges.size() + keys.size());
+	std::set_union(edges.begin(), edges.end(), keys.begin(), keys.end(), std::back_inserter(merged));
+	edges.swap(merged);
+	keys.clear();
+}
 
-	for (int y = 0; y < nrows; y++)
+void BuildRegionAdjacencyGraph(VECBITMAP<int>& labelmap, int nsegments, RegionAdjacencyGraph& rag)
+{
+	// Each thread collects the label pairs (a < b) seen across its rows as 64-bit keys, looking only
+	// at the forward half of the 8-neighbourhood so every pixel pair is visited once. The keys of every
+	// band of rows are merged into the thread's edges, so memory follows the edges, not the boundary pixels.
+	int nthreads = omp_get_max_threads();
+	std::vector<std::vector<long long>> localEdges(nthreads);
+
+	#pragma omp parallel
 	{
-		for (int x = 0; x < ncols; x++)
-		{
-			int a = labelmap[y][x];
-			for (int i = -1; i <= 1; i++)
-			{
-				for (int j = -1; j <= 1; j++)
-				{
-					if (x + j >= 0 && x + j < ncols && y + i >= 0 && y + i < nrows)
-					{
-						int b = labelmap[y + i][x + j];
-						adjacentTable[a][b] = 1;
-						adjacentTable[b][a] = 1;
+		std::vector<long long> keys;
+		std::vector<long long>& edges = localEdges[omp_get_thread_num()];
+		int nrowsDone = 0;
+		#pragma omp for schedule(static)
+		for (int y = 0; y < nrows; y++) {
+			for (int x = 0; x < ncols; x++) {
+				int a = labelmap[y][x];
+				const int dy[4] = { 0, 1, 1, 1 };
+				const int dx[4] = { 1, -1, 0, 1 };
+				for (int k = 0; k < 4; k++) {
+					int yy = y + dy[k], xx = x + dx[k];
+					if (InBound(yy, xx) && labelmap[yy][xx] != a) {
+						int b = labelmap[yy][xx];
+						keys.push_back(((long long)std::min(a, b) << 32) | std::max(a, b));
 					}
 				}
 			}
+			if (++nrowsDone % RAG_BAND_ROWS == 0) {
+				MergeEdgeKeys(keys, edges);
+			}
 		}
+		MergeEdgeKeys(keys, edges);
 	}
 
+	// Merge the per-thread lists
+	std::vector<long long> edges;
+	for (int t = 0; t < nthreads; t++) {
+		edges.insert(edges.end(), localEdges[t].begin(), localEdges[t].end());
+		std::vector<long long>().swap(localEdges[t]);
+	}
+	std::sort(edges.begin(), edges.end());
+	edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+	int nedges = (int)edges.size();
+
+	// Scatter into symmetric CSR. Keys are sorted by (a, b), so each row comes out sorted.
+	rag.offsets.assign(nsegments + 1, 0);
+	for (int i = 0; i < nedges; i++) {
+		rag.offsets[(int)(edges[i] >> 32) + 1]++;
+		rag.offsets[(int)(edges[i] & 0xffffffff) + 1]++;
+	}
+	for (int i = 0; i < nsegments; i++) {
+		rag.offsets[i + 1] += rag.offsets[i];
+	}
+	rag.neighbors.resize(2 * nedges);
+	std::vector<int> fill(rag.offsets.begin(), rag.offsets.end() - 1);
+	for (int i = 0; i < nedges; i++) {
+		int a = edges[i] >> 32;
+		int b = edges[i] & 0xffffffff;
+		rag.neighbors[fill[a]++] = b;
+		rag.neighbors[fill[b]++] = a;
+	}
+}
+
+void ConstructCurvedSegmentList(std::vector<CurvedSegment>& curvedSegmentList, RegionIndex& regions, VECBITMAP<int>& labelmap, RegionAdjacencyGraph& rag)
+{
+	int nsegments = regions.NumRegions();
+	curvedSegmentList.resize(nsegments);
+	BuildRegionAdjacencyGraph(labelmap, nsegments, rag);
+
 	for (int i = 0; i < nsegments; i++)
 	{
-		adjacentTable[i][i] = 0;	//remove itself
-		for (int j = 0; j < nsegments; j++) {
-			if (adjacentTable[i][j]) {
-				curvedSegmentList[i].adjacentList.push_back(j);
-			}
-		}
-		curvedSegmentList[i].pointList = regionList[i];
+		curvedSegmentList[i].adjacentList.assign(rag.neighbors.begin() + rag.offsets[i], rag.neighbors.begin() + rag.offsets[i + 1]);
 	}
 }
 
@@ -1144,37 +1623,25 @@ void PlanefitView(cv::Mat& imL, VECBITMAP<float>& dsiL, VECBITMAP<Plane>& coeffs
 	//Timer::toc();
 
 
-	cv::imwrite(folders[folder_id] + "segments.png", g_segments);
+	if (!g_batchMode) {
+		cv::imwrite(folders[folder_id] + "segments.png", g_segments);
+	}
 
+	// The region index is built in place and shared with the mouse callbacks
 	VECBITMAP<int> labelmap(nrows, ncols);
-	int nlables = FromSegmentMapToLabelMap(g_segments, labelmap);
-
+	RegionIndex& regions = g_regions;
+	int nlables = FromSegmentMapToLabelMap(g_segments, labelmap, regions);
 
-	std::vector<int> regionSize(nlables, 0);
-	for (int y = 0; y < nrows; y++) {
-		for (int x = 0; x < ncols; x++) {
-			regionSize[labelmap[y][x]]++;
-		}
-	}
-	std::vector<std::vector<cv::Point2d>> regionList(nlables);
-	for (int i = 0; i < nlables; i++) {
-		regionList[i].reserve(regionSize[i]);
-	}
-	for (int y = 0; y < nrows; y++) {
-		for (int x = 0; x < ncols; x++) {
-			int label = labelmap[y][x];
-			regionList[label].push_back(cv::Point2d(x, y));
-		}
-	}
-
-	g_regionList = regionList;
 	g_labelmap = labelmap;
 	g_dsiL = dsiL;
 
 	Timer::tic("Fitting region");
-	//#pragma omp parallel for
+	// Segment sizes vary by orders of magnitude, hence the dynamic schedule.
+	// Each segment seeds its own generator, so the result does not depend on the thread count.
+	#pragma omp parallel for schedule(dynamic, 1)
 	for (int id = 0; id < nlables; id++) {
-		RansacEstimate(regionList[id], dsiL, dispL, coeffsL);
+		std::mt19937 rng(id);
+		RansacEstimate(regions, id, dsiL, dispL, coeffsL, rng);
 	}
 	g_coeffsL_ransac = coeffsL;
 
@@ -1183,18 +1650,37 @@ void PlanefitView(cv::Mat& imL, VECBITMAP<float>& dsiL, VECBITMAP<Plane>& coeffs
 
 
 	std::vector<CurvedSegment> curvedSegmentList;
-	ConstructCurvedSegmentList(curvedSegmentList, regionList, labelmap);
+	RegionAdjacencyGraph rag;
+	ConstructCurvedSegmentList(curvedSegmentList, regions, labelmap, rag);
 	int area = nrows * ncols;
 	Eigen::SparseMatrix<double> L(area, area);
 	CurvedSegment_ConstructLaplacian(imL, ncols, nrows, L);
+	SmoothCostCache smoothCache(L);
+	TrackedBytes laplacianBytes(3 * SparseBytes(L) + area * (long long)sizeof(double));		// L, its two copies in the cache and Lu
 	PlaneMapToDisparityMap(coeffsL, dispL);
 
 	//dispL.LoadFromBinaryFile(folders[folder_id] + "PatchMatch_dispL.bin");
 	//dispL.LoadFromBinaryFile(folders[folder_id] + "ourDispL.bin");
 
+#ifdef USE_IRLS_QUADRATIC_FIT
+	VECBITMAP<float> wtaL(nrows, ncols), confL(nrows, ncols);
+	ComputeWtaConfidence(dsiL, wtaL, confL);
+#endif
+	#pragma omp parallel for schedule(dynamic, 1)
 	for (int id = 0; id < nlables; id++) {
 		// Optimize nonlinear part
-		NelderMeadImproveNonlinear(regionList[id], dsiL, dispL, coeffsL, L);
+#ifdef USE_IRLS_QUADRATIC_FIT
+		IrlsImproveNonlinear(regions, id, dsiL, wtaL, confL, dispL, coeffsL);
+#else
+		std::mt19937 rng(id);
+		NelderMeadImproveNonlinear(regions, id, dsiL, dispL, coeffsL, L, rng);
+#endif
+	}
+
+	// The rest is the interactive refinement loop.
+	if (g_batchMode) {
+		Timer::toc();
+		return;
 	}
 	
 	for (;;) {
@@ -1204,12 +1690,16 @@ void PlanefitView(cv::Mat& imL, VECBITMAP<float>& dsiL, VECBITMAP<Plane>& coeffs
 		printf("selectedRegionId: %d\n", id);
 		if (g_OPTIMZE_TYPE == OPTIMIZE_LINEAR_PART) {
 			printf("\nOptimizing Linear Part\n");
-			OptimizeCurvedSegment(curvedSegmentList[id], dsiL, dispL, coeffsL, L);
+			OptimizeCurvedSegment(regions, id, dsiL, dispL, coeffsL, smoothCache);
 			
 		}
 		else if (g_OPTIMZE_TYPE == OPTIMIZE_NONLINEAR_PART) {
 			printf("\nOptimizing Non-Linear Part\n");
-			OptimizeCurvedSegmentNonlinear(curvedSegmentList[id], dsiL, dispL, coeffsL, L);
+#ifdef USE_IRLS_QUADRATIC_FIT
+			IrlsImproveNonlinear(regions, id, dsiL, wtaL, confL, dispL, coeffsL);
+#else
+			OptimizeCurvedSegmentNonlinear(regions, id, dsiL, dispL, coeffsL, L);
+#endif
 		}
 		else if (g_OPTIMZE_TYPE == COPY_PLANE_LABEL) {
 			printf("selected a plane, go on.\n");
@@ -1219,18 +1709,18 @@ void PlanefitView(cv::Mat& imL, VECBITMAP<float>& dsiL, VECBITMAP<Plane>& coeffs
 			//Plane coeff = g_selectedPlane;
 			printf("past selected plaen to current region.\n");
 			id = g_seletedRegionId;
-			std::vector<cv::Point2d>& pointList = curvedSegmentList[id].pointList;
-			for (int i = 0; i < pointList.size(); i++) {
-				int y = pointList[i].y, x = pointList[i].x;
-				coeffsL[y][x] = g_selectedPlane;
-				dispL[y][x] = g_selectedPlane.ToDisparity(y, x);
+			for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+				for (int x = r->x0; x < r->x1; x++) {
+					coeffsL[r->y][x] = g_selectedPlane;
+					dispL[r->y][x] = g_selectedPlane.ToDisparity(r->y, x);
+				}
 			}
 		}
 		
 			
 			
 		ShowSmoothCost(L, dispL);
-		EvaluateDisparity(dispL, 0.5f, coeffsL);
+		EvaluateDisparity(dispL, 0.5f, coeffsL, EVAL_SAVE_IMAGES | EVAL_SHOW_GUI);
 
 		/*WriteToPlyFile(dispL, imL, folders[folder_id] + "Ransac+QuadraticImprove.ply");*/
 		//std::string cmd("meshlab D:/code/PatchMatchStereo/PatchMatchStereo/" + folders[folder_id] + "Ransac+QuadraticImprove.ply");
@@ -1242,10 +1732,10 @@ void PlanefitView(cv::Mat& imL, VECBITMAP<float>& dsiL, VECBITMAP<Plane>& coeffs
 
 
 
-	//#pragma omp parallel for
+	//#pragma omp parallel for schedule(dynamic, 1)
 	for (int id = 0; id < nlables; id++) {
-		// This function is not thread-safe!
-		//NelderMeadEstimate(regionList[id], dsiL, dispL, coeffsL);
+		//std::mt19937 rng(id);
+		//NelderMeadEstimate(regions, id, dsiL, dispL, coeffsL, rng);
 	}
 	g_coeffsL_neldermead = coeffsL;
 	Timer::toc();
@@ -1262,30 +1752,36 @@ void PlanefitView(cv::Mat& imL, VECBITMAP<float>& dsiL, VECBITMAP<Plane>& coeffs
 			cc.get(y, x)[2] = coeffsL[y][x].c;
 		}
 	}
-	cc.SaveToBinaryFile(folders[folder_id] + "coeffsL.bin");
+	cc.SaveToFile(folders[folder_id] + "coeffsL.bin", RunParameters());
 
 	for (int id = 0; id < nlables; id++) {
 		// Optimize nonlinear part
-		//NelderMeadImproveNonlinear(regionList[id], dsiL, dispL, coeffsL, L);
+		//NelderMeadImproveNonlinear(regions, id, dsiL, dispL, coeffsL, L, rng);
 	}
 
-	labelmap.SaveToBinaryFile(folders[folder_id] + "labelmap.bin");
+	labelmap.SaveToFile(folders[folder_id] + "labelmap.bin", RunParameters());
 
-	EvaluateDisparity(dispL, 0.5f, coeffsL);
+	EvaluateDisparity(dispL, 0.5f, coeffsL, EVAL_SAVE_IMAGES | EVAL_SHOW_GUI);
 }
 
-void RunRansacPlaneFitting(cv::Mat& imL, cv::Mat& imR, int ndisps)
+VECBITMAP<float> RunRansacPlaneFitting(cv::Mat& imL, cv::Mat& imR, int ndisps)
 {
 	VECBITMAP<float> dsiL = ComputeAdGradientCostVolume(imL, imR, ndisps, -1, granularity);
 	VECBITMAP<float> dsiR = ComputeAdGradientCostVolume(imR, imL, ndisps, +1, granularity);
 
-	VECBITMAP<float> adcensus_dsiL = ComputeAdCensusCostVolume(imL, imR, ndisps, -1);
-	VECBITMAP<float> adcensus_dsiR = ComputeAdCensusCostVolume(imR, imL, ndisps, +1);
+	// The census volumes are only needed for the initial disparities, one at a time.
+	VECBITMAP<float> dispL, dispR;
+	{
+		VECBITMAP<float> adcensus_dsiL = ComputeAdCensusCostVolume(imL, imR, ndisps, -1);
+		dispL = WinnerTakesAll(adcensus_dsiL, 1.0);
+	}
+	{
+		VECBITMAP<float> adcensus_dsiR = ComputeAdCensusCostVolume(imR, imL, ndisps, +1);
+		dispR = WinnerTakesAll(adcensus_dsiR, 1.0);
+	}
 
 	//VECBITMAP<float> dispL = WinnerTakesAll(dsiL, granularity);
 	//VECBITMAP<float> dispR = WinnerTakesAll(dsiR, granularity);
-	VECBITMAP<float> dispL = WinnerTakesAll(adcensus_dsiL, 1.0);
-	VECBITMAP<float> dispR = WinnerTakesAll(adcensus_dsiR, 1.0);
 	//VECBITMAP<float> dispL(nrows, ncols), dispR(nrows, ncols);
 	//cv::Mat gtL = cv::imread(folders[folder_id] + "disp2.png", CV_LOAD_IMAGE_GRAYSCALE);
 	//cv::Mat gtR = cv::imread(folders[folder_id] + "disp6.png", CV_LOAD_IMAGE_GRAYSCALE);
@@ -1314,10 +1810,13 @@ void RunRansacPlaneFitting(cv::Mat& imL, cv::Mat& imR, int ndisps)
 	//Timer::tic("Planefit Postprocess");
 	//PostProcess(weightsL, weightsR, coeffsL, coeffsR, dispL, dispR);
 
-	WriteToPlyFile(dispL, imL, folders[folder_id] + "Ransac+QuadraticImprove.ply");
-	std::string cmd("meshlab D:/code/PatchMatchStereo/PatchMatchStereo/" + folders[folder_id] + "Ransac+QuadraticImprove.ply");
-	system(cmd.c_str());
-	
+	if (!g_batchMode) {
+		WriteToPlyFile(dispL, imL, folders[folder_id] + "Ransac+QuadraticImprove.ply");
+		WriteToPfmFile(dispL, folders[folder_id] + "Ransac+QuadraticImprove.pfm");
+		std::string cmd("meshlab D:/code/PatchMatchStereo/PatchMatchStereo/" + folders[folder_id] + "Ransac+QuadraticImprove.ply");
+		system(cmd.c_str());
+	}
+	return dispL;
 }
 
 
@@ -8,7 +8,24 @@
 #include <cmath>
 #include <iostream>
 #include <fstream>
+#include <omp.h>
 #include "SLIC.h"
+#include "ColorConversion.h"
+
+#define SLIC_MAX_ITERATIONS		10
+#define SLIC_CONVERGENCE_SHIFT	0.75	// mean seed move, in units of the SLIC distance, that ends the parallel iterations
+
+// Centroid sums of one seed over a part of the image: l, a, b, x, y and size.
+struct SeedSums
+{
+	int k;
+	double s[6];
+};
+
+static bool SeedSumsLess(const SeedSums& a, const SeedSums& b)
+{
+	return a.k < b.k;
+}
 
 
 //////////////////////////////////////////////////////////////////////
@@ -122,27 +139,20 @@ void SLIC::RGB2LAB(const int& sR, const int& sG, const int& sB, double& lval, do
 //===========================================================================
 ///	DoRGBtoLABConversion
 ///
-///	For whole image: overlaoded floating point version
+///	For whole image: single precision, table-driven (see ColorConversion.h)
 //===========================================================================
 void SLIC::DoRGBtoLABConversion(
 	const unsigned int*&		ubuff,
-	double*&					lvec,
-	double*&					avec,
-	double*&					bvec)
+	float*&						lvec,
+	float*&						avec,
+	float*&						bvec)
 {
 	int sz = m_width*m_height;
-	lvec = new double[sz];
-	avec = new double[sz];
-	bvec = new double[sz];
+	lvec = new float[sz];
+	avec = new float[sz];
+	bvec = new float[sz];
 
-	for( int j = 0; j < sz; j++ )
-	{
-		int r = (ubuff[j] >> 16) & 0xFF;
-		int g = (ubuff[j] >>  8) & 0xFF;
-		int b = (ubuff[j]      ) & 0xFF;
-
-		RGB2LAB( r, g, b, lvec[j], avec[j], bvec[j] );
-	}
+	ConvertArgbToLab(ubuff, sz, lvec, avec, bvec);
 }
 
 //===========================================================================
@@ -281,9 +291,9 @@ void SLIC::DrawContoursAroundSegments(
 ///	DetectLabEdges
 //==============================================================================
 void SLIC::DetectLabEdges(
-	const double*				lvec,
-	const double*				avec,
-	const double*				bvec,
+	const float*				lvec,
+	const float*				avec,
+	const float*				bvec,
 	const int&					width,
 	const int&					height,
 	vector<double>&				edges)
@@ -627,6 +637,185 @@ void SLIC::PerformSuperpixelSLIC(
 	}
 }
 
+//===========================================================================
+///	PerformSuperpixelSLIC_Parallel
+///
+///	Same clustering as PerformSuperpixelSLIC, but the image is cut into bands
+/// of STEP rows and each thread runs the seed window loop over its own bands
+/// only, so no two threads write the same pixel. Works on the float LAB planes
+/// and float copies of the seeds, sums the new centroids of each band over the
+/// few seeds it holds, adds the bands up in order, and stops early once the
+/// seeds move less than SLIC_CONVERGENCE_SHIFT on average.
+//===========================================================================
+void SLIC::PerformSuperpixelSLIC_Parallel(
+	vector<double>&				kseedsl,
+	vector<double>&				kseedsa,
+	vector<double>&				kseedsb,
+	vector<double>&				kseedsx,
+	vector<double>&				kseedsy,
+	int*&						klabels,
+	const int&					STEP,
+	const double&				M)
+{
+	const int sz = m_width*m_height;
+	const int numk = kseedsl.size();
+	const int offset = STEP;
+
+	//----------------------------------------------
+	// Float structure-of-arrays copies of the seeds
+	//----------------------------------------------
+	const float *lvec = m_lvec, *avec = m_avec, *bvec = m_bvec;
+	vector<float> seedl(kseedsl.begin(), kseedsl.end());
+	vector<float> seeda(kseedsa.begin(), kseedsa.end());
+	vector<float> seedb(kseedsb.begin(), kseedsb.end());
+	vector<float> seedx(kseedsx.begin(), kseedsx.end());
+	vector<float> seedy(kseedsy.begin(), kseedsy.end());
+	vector<float> distvec(sz);
+	vector<int> winx1(numk), winx2(numk), winy1(numk), winy2(numk);
+
+	const int nbands = (m_height + STEP - 1)/STEP;
+	vector<vector<SeedSums> > bandsums(nbands);	// sums of the seeds present in each band, by seed
+	vector<double> sigma(numk*6);				// l, a, b, x, y and size of every seed
+
+	const float invwt = 1.0/((STEP/M)*(STEP/M));
+
+	for( int itr = 0; itr < SLIC_MAX_ITERATIONS; itr++ )
+	{
+		for( int n = 0; n < numk; n++ )
+		{
+			winy1[n] = max(0.f,				seedy[n] - offset);
+			winy2[n] = min(float(m_height),	seedy[n] + offset);
+			winx1[n] = max(0.f,				seedx[n] - offset);
+			winx2[n] = min(float(m_width),	seedx[n] + offset);
+		}
+
+		#pragma omp parallel
+		{
+			vector<SeedSums> runs;
+
+			#pragma omp for schedule(static)
+			for( int band = 0; band < nbands; band++ )
+			{
+				const int by1 = band*STEP;
+				const int by2 = min(m_height, by1 + STEP);
+				for( int i = by1*m_width; i < by2*m_width; i++ ) distvec[i] = FLT_MAX;
+
+				//-----------------------------------------
+				// Seeds in index order, clipped to the band
+				//-----------------------------------------
+				for( int n = 0; n < numk; n++ )
+				{
+					const int y1 = max(by1, winy1[n]);
+					const int y2 = min(by2, winy2[n]);
+					const float sl = seedl[n], sa = seeda[n], sb = seedb[n], sx = seedx[n], sy = seedy[n];
+
+					for( int y = y1; y < y2; y++ )
+					{
+						const float dy2 = (y - sy)*(y - sy);
+						for( int x = winx1[n]; x < winx2[n]; x++ )
+						{
+							const int i = y*m_width + x;
+							float dist =	(lvec[i] - sl)*(lvec[i] - sl) +
+											(avec[i] - sa)*(avec[i] - sa) +
+											(bvec[i] - sb)*(bvec[i] - sb);
+							dist += ((x - sx)*(x - sx) + dy2)*invwt;
+							if( dist < distvec[i] )
+							{
+								distvec[i] = dist;
+								klabels[i] = n;
+							}
+						}
+					}
+				}
+
+				//-----------------------------------------
+				// Sum the centroids of the band over runs
+				// of equal labels, then merge by seed
+				//-----------------------------------------
+				runs.clear();
+				for( int y = by1; y < by2; y++ )
+				{
+					for( int x = 0; x < m_width; )
+					{
+						const int i0 = y*m_width;
+						const int k = klabels[i0 + x];
+						SeedSums run = { k, {0, 0, 0, 0, (double)y, 0} };
+						const int x0 = x;
+						for( ; x < m_width && klabels[i0 + x] == k; x++ )
+						{
+							run.s[0] += lvec[i0 + x];
+							run.s[1] += avec[i0 + x];
+							run.s[2] += bvec[i0 + x];
+						}
+						if( k < 0 ) continue;
+						run.s[5] = x - x0;
+						run.s[3] = (x0 + x - 1)*run.s[5]*0.5;
+						run.s[4] *= run.s[5];
+						runs.push_back(run);
+					}
+				}
+				sort(runs.begin(), runs.end(), SeedSumsLess);
+
+				vector<SeedSums>& sums = bandsums[band];
+				sums.clear();
+				for( size_t r = 0; r < runs.size(); r++ )
+				{
+					if( sums.empty() || sums.back().k != runs[r].k )
+					{
+						sums.push_back(runs[r]);
+						continue;
+					}
+					for( int j = 0; j < 6; j++ ) sums.back().s[j] += runs[r].s[j];
+				}
+			}
+		}
+
+		sigma.assign(sigma.size(), 0);
+		for( int band = 0; band < nbands; band++ )
+		{
+			for( size_t r = 0; r < bandsums[band].size(); r++ )
+			{
+				const SeedSums& e = bandsums[band][r];
+				for( int j = 0; j < 6; j++ ) sigma[e.k*6 + j] += e.s[j];
+			}
+		}
+
+		//-----------------------------------------
+		// Move the seeds and measure how far they
+		// moved
+		//-----------------------------------------
+		double totalshift = 0;
+		#pragma omp parallel for reduction(+: totalshift)
+		for( int k = 0; k < numk; k++ )
+		{
+			const double *sum = &sigma[k*6];
+			if( sum[5] <= 0 ) continue;		// an empty cluster keeps its seed
+			const double inv = 1.0/sum[5];
+			const float l = sum[0]*inv, a = sum[1]*inv, b = sum[2]*inv, x = sum[3]*inv, y = sum[4]*inv;
+
+			double shift2 =	(l - seedl[k])*(l - seedl[k]) + (a - seeda[k])*(a - seeda[k]) + (b - seedb[k])*(b - seedb[k]) +
+							((x - seedx[k])*(x - seedx[k]) + (y - seedy[k])*(y - seedy[k]))*invwt;
+			totalshift += sqrt(shift2);
+
+			seedl[k] = l;
+			seeda[k] = a;
+			seedb[k] = b;
+			seedx[k] = x;
+			seedy[k] = y;
+		}
+		if( totalshift < SLIC_CONVERGENCE_SHIFT*numk ) break;
+	}
+
+	for( int k = 0; k < numk; k++ )
+	{
+		kseedsl[k] = seedl[k];
+		kseedsa[k] = seeda[k];
+		kseedsb[k] = seedb[k];
+		kseedsx[k] = seedx[k];
+		kseedsy[k] = seedy[k];
+	}
+}
+
 //===========================================================================
 ///	PerformSupervoxelSLIC
 ///
@@ -1139,7 +1328,7 @@ void SLIC::DoSuperpixelSegmentation_ForGivenSuperpixelSize(
     }
     else//RGB
     {
-        m_lvec = new double[sz]; m_avec = new double[sz]; m_bvec = new double[sz];
+        m_lvec = new float[sz]; m_avec = new float[sz]; m_bvec = new float[sz];
         for( int i = 0; i < sz; i++ )
         {
                 m_lvec[i] = ubuff[i] >> 16 & 0xff;
@@ -1195,6 +1384,49 @@ void SLIC::DoSuperpixelSegmentation_ForGivenNumberOfSuperpixels(
     DoSuperpixelSegmentation_ForGivenSuperpixelSize(ubuff,width,height,klabels,numlabels,superpixelsize,compactness);
 }
 
+//===========================================================================
+///	DoSuperpixelSegmentation_ForGivenNumberOfSuperpixels_Parallel
+///
+/// Multithreaded variant of DoSuperpixelSegmentation_ForGivenNumberOfSuperpixels
+/// (LAB only, no seed perturbation), see PerformSuperpixelSLIC_Parallel().
+//===========================================================================
+void SLIC::DoSuperpixelSegmentation_ForGivenNumberOfSuperpixels_Parallel(
+    const unsigned int*                             ubuff,
+	const int					width,
+	const int					height,
+	int*&						klabels,
+	int&						numlabels,
+	const int&					K,//required number of superpixels
+    const double&                                   compactness)//weight given to spatial distance
+{
+    const int superpixelsize = 0.5+double(width*height)/double(K);
+    const int STEP = sqrt(double(superpixelsize))+0.5;
+
+	vector<double> kseedsl(0);
+	vector<double> kseedsa(0);
+	vector<double> kseedsb(0);
+	vector<double> kseedsx(0);
+	vector<double> kseedsy(0);
+
+	m_width  = width;
+	m_height = height;
+	int sz = m_width*m_height;
+	klabels = new int[sz];
+	for( int s = 0; s < sz; s++ ) klabels[s] = -1;
+
+	DoRGBtoLABConversion(ubuff, m_lvec, m_avec, m_bvec);
+	vector<double> edgemag(0);
+	GetLABXYSeeds_ForGivenStepSize(kseedsl, kseedsa, kseedsb, kseedsx, kseedsy, STEP, false, edgemag);
+
+	PerformSuperpixelSLIC_Parallel(kseedsl, kseedsa, kseedsb, kseedsx, kseedsy, klabels, STEP, compactness);
+	numlabels = kseedsl.size();
+
+	int* nlabels = new int[sz];
+	EnforceLabelConnectivity(klabels, m_width, m_height, nlabels, numlabels, double(sz)/double(STEP*STEP));
+	{for(int i = 0; i < sz; i++ ) klabels[i] = nlabels[i];}
+	if(nlabels) delete [] nlabels;
+}
+
 //===========================================================================
 ///	DoSupervoxelSegmentation
 ///
@@ -48,6 +48,17 @@ public:
                 const int&					K,//required number of superpixels
                 const double&                                   compactness);//10-20 is a good value for CIELAB space
 	//============================================================================
+	// Same as above, using all cores (see PerformSuperpixelSLIC_Parallel)
+	//============================================================================
+        void DoSuperpixelSegmentation_ForGivenNumberOfSuperpixels_Parallel(
+        const unsigned int*                             ubuff,
+		const int					width,
+		const int					height,
+		int*&						klabels,
+		int&						numlabels,
+                const int&					K,
+                const double&                                   compactness);
+	//============================================================================
 	// Supervoxel segmentation for a given step size (supervoxel size ~= step*step*step)
 	//============================================================================
 	void DoSupervoxelSegmentation(
@@ -104,6 +115,18 @@ private:
                 const vector<double>&		edgemag,
 		const double&				m = 10.0);
 	//============================================================================
+	// Parallel SLIC on float buffers, with early termination
+	//============================================================================
+	void PerformSuperpixelSLIC_Parallel(
+		vector<double>&				kseedsl,
+		vector<double>&				kseedsa,
+		vector<double>&				kseedsb,
+		vector<double>&				kseedsx,
+		vector<double>&				kseedsy,
+		int*&						klabels,
+		const int&					STEP,
+		const double&				M);
+	//============================================================================
 	// The main SLIC algorithm for generating supervoxels
 	//============================================================================
 	void PerformSupervoxelSLIC(
@@ -154,9 +177,9 @@ private:
 	// Detect color edges, to help PerturbSeeds()
 	//============================================================================
 	void DetectLabEdges(
-		const double*				lvec,
-		const double*				avec,
-		const double*				bvec,
+		const float*				lvec,
+		const float*				avec,
+		const float*				bvec,
 		const int&					width,
 		const int&					height,
 		vector<double>&				edges);
@@ -185,9 +208,9 @@ private:
 	//============================================================================
 	void DoRGBtoLABConversion(
 		const unsigned int*&		ubuff,
-		double*&					lvec,
-		double*&					avec,
-		double*&					bvec);
+		float*&						lvec,
+		float*&						avec,
+		float*&						bvec);
 	//============================================================================
 	// sRGB to CIELAB conversion for 3-D volumes
 	//============================================================================
@@ -222,9 +245,9 @@ private:
 	int										m_height;
 	int										m_depth;
 
-	double*									m_lvec;
-	double*									m_avec;
-	double*									m_bvec;
+	float*									m_lvec;
+	float*									m_avec;
+	float*									m_bvec;
 
 	double**								m_lvecvec;
 	double**								m_avecvec;
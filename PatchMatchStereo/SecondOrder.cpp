@@ -16,27 +16,66 @@
 
 #include <omp.h>
 #include "Utilities.h"
+#include "Multigrid.h"
+
+
+#define USE_MULTIGRID_SOLVER
 
 
 extern int nrows, ncols;
 
 
-Eigen::SparseMatrix<double> PrecomputeSparseLTL(cv::Mat& cvImg)
+void ComputeSecondOrderWeights(cv::Mat& cvImg, VECBITMAP<float>& wLR, VECBITMAP<float>& wUD)
 {
+	// Per-pixel weights of the horizontal and vertical second-order terms.
+	// Pixels on the image border, where the second derivative is undefined, get zero weight.
 	cv::Mat blurImg;
 	cv::GaussianBlur(cvImg, blurImg, cv::Size(3, 3), 0.5);
 	assert(blurImg.isContinuous());
 	VECBITMAP<unsigned char> img(nrows, ncols, 3, blurImg.data);
-	cv::Mat weightImgLR(nrows, ncols, CV_32FC1);
-	cv::Mat weightImgUD(nrows, ncols, CV_32FC1);
 
-	// Construct LTWT.
 	const double sigma = 80;
+	memset(wLR.data, 0, nrows * ncols * sizeof(float));
+	memset(wUD.data, 0, nrows * ncols * sizeof(float));
+
+	#pragma omp parallel for
+	for (int y = 0; y < nrows; y++) {
+		for (int x = 0; x < ncols; x++) {
+			if (x > 0 && x < ncols - 1) {
+				unsigned char *p = img.get(y, x);
+				unsigned char *pL = img.get(y, x - 1);
+				unsigned char *pR = img.get(y, x + 1);
+				float diffL = fabs((float)p[0] - pL[0]) + fabs((float)p[1] - pL[1]) + fabs((float)p[2] - pL[2]);
+				float diffR = fabs((float)p[0] - pR[0]) + fabs((float)p[1] - pR[1]) + fabs((float)p[2] - pR[2]);
+				float wL = exp(-diffL / sigma);
+				float wR = exp(-diffR / sigma);
+				//float weight = std::min(wL, wR);
+				wLR[y][x] = wR;
+			}
+			if (y > 0 && y < nrows - 1) {
+				unsigned char *p = img.get(y, x);
+				unsigned char *pU = img.get(y - 1, x);
+				unsigned char *pD = img.get(y + 1, x);
+				float diffU = fabs((float)p[0] - pU[0]) + fabs((float)p[1] - pU[1]) + fabs((float)p[2] - pU[2]);
+				float diffD = fabs((float)p[0] - pD[0]) + fabs((float)p[1] - pD[1]) + fabs((float)p[2] - pD[2]);
+				float wU = exp(-diffU / sigma);
+				float wD = exp(-diffD / sigma);
+				//float weight = std::min(wU, wD);
+				wUD[y][x] = wD;
+			}
+		}
+	}
+}
+
+Eigen::SparseMatrix<double> PrecomputeSparseLTL(cv::Mat& cvImg)
+{
+	// Construct LTWT.
 	const int N = nrows * ncols;
 	std::vector<Eigen::Triplet<double>> coefficientsLR;
 	std::vector<Eigen::Triplet<double>> coefficientsUD;
 	coefficientsLR.reserve(3 * N);
 	coefficientsUD.reserve(3 * N);
+	TrackedBytes tripletBytes(6LL * N * sizeof(Eigen::Triplet<double>));
 
 	for (int y = 0, i = 0; y < nrows; y++) {
 		for (int x = 0; x < ncols; x++, i++) {
@@ -63,6 +102,10 @@ Eigen::SparseMatrix<double> PrecomputeSparseLTL(cv::Mat& cvImg)
 	Eigen::SparseMatrix<double> L2(N, N);
 	L1.setFromTriplets(coefficientsLR.begin(), coefficientsLR.end());
 	L2.setFromTriplets(coefficientsUD.begin(), coefficientsUD.end());
+	TrackedBytes operatorBytes(SparseBytes(L1) + SparseBytes(L2));
+
+	VECBITMAP<float> weightLR(nrows, ncols), weightUD(nrows, ncols);
+	ComputeSecondOrderWeights(cvImg, weightLR, weightUD);
 
 	coefficientsLR.clear();
 	coefficientsUD.clear();
@@ -71,42 +114,18 @@ Eigen::SparseMatrix<double> PrecomputeSparseLTL(cv::Mat& cvImg)
 	for (int y = 0, i = 0; y < nrows; y++) {
 		for (int x = 0; x < ncols; x++, i++) {
 			if (x > 0 && x < ncols - 1) {
-				unsigned char *p = img.get(y, x);
-				unsigned char *pL = img.get(y, x - 1);
-				unsigned char *pR = img.get(y, x + 1);
-				float diffL = fabs((float)p[0] - pL[0]) + fabs((float)p[1] - pL[1]) + fabs((float)p[2] - pL[2]);
-				float diffR = fabs((float)p[0] - pR[0]) + fabs((float)p[1] - pR[1]) + fabs((float)p[2] - pR[2]);
-				float wL = exp(-diffL / sigma);
-				float wR = exp(-diffR / sigma);
-				//float weight = std::min(wL, wR);
-				float weight = wR;
-
-				Eigen::Triplet<double> triplet(i, i, weight);
+				Eigen::Triplet<double> triplet(i, i, weightLR[y][x]);
 				coefficientsLR.push_back(triplet);
-
-				weightImgLR.at<float>(y, x) = weight;
 			}
 			if (y > 0 && y < nrows - 1) {
-				unsigned char *p = img.get(y, x);
-				unsigned char *pU = img.get(y - 1, x);
-				unsigned char *pD = img.get(y + 1, x);
-				float diffU = fabs((float)p[0] - pU[0]) + fabs((float)p[1] - pU[1]) + fabs((float)p[2] - pU[2]);
-				float diffD = fabs((float)p[0] - pD[0]) + fabs((float)p[1] - pD[1]) + fabs((float)p[2] - pD[2]);
-				float wU = exp(-diffU / sigma);
-				float wD = exp(-diffD / sigma);
-				//float weight = std::min(wU, wD);
-				float weight = wD;
-
-				Eigen::Triplet<double> triplet(i, i, weight);
+				Eigen::Triplet<double> triplet(i, i, weightUD[y][x]);
 				coefficientsUD.push_back(triplet);
-
-				weightImgUD.at<float>(y, x) = weight;
 			}
 		}
 	}
 
-	//weightImgLR.convertTo(weightImgLR, CV_8UC3, 255);
-	//weightImgUD.convertTo(weightImgUD, CV_8UC3, 255);
+	//cv::Mat weightImgLR(nrows, ncols, CV_32FC1, weightLR.data);
+	//cv::Mat weightImgUD(nrows, ncols, CV_32FC1, weightUD.data);
 	//cv::imshow("weightLR", weightImgLR);
 	//cv::imshow("weightUD", weightImgUD);
 	//cv::waitKey(0);
@@ -117,11 +136,44 @@ Eigen::SparseMatrix<double> PrecomputeSparseLTL(cv::Mat& cvImg)
 	W2.setFromTriplets(coefficientsUD.begin(), coefficientsUD.end());
 
 	Eigen::SparseMatrix<double> LTL = L1.transpose() * W1 * L1 + L2.transpose() * W2 * L2;
+	TrackedBytes ltlBytes(SparseBytes(LTL));
 	printf("L.nonZeros = %d, LTL.nonZeros = %d\n", L1.nonZeros(), LTL.nonZeros());
 
 	return LTL;
 }
 
+// The symbolic analysis of LTL + theta * G only depends on its sparsity pattern, which is the same
+// for all images of a size. It is done once and reused for every theta, and by the jobs of --serve.
+static std::unique_ptr<Eigen::SimplicialCholesky<Eigen::SparseMatrix<double>>> cachedChol;
+static std::vector<int> cachedOuter, cachedInner;
+
+static Eigen::SimplicialCholesky<Eigen::SparseMatrix<double>>& AnalyzedCholesky(const Eigen::SparseMatrix<double>& A)
+{
+	bool samePattern = cachedOuter.size() == A.outerSize() + 1 && cachedInner.size() == A.nonZeros()
+		&& std::equal(cachedOuter.begin(), cachedOuter.end(), A.outerIndexPtr())
+		&& std::equal(cachedInner.begin(), cachedInner.end(), A.innerIndexPtr());
+	if (!samePattern) {
+		cachedChol.reset(new Eigen::SimplicialCholesky<Eigen::SparseMatrix<double>>);
+		cachedChol->analyzePattern(A);
+		cachedOuter.assign(A.outerIndexPtr(), A.outerIndexPtr() + A.outerSize() + 1);
+		cachedInner.assign(A.innerIndexPtr(), A.innerIndexPtr() + A.nonZeros());
+	}
+	return *cachedChol;
+}
+
+// With the buffer pool on (--serve), the multigrid hierarchy is kept as well, and the next image of
+// the same size is rebuilt in its buffers.
+static MGHierarchy keptMG;
+
+void ReleaseSolverCaches()
+{
+	cachedChol.reset();
+	std::vector<int>().swap(cachedOuter);
+	std::vector<int>().swap(cachedInner);
+	keptMG = MGHierarchy();
+	ReleaseMultigridCaches();
+}
+
 VECBITMAP<float> SolveSecondOrderSmootheness(VECBITMAP<float>& dv, float theta, Eigen::SparseMatrix<double>& LTL)
 {
 	const int N = nrows * ncols;
@@ -133,7 +185,11 @@ VECBITMAP<float> SolveSecondOrderSmootheness(VECBITMAP<float>& dv, float theta,
 		v[i] = dv.data[i];
 	}
 
-	Eigen::SimplicialCholesky<Eigen::SparseMatrix<double>> chol(LTL + theta * G);
+	Eigen::SparseMatrix<double> A = LTL + theta * G;
+	Eigen::SimplicialCholesky<Eigen::SparseMatrix<double>>& chol = AnalyzedCholesky(A);
+	chol.factorize(A);
+	// The factor is not exposed by SimplicialCholesky; its size is at least that of the system matrix.
+	TrackedBytes factorBytes(SparseBytes(LTL));
 	Eigen::VectorXd u = chol.solve(theta * G * v);
 	
 	VECBITMAP<float> du(nrows, ncols);
@@ -161,26 +217,40 @@ VECBITMAP<float> ConstrainedLocalSearch(VECBITMAP<float>&u, VECBITMAP<float>& ds
 	return WinnerTakesAll(dsi_constrained);
 }
 
-void RunLaplacianStereo(cv::Mat& imL, cv::Mat& imR, int ndisps)
+VECBITMAP<float> RunLaplacianStereo(cv::Mat& imL, cv::Mat& imR, int ndisps)
 {
 	// Initialize u and v from GT.
-	cv::Mat gt = cv::imread(folders[folder_id] + "disp2.png", CV_LOAD_IMAGE_GRAYSCALE);
-	gt.convertTo(gt, CV_32FC1);
-	gt /= 4;
-	assert(gt.isContinuous());
+	//cv::Mat gt = cv::imread(folders[folder_id] + "disp2.png", CV_LOAD_IMAGE_GRAYSCALE);
+	//gt.convertTo(gt, CV_32FC1);
+	//gt /= 4;
+	//assert(gt.isContinuous());
 
 	//VECBITMAP<float> u(nrows, ncols), v(nrows, ncols);
 	//memcpy(u.data, gt.data, nrows * ncols * sizeof(float));
 	//memcpy(v.data, gt.data, nrows * ncols * sizeof(float));
 
-	//VECBITMAP<float> dsiL = ComputeAdGradientCostVolume(imL, imR, ndisps, -1, 1.f);
-	VECBITMAP<float> dsiL = ComputeAdCensusCostVolume(imL, imR, ndisps, -1);
-	VECBITMAP<float> u = WinnerTakesAll(dsiL);
-	VECBITMAP<float> v = WinnerTakesAll(dsiL);
+	// The census volume is only needed for the initialization, free it before PatchMatch fills its state.
+	VECBITMAP<float> u, v;
+	{
+		//VECBITMAP<float> dsiL = ComputeAdGradientCostVolume(imL, imR, ndisps, -1, 1.f);
+		VECBITMAP<float> dsiL = ComputeAdCensusCostVolume(imL, imR, ndisps, -1);
+		u = WinnerTakesAll(dsiL);
+		v = WinnerTakesAll(dsiL);
+	}
 
+#ifndef USE_MULTIGRID_SOLVER
 	Timer::tic("Prepare LTL matrix");
 	Eigen::SparseMatrix<double> LTL = PrecomputeSparseLTL(imL);
+	TrackedBytes ltlBytes(SparseBytes(LTL));
 	Timer::toc();
+#else
+	Timer::tic("Prepare multigrid hierarchy");
+	MGHierarchy localMG;
+	MGHierarchy& mg = BufferPool::Enabled() ? keptMG : localMG;
+	PrecomputeMultigridHierarchy(imL, mg);
+	TrackedBytes mgBytes(MultigridBytes(mg));
+	Timer::toc();
+#endif
 
 	
 	
@@ -209,13 +279,14 @@ void RunLaplacianStereo(cv::Mat& imL, cv::Mat& imR, int ndisps)
 	VECBITMAP<float> uR(nrows, ncols);
 	VECBITMAP<float> vL(nrows, ncols);
 	VECBITMAP<float> vR(nrows, ncols);
+	PatchMatchState pmState;
 
 	for (float theta = 0.f; theta < 20; /*theta *= 1.5f*/) {
 
 		printf("\ntheta = %f\n\n", theta);
 
 		Timer::tic("PatchMatchSearch");
-		RunPatchMatchStereo(imL, imR, ndisps, uL, uR, theta, lambda);
+		RunPatchMatchStereo(imL, imR, ndisps, uL, uR, theta, lambda, pmState);
 		vL = uL;
 		vR = uR;
 		Timer::toc();
@@ -226,12 +297,22 @@ void RunLaplacianStereo(cv::Mat& imL, cv::Mat& imR, int ndisps)
 		else theta *= 1.5f;
 
 		Timer::tic("SolveSecondOrderSmoothness");
+#ifndef USE_MULTIGRID_SOLVER
 		uL = SolveSecondOrderSmootheness(vL, theta, LTL);
 		uR = SolveSecondOrderSmootheness(vR, theta, LTL);
+#else
+		// A couple of V-cycles are good enough while theta is small, v is still far from converged.
+		int ncycles = (theta < 1.f ? 2 : 0);
+		uL = SolveSecondOrderSmoothenessMG(vL, theta, mg, ncycles);
+		uR = SolveSecondOrderSmoothenessMG(vR, theta, mg, ncycles);
+#endif
 		Timer::toc();
 		//EvaluateDisparity(uL, 0.5f);
 	}
 
-	EvaluateDisparity(vL, 0.5f);
-	EvaluateDisparity(uL, 0.5f);
+	if (!g_batchMode) {
+		EvaluateDisparity(vL, 0.5f);
+		EvaluateDisparity(uL, 0.5f);
+	}
+	return uL;
 }
@@ -0,0 +1,326 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <sstream>
+#include <exception>
+#include <algorithm>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <omp.h>
+#include "Utilities.h"
+#include "Benchmark.h"
+#include "BinaryFile.h"
+#include "StereoServer.h"
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <signal.h>
+#endif
+
+
+#ifndef _WIN32
+
+extern int nrows, ncols;
+
+#define SERVER_DEFAULT_SOCKET		"/tmp/patchmatchstereo.sock"
+#define SERVER_DEFAULT_OUT_DIR		"/dev/shm/"
+#define SERVER_DEFAULT_NDISPS		64
+#define SERVER_BACKLOG				16
+#define SERVER_MAX_LINE				4096
+
+struct StereoJob {
+	std::string pipeline, left, right, out;
+	int ndisps;
+	StereoJob() : pipeline("patchmatch"), ndisps(SERVER_DEFAULT_NDISPS) {}
+};
+
+// What is kept between jobs besides the pooled buffers.
+struct ServerState {
+	int njobs;
+	int rows, cols, ndisps;		// configuration of the last job, whose buffers the pool holds
+	std::string pipeline;
+	ServerState() : njobs(0), rows(-1), cols(-1), ndisps(-1) {}
+};
+
+// An input image, mapped if it is a VECBITMAP file, decoded otherwise.
+struct JobImage {
+	VECBITMAP<unsigned char> mapped;
+	cv::Mat img;
+};
+
+static bool IsVbmFile(const std::string& path)
+{
+	char magic[8];
+	FILE *fid = fopen(path.c_str(), "rb");
+	if (fid == NULL) {
+		return false;
+	}
+	bool ok = fread(magic, 1, sizeof(magic), fid) == sizeof(magic) && memcmp(magic, VBM_MAGIC, sizeof(magic)) == 0;
+	fclose(fid);
+	return ok;
+}
+
+static bool LoadJobImage(const std::string& path, JobImage& im, std::string& error)
+{
+	if (IsVbmFile(path)) {
+		if (!im.mapped.MapFromFile(path)) {
+			error = "cannot map " + path;
+			return false;
+		}
+		if (im.mapped.n != 3) {
+			error = path + " is not h x w x 3";
+			return false;
+		}
+		im.img = cv::Mat(im.mapped.h, im.mapped.w, CV_8UC3, im.mapped.data);
+		return true;
+	}
+	im.img = cv::imread(path);
+	if (im.img.empty()) {
+		error = "cannot read " + path;
+		return false;
+	}
+	return true;
+}
+
+static bool ParseJob(const std::string& request, StereoJob& job, std::string& error)
+{
+	std::istringstream in(request);
+	std::string item;
+	while (in >> item) {
+		size_t eq = item.find('=');
+		if (eq == std::string::npos) {
+			error = "expected key=value, got " + item;
+			return false;
+		}
+		std::string key = item.substr(0, eq), value = item.substr(eq + 1);
+		if		(key == "left")		{ job.left = value; }
+		else if (key == "right")	{ job.right = value; }
+		else if (key == "pipeline")	{ job.pipeline = value; }
+		else if (key == "ndisps")	{ job.ndisps = atoi(value.c_str()); }
+		else if (key == "out")		{ job.out = value; }
+		else {
+			error = "unknown key " + key;
+			return false;
+		}
+	}
+	if (job.left.empty() || job.right.empty()) {
+		error = "left and right are required";
+		return false;
+	}
+	if (!IsPipelineName(job.pipeline)) {
+		error = "unknown pipeline " + job.pipeline;
+		return false;
+	}
+	return true;
+}
+
+static std::string RunJob(const StereoJob& job, ServerState& state)
+{
+	std::string error;
+	JobImage L, R;
+	if (!LoadJobImage(job.left, L, error) || !LoadJobImage(job.right, R, error)) {
+		return "error " + error;
+	}
+	if (L.img.rows != R.img.rows || L.img.cols != R.img.cols) {
+		return "error the images differ in size";
+	}
+	if (job.ndisps < 1 || job.ndisps >= L.img.cols) {
+		return "error ndisps must be between 1 and the image width";
+	}
+
+	// The buffers of a job depend on the size, the disparity range and the pipeline; those of
+	// another configuration would mostly stay in the pool unused.
+	if (L.img.rows != state.rows || L.img.cols != state.cols || job.ndisps != state.ndisps || job.pipeline != state.pipeline) {
+		BufferPool::Clear();
+		if (L.img.rows != state.rows || L.img.cols != state.cols) {
+			ReleaseSolverCaches();
+		}
+		state.rows = L.img.rows;
+		state.cols = L.img.cols;
+		state.ndisps = job.ndisps;
+		state.pipeline = job.pipeline;
+	}
+	nrows = L.img.rows;
+	ncols = L.img.cols;
+	ndisps = job.ndisps;
+	dmax = ndisps - 1;
+	if (!PlanStereo(job.pipeline, nrows, ncols, ndisps)) {
+		return "error the predicted peak exceeds the memory budget";
+	}
+	// The pool is not tracked, it may only hold what the budget leaves next to the job.
+	if (g_memoryBudgetBytes > 0) {
+		BufferPool::SetLimit(std::max(0LL, g_memoryBudgetBytes - EstimatePeakBytes(job.pipeline, nrows, ncols, ndisps, g_plan)));
+	}
+
+	double start = omp_get_wtime();
+	VECBITMAP<float> disp = RunPipeline(job.pipeline, L.img, R.img);
+	double elapsed = omp_get_wtime() - start;
+	int id = ++state.njobs;
+
+	char buf[256];
+	std::string out = job.out;
+	if (out.empty()) {
+		sprintf(buf, SERVER_DEFAULT_OUT_DIR "patchmatchstereo-%d-%d.vbm", (int)getpid(), id);
+		out = buf;
+	}
+	sprintf(buf, "ndisps=%d\n", ndisps);
+	std::string params = "pipeline=" + job.pipeline + "\nleft=" + job.left + "\nright=" + job.right + "\n" + buf;
+	if (!disp.SaveToFile(out, params)) {
+		return "error cannot write " + out;
+	}
+
+	sprintf(buf, " rows=%d cols=%d seconds=%.3f plan=\"", nrows, ncols, elapsed);
+	return "ok out=" + out + buf + g_plan.Describe() + "\"";
+}
+
+static std::string HandleRequest(const std::string& request, ServerState& state)
+{
+	char buf[128];
+	if (request == "stats") {
+		sprintf(buf, "ok jobs=%d pooled_mb=%.1f", state.njobs, BufferPool::PooledBytes() / 1048576.0);
+		return buf;
+	}
+	StereoJob job;
+	std::string error;
+	if (!ParseJob(request, job, error)) {
+		return "error " + error;
+	}
+	printf("\n==== job: %s ====\n", request.c_str());
+	try {
+		return RunJob(job, state);
+	}
+	catch (const std::exception& e) {
+		// e.g. cv::Exception on an input the pipelines cannot handle, thrown outside of the parallel
+		// loops; an exception inside an OpenMP region still ends the process. The stages of the job
+		// that were left open are dropped.
+		Timer::Reset();
+		return std::string("error ") + e.what();
+	}
+}
+
+static bool WriteAll(int fd, const std::string& text)
+{
+	for (size_t done = 0; done < text.size();) {
+		ssize_t n = write(fd, text.data() + done, text.size() - done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		done += n;
+	}
+	return true;
+}
+
+int RunStereoServer(int argc, char **argv)
+{
+	std::string socketPath = SERVER_DEFAULT_SOCKET;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (i + 1 >= argc) {
+			printf("missing value for %s\n", arg.c_str());
+			return 1;
+		}
+		std::string value = argv[++i];
+		if (arg == "--socket") {
+			socketPath = value;
+		}
+		else if (arg == "--threads") {
+			omp_set_num_threads(atoi(value.c_str()));
+		}
+		else if (arg == "--mem-budget") {
+			g_memoryBudgetBytes = (long long)(atof(value.c_str()) * 1048576.0);
+		}
+		else {
+			printf("unknown option %s\n", arg.c_str());
+			return 1;
+		}
+	}
+
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (socketPath.size() >= sizeof(addr.sun_path)) {
+		printf("socket path %s is too long.\n", socketPath.c_str());
+		return 1;
+	}
+	strcpy(addr.sun_path, socketPath.c_str());
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(socketPath.c_str());		// left behind by a server that did not shut down
+	if (fd < 0 || bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SERVER_BACKLOG) != 0) {
+		printf("cannot listen on %s: %s\n", socketPath.c_str(), strerror(errno));
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);		// a client that hangs up must not end the server
+
+	g_batchMode = true;
+	BufferPool::Enable(true);
+	printf("listening on %s, %d threads\n", socketPath.c_str(), omp_get_max_threads());
+
+	ServerState state;
+	bool running = true;
+	while (running) {
+		int conn = accept(fd, NULL, NULL);
+		if (conn < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			printf("accept failed: %s\n", strerror(errno));
+			break;
+		}
+		// Any number of requests per connection, each answered before the next is read.
+		FILE *in = fdopen(conn, "r");
+		if (in == NULL) {
+			printf("fdopen failed: %s\n", strerror(errno));
+			close(conn);
+			continue;
+		}
+		char line[SERVER_MAX_LINE];
+		while (running && fgets(line, sizeof(line), in) != NULL) {
+			std::string request = line;
+			while (!request.empty() && (request[request.size() - 1] == '\n' || request[request.size() - 1] == '\r')) {
+				request.erase(request.size() - 1);
+			}
+			if (request.empty()) {
+				continue;
+			}
+			std::string reply;
+			if (request == "shutdown") {
+				reply = "ok";
+				running = false;
+			}
+			else {
+				reply = HandleRequest(request, state);
+			}
+			printf("%s\n", reply.c_str());
+			if (!WriteAll(conn, reply + "\n")) {
+				break;
+			}
+		}
+		fclose(in);
+	}
+
+	close(fd);
+	unlink(socketPath.c_str());
+	BufferPool::Enable(false);
+	return 0;
+}
+
+#else
+
+int RunStereoServer(int argc, char **argv)
+{
+	printf("--serve needs Unix domain sockets, which this build does not support.\n");
+	return 1;
+}
+
+#endif
@@ -0,0 +1,23 @@
+#pragma once
+
+
+// Service mode: listens on a Unix domain socket and runs one stereo job per request line, one job
+// at a time. Between jobs the process keeps its OpenMP threads, the buffers of the last image size,
+// disparity range and pipeline (BufferPool, limited by --mem-budget), and for the image size the
+// multigrid hierarchy of the laplacian pipeline with the symbolic factorization of its coarsest grid
+// (the symbolic Cholesky factorization when built without USE_MULTIGRID_SOLVER).
+//
+// PatchMatchStereo --serve [--socket /tmp/patchmatchstereo.sock] [--threads n] [--mem-budget MB]
+//
+// Request, one line of key=value pairs, paths without spaces:
+//     left=PATH right=PATH [pipeline=patchmatch] [ndisps=64] [out=PATH]
+// The images are anything cv::imread reads, or VECBITMAP files of unsigned char, h x w x 3 (see
+// BinaryFile.h), which are mapped instead of decoded; clients pass pairs through shared memory
+// by writing them to /dev/shm.
+// The disparities of the left view are written as a VECBITMAP<float> file to out, by default a new
+// file in /dev/shm, i.e. shared memory. The client maps it and removes it when done.
+// Reply, one line:
+//     ok out=PATH rows=R cols=C seconds=S plan="..."
+//     error MESSAGE
+// "stats" replies with the number of jobs and the pooled memory, "shutdown" stops the server.
+int RunStereoServer(int argc, char **argv);
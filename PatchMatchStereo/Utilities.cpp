@@ -2,6 +2,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cmath>
+#include <cfloat>
 #include <cstring>
 #include <ctime>
 #include <algorithm>
@@ -16,6 +17,7 @@
 #include <omp.h>
 #include "SLIC.h"
 #include "Utilities.h"
+#include "DatasetPack.h"
 
 
 
@@ -32,7 +34,7 @@ int g_seletedRegionId, g_OPTIMZE_TYPE;
 Plane g_selectedPlane;
 bool g_isPaste = false;
 
-extern std::vector<std::vector<cv::Point2d>> g_regionList;
+extern RegionIndex g_regions;
 extern VECBITMAP<int> g_labelmap;
 extern VECBITMAP<Plane> g_coeffsL_ransac, g_coeffsL_neldermead;
 extern VECBITMAP<float> g_dsiL;
@@ -131,16 +133,17 @@ double ComputePlaneCost(int yc, int xc, Plane& coeff_try, VECBITMAP<float>& colg
 	return cost;
 }
 
-float ComputeRegionCost(std::vector<cv::Point2d>& pointList, cv::Mat& disp)
+float ComputeRegionCost(RegionIndex& regions, int id, cv::Mat& disp)
 {
-	int regionSize = pointList.size();
 	float cost = 0.f;
-	for (int i = 0; i < regionSize; i++) {
-		int y = pointList[i].y, x = pointList[i].x;
-		float d = (float)disp.at<cv::Vec3b>(y, x)[0] / scale;
-		d = std::max(0.f, std::min((float)dmax, d));
-		int level = 0.5 + d / granularity;
-		cost += g_dsiL.get(y, x)[level];
+	for (RegionRun *r = regions.RunsBegin(id); r != regions.RunsEnd(id); r++) {
+		int y = r->y;
+		for (int x = r->x0; x < r->x1; x++) {
+			float d = (float)disp.at<cv::Vec3b>(y, x)[0] / scale;
+			d = std::max(0.f, std::min((float)dmax, d));
+			int level = 0.5 + d / granularity;
+			cost += g_dsiL.get(y, x)[level];
+		}
 	}
 	return cost;
 }
@@ -203,7 +206,7 @@ void on_mouse(int event, int x, int y, int flags, void *param)
 	}
 	if (event == CV_EVENT_LBUTTONDOWN) {
 		g_OPTIMZE_TYPE = OPTIMIZE_NONLINEAR_PART;
-		if (g_regionList.size() > 0) {
+		if (g_regions.NumRegions() > 0) {
 			x %= ncols; y %= nrows;
 			int id = g_labelmap[y][x];
 			g_seletedRegionId = id;
@@ -238,15 +241,15 @@ void on_mouse(int event, int x, int y, int flags, void *param)
 				/*float cost = ComputePlaneCost(y, x, g_coeffsL[y][x], g_colgradL, g_colgradR, weights, -1) / wsum;
 				printf("plane cost: %f\n", cost);*/
 			}
-			if (g_regionList.size() > 0) {
+			if (g_regions.NumRegions() > 0) {
 
 				//int id = g_labelmap[y][x];
 				//Plane coeff_ransac = g_coeffsL_ransac[y][x];
 				//Plane coeff_neldermead = g_coeffsL_neldermead[y][x];
 
-				//double ComputePlaneCost(Plane& coeff, VECBITMAP<float>& dsi, std::vector<cv::Point2d>& pointList);
-				//float cost_ransac = ComputePlaneCost(coeff_ransac, g_dsiL, g_regionList[id]);
-				//float cost_neldermead = ComputePlaneCost(coeff_neldermead, g_dsiL, g_regionList[id]);
+				//double ComputePlaneCost(Plane& coeff, VECBITMAP<float>& dsi, RegionIndex& regions, int id);
+				//float cost_ransac = ComputePlaneCost(coeff_ransac, g_dsiL, g_regions, id);
+				//float cost_neldermead = ComputePlaneCost(coeff_neldermead, g_dsiL, g_regions, id);
 
 				//printf("     RANSAC plane cost: %f\n", cost_ransac);
 				//printf("NELDER-MEAD plane cost: %f\n", cost_neldermead);
@@ -254,11 +257,8 @@ void on_mouse(int event, int x, int y, int flags, void *param)
 				int id = g_labelmap[y][x];
 				g_seletedRegionId = id;
 
-				std::vector<cv::Point2d> pointList = g_regionList[id];
-				int regionSize = pointList.size();
-				std::vector<float> dGT(regionSize), dMY(regionSize);
-				float gt_cost = ComputeRegionCost(pointList, g_GT);
-				float my_cost = ComputeRegionCost(pointList, g_mydisp);
+				float gt_cost = ComputeRegionCost(g_regions, id, g_GT);
+				float my_cost = ComputeRegionCost(g_regions, id, g_mydisp);
 				
 				printf("Region %d cost-> GT:%.1f, MY:%.1f\n", id, gt_cost, my_cost);
 			}
@@ -297,29 +297,189 @@ void on_mouse(int event, int x, int y, int flags, void *param)
 	}
 }
 
-void EvaluateDisparity(VECBITMAP<float>& h_disp, float thresh, VECBITMAP<Plane>& coeffsL)
+// Images of one Middlebury dataset, read once and kept until another folder_id is evaluated.
+struct GroundTruthCache {
+	StereoDataset ds;
+	void Load()
+	{
+		if (ds.folderId != folder_id) {
+			ds.Load(folder_id);
+		}
+	}
+	static cv::Mat ToBgr(const cv::Mat& img)
+	{
+		cv::Mat bgr;
+		if (!img.empty()) {
+			cv::cvtColor(img, bgr, CV_GRAY2BGR);
+		}
+		return bgr;
+	}
+};
+
+static GroundTruthCache g_groundTruth;
+
+void SetEvaluationDataset(const StereoDataset& ds)
 {
-	g_unQuantizedDisp = h_disp;
+	g_groundTruth.ds = ds;
+}
 
-	g_L = cv::imread(folders[folder_id] + "im2.png");
-	g_R = cv::imread(folders[folder_id] + "im6.png");
-	g_GT = cv::imread(folders[folder_id] + "disp2.png");
-	g_OC = cv::imread(folders[folder_id] + "nonocc.png");
-	g_ALL = cv::imread(folders[folder_id] + "all.png");
-	g_DISC = cv::imread(folders[folder_id] + "disc.png");
+// s as the contents of a JSON string.
+static std::string JsonEscape(const std::string& s)
+{
+	std::string out;
+	for (size_t i = 0; i < s.size(); i++) {
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		}
+		else if (c < 0x20) {
+			char buf[8];
+			sprintf(buf, "\\u%04x", c);
+			out += buf;
+		}
+		else {
+			out += c;
+		}
+	}
+	return out;
+}
+
+std::string EvaluationResult::ToJson() const
+{
+	const std::vector<float> *rates[3] = { &badNonocc, &badAll, &badDisc };
+	const char *names[3] = { "nonocc", "all", "disc" };
+	char buf[64];
+
+	std::string json = "{\"dataset\": \"" + JsonEscape(dataset) + "\", \"thresholds\": [";
+	for (size_t k = 0; k < thresholds.size(); k++) {
+		sprintf(buf, "%s%g", k ? ", " : "", thresholds[k]);
+		json += buf;
+	}
+	json += "]";
+	for (int m = 0; m < 3; m++) {
+		json += std::string(", \"") + names[m] + "\": [";
+		for (size_t k = 0; k < rates[m]->size(); k++) {
+			sprintf(buf, "%s%.6f", k ? ", " : "", (*rates[m])[k]);
+			json += buf;
+		}
+		json += "]";
+	}
+	json += "}";
+	return json;
+}
+
+EvaluationResult EvaluateDisparityHeadless(VECBITMAP<float>& disp, const std::vector<float>& thresholds)
+{
+	g_groundTruth.Load();
+	cv::Mat& gt = g_groundTruth.ds.gt;
+	cv::Mat& oc = g_groundTruth.ds.oc;
+	cv::Mat& all = g_groundTruth.ds.all;
+	cv::Mat& disc = g_groundTruth.ds.disc;
+
+	EvaluationResult result;
+	result.dataset = folders[folder_id];
+	result.thresholds = thresholds;
+	const cv::Mat *images[4] = { &gt, &oc, &all, &disc };
+	for (int i = 0; i < 4; i++) {
+		if (images[i]->rows != nrows || images[i]->cols != ncols || images[i]->type() != CV_8UC1) {
+			printf("no ground truth of %d x %d in %s.\n", nrows, ncols, folders[folder_id].c_str());
+			return result;
+		}
+	}
+
+	// A pixel is bad at threshold t when its disparity, quantized as in disp2.png,
+	// is more than scale * t away from the ground truth.
+	const int nthresh = thresholds.size();
+	std::vector<float> scaledThresh(nthresh);
+	for (int k = 0; k < nthresh; k++) {
+		scaledThresh[k] = scale * thresholds[k];
+	}
+
+	int count[3] = { 0, 0, 0 };
+	std::vector<int> bad(3 * nthresh, 0);
+
+	#pragma omp parallel
+	{
+		int localCount[3] = { 0, 0, 0 };
+		std::vector<int> localBad(3 * nthresh, 0);
+		std::vector<float> diff(ncols);
+
+		#pragma omp for
+		for (int y = 0; y < nrows; y++) {
+			const unsigned char *gtRow = gt.ptr<unsigned char>(y);
+			const unsigned char *masks[3] = { oc.ptr<unsigned char>(y), all.ptr<unsigned char>(y), disc.ptr<unsigned char>(y) };
+			for (int x = 0; x < ncols; x++) {
+				unsigned char d = (unsigned int)(scale * disp[y][x] + 0.5);
+				diff[x] = std::abs((float)d - (float)gtRow[x]);
+			}
+			for (int m = 0; m < 3; m++) {
+				const unsigned char *mask = masks[m];
+				for (int x = 0; x < ncols; x++) {
+					localCount[m] += (mask[x] == 255);
+				}
+				for (int k = 0; k < nthresh; k++) {
+					int n = 0;
+					for (int x = 0; x < ncols; x++) {
+						n += (mask[x] == 255) & (diff[x] > scaledThresh[k]);
+					}
+					localBad[m * nthresh + k] += n;
+				}
+			}
+		}
+
+		#pragma omp critical
+		{
+			for (int m = 0; m < 3; m++) {
+				count[m] += localCount[m];
+			}
+			for (int i = 0; i < 3 * nthresh; i++) {
+				bad[i] += localBad[i];
+			}
+		}
+	}
+
+	if (count[0] == 0 || count[1] == 0 || count[2] == 0) {
+		printf("a mask of %s selects no pixel.\n", folders[folder_id].c_str());
+		return result;
+	}
+	std::vector<float> *rates[3] = { &result.badNonocc, &result.badAll, &result.badDisc };
+	for (int m = 0; m < 3; m++) {
+		rates[m]->resize(nthresh);
+		for (int k = 0; k < nthresh; k++) {
+			(*rates[m])[k] = (float)bad[m * nthresh + k] / count[m];
+		}
+	}
+	return result;
+}
+
+void EvaluateDisparity(VECBITMAP<float>& h_disp, float thresh, VECBITMAP<Plane>& coeffsL, int options)
+{
+	EvaluationResult result = EvaluateDisparityHeadless(h_disp, std::vector<float>(1, thresh));
+	if (!result.Valid()) {
+		return;
+	}
+	printf("badPixelRate: %f%%, %f%%, %f%%\n",
+		result.badNonocc[0] * 100.0f, result.badAll[0] * 100.0f, result.badDisc[0] * 100.0f);
+
+	if (!(options & (EVAL_SAVE_IMAGES | EVAL_SHOW_GUI))) {
+		return;
+	}
+
+	g_unQuantizedDisp = h_disp;
+	g_L = g_groundTruth.ds.L;
+	g_R = g_groundTruth.ds.R;
+	g_GT = GroundTruthCache::ToBgr(g_groundTruth.ds.gt);
+	g_OC = GroundTruthCache::ToBgr(g_groundTruth.ds.oc);
+	g_ALL = GroundTruthCache::ToBgr(g_groundTruth.ds.all);
+	g_DISC = GroundTruthCache::ToBgr(g_groundTruth.ds.disc);
 
-	float count[3] = { 0, 0, 0 };
-	float badPixelRate[3] = { 0, 0, 0 };
 	cv::Mat disp(nrows, ncols, CV_8UC3), badOnALL(nrows, ncols, CV_8UC3), badOnOC(nrows, ncols, CV_8UC3), gray;
 	cv::cvtColor(g_L, gray, CV_BGR2GRAY);
 
 	for (int y = 0; y < nrows; y++) {
 		for (int x = 0; x < ncols; x++) {
 
-			count[0] += (g_OC.at<cv::Vec3b>(y, x)[0] == 255);
-			count[1] += (g_ALL.at<cv::Vec3b>(y, x)[0] == 255);
-			count[2] += (g_DISC.at<cv::Vec3b>(y, x)[0] == 255);
-
 			unsigned char g = gray.at<unsigned char>(y, x);
 			badOnALL.at<cv::Vec3b>(y, x) = cv::Vec3b(g, g, g);
 			badOnOC.at<cv::Vec3b>(y, x) = cv::Vec3b(g, g, g);
@@ -329,18 +489,11 @@ void EvaluateDisparity(VECBITMAP<float>& h_disp, float thresh, VECBITMAP<Plane>&
 
 			float diff = abs((float)disp.at<cv::Vec3b>(y, x)[0] - (float)g_GT.at<cv::Vec3b>(y, x)[0]);
 			if (g_OC.at<cv::Vec3b>(y, x)[0] == 255 && diff > scale * thresh) {
-				badPixelRate[0]++;
 				badOnOC.at<cv::Vec3b>(y, x) = cv::Vec3b(0, 0, 255);
 			}
 			if (g_ALL.at<cv::Vec3b>(y, x)[0] == 255 && diff > scale * thresh) {
-				badPixelRate[1]++;
 				badOnALL.at<cv::Vec3b>(y, x) = cv::Vec3b(0, 0, 255);
 			}
-			if (g_DISC.at<cv::Vec3b>(y, x)[0] == 255 && diff > scale * thresh)	{
-				badPixelRate[2]++;
-			}
-
-
 
 			if (g_OC.at<cv::Vec3b>(y, x)[0] == 0) {		//draw occlusion region
 				badOnOC.at<cv::Vec3b>(y, x) = cv::Vec3b(255, 0, 0);
@@ -351,54 +504,41 @@ void EvaluateDisparity(VECBITMAP<float>& h_disp, float thresh, VECBITMAP<Plane>&
 		}
 	}
 
-	for (int i = 0; i < 3; i++) {
-		badPixelRate[i] /= count[i];
-	}
-
-	printf("badPixelRate: %f%%, %f%%, %f%%\n",
-		badPixelRate[0] * 100.0f, badPixelRate[1] * 100.0f, badPixelRate[2] * 100.0f);
-
-	if (1)
-	{
-
-		cv::Mat compareImg(nrows * 2, ncols * 3, CV_8UC3);
-		cv::Mat outImg1 = compareImg(cv::Rect(0, 0, ncols, nrows)),
-			outImg2 = compareImg(cv::Rect(ncols, 0, ncols, nrows)),
-			outImg3 = compareImg(cv::Rect(0, nrows, ncols, nrows)),
-			outImg4 = compareImg(cv::Rect(ncols, nrows, ncols, nrows)),
-			outImg5 = compareImg(cv::Rect(ncols * 2, 0, ncols, nrows)),
-			outImg6 = compareImg(cv::Rect(ncols * 2, nrows, ncols, nrows));
-		g_GT.copyTo(outImg1);	disp.copyTo(outImg2);
-		g_segments.copyTo(outImg3);	badOnOC.copyTo(outImg4);
-		g_L.copyTo(outImg5);	badOnALL.copyTo(outImg6);
-
-		//printf("111111\n");
+	cv::Mat compareImg(nrows * 2, ncols * 3, CV_8UC3);
+	cv::Mat outImg1 = compareImg(cv::Rect(0, 0, ncols, nrows)),
+		outImg2 = compareImg(cv::Rect(ncols, 0, ncols, nrows)),
+		outImg3 = compareImg(cv::Rect(0, nrows, ncols, nrows)),
+		outImg4 = compareImg(cv::Rect(ncols, nrows, ncols, nrows)),
+		outImg5 = compareImg(cv::Rect(ncols * 2, 0, ncols, nrows)),
+		outImg6 = compareImg(cv::Rect(ncols * 2, nrows, ncols, nrows));
+	g_GT.copyTo(outImg1);	disp.copyTo(outImg2);
+	g_segments.copyTo(outImg3);	badOnOC.copyTo(outImg4);
+	g_L.copyTo(outImg5);	badOnALL.copyTo(outImg6);
+
+	if (options & EVAL_SAVE_IMAGES) {
 		std::string folderpath = folders[folder_id];
-		char buf[256];
-		//sprintf(buf, "%s=%.2f.png", folderpath.substr(0, folderpath.length() - 1).c_str(), badPixelRate[0] * 100.0f);
-		//std::string filename(buf);
 		std::string filename = folderpath + folderpath.substr(0, folderpath.length() - 1) + ".png";
 		std::string filename2 = folderpath + folderpath.substr(0, folderpath.length() - 1) + "_err.png";
 		cv::imwrite(filename, disp);
 		cv::imwrite(filename2, compareImg);
 
-		cv::imwrite(folders[folder_id] + "disparity.png", disp);
-		cv::imwrite("d:\\disparity.png", disp);
-		cv::imwrite("d:\\badOnALL.png", badOnALL);
-		cv::imwrite("d:\\badOnOC.png", badOnOC);
-
+		cv::imwrite(folderpath + "disparity.png", disp);
+		WriteToPfmFile(h_disp, folderpath + "disparity.pfm");
+		WriteToPng16File(h_disp, folderpath + "disparity16.png");
+		cv::imwrite(folderpath + "badOnALL.png", badOnALL);
+		cv::imwrite(folderpath + "badOnOC.png", badOnOC);
+	}
 
+	if (options & EVAL_SHOW_GUI) {
 		g_colgradL = ComputeColGradFeature(g_L);
 		g_colgradR = ComputeColGradFeature(g_R);
 		g_coeffsL = coeffsL;
 		g_stereo = compareImg;
 		g_mydisp = disp;
 
-
 		cv::imshow("disparity", compareImg);
 		cv::setMouseCallback("disparity", on_mouse);
 		cv::waitKey(0);
-
 	}
 }
 
@@ -418,81 +558,201 @@ cv::Vec3f CrossProduct(cv::Vec3f& u, cv::Vec3f& v)
 	return w;
 }
 
-void WriteToPlyFile(VECBITMAP<float>& disp, cv::Mat& img, std::string filepath)
-{
-	const float f = 3740;
-	const float B = 160;
-	const float cutoff = 15;
-	float dmin = 240;
-	FILE *ff = fopen((folders[folder_id] + "dmin.txt").c_str(), "r");
-	if (ff != NULL) {
-		fscanf(ff, "%f", &dmin);
-		fclose(ff);
-	}
-	printf("dmin = %f\n", dmin);
+// Rows formatted per parallel work item when writing a PLY file.
+#define PLY_ROWS_PER_CHUNK		32
 
-	VECBITMAP<float> X(nrows, ncols), Y(nrows, ncols), Z(nrows, ncols);
+// The binary PLY and PFM writers copy floats straight from memory into files declared
+// little-endian, which holds on every platform we build on.
 
-	for (int y = 0; y < nrows; y++) {
-		for (int x = 0; x < ncols; x++) {
-			float d = disp[y][x];
-			d = std::max(d, cutoff);
-			d = std::min(d, (float)dmax);
-			d += dmin;
-			Z[y][x] = f * B / d;
-			X[y][x] = x * Z[y][x] / f;
-			Y[y][x] = y * Z[y][x] / f;
-		}
+struct PlyCamera {
+	float f, B, cutoff, dmin;
+	// Back-projects pixel (y, x) with disparity d, clamped as in the old Matlab script.
+	void Point(float d, int y, int x, float *P)
+	{
+		d = std::max(d, cutoff);
+		d = std::min(d, (float)dmax);
+		d += dmin;
+		P[2] = f * B / d;
+		P[0] = x * P[2] / f;
+		P[1] = y * P[2] / f;
 	}
+};
 
-	//	D = D(:, : , 1);
-	//D(D < cutoff) = cutoff;
-	//D = D + dmin;
-
-	//Z = f*B. / D;
-
-	//[nrows, ncols] = size(D);
-	//[u, v] = meshgrid(1:ncols, 1 : nrows);
-
-	//X = u.*Z / f;
-	//Y = v.*Z / f;
+static void FormatPlyRows(VECBITMAP<float>& disp, cv::Mat& img, VECBITMAP<Plane> *coeffs, PlyCamera& cam,
+	int ybegin, int yend, bool binary, std::vector<char>& buf)
+{
+	const int vertexBytes = 6 * sizeof(float) + 3;
+	buf.clear();
+	if (binary) {
+		buf.reserve((yend - ybegin) * ncols * vertexBytes);
+	}
 
+	for (int i = ybegin; i < yend; i++) {
+		for (int j = 0; j < ncols; j++) {
+			cv::Vec3b c = img.at<cv::Vec3b>(i, j);
+			float v[6];
+			cam.Point(disp[i][j], i, j, v);
+
+			if (coeffs) {
+				// d + dmin = a*x + b*y + c + dmin is a plane in camera space as well:
+				// a*f*X + b*f*Y + (c + dmin)*Z = f*B.
+				Plane& p = (*coeffs)[i][j];
+				float nx = p.a * cam.f, ny = p.b * cam.f, nz = p.c + cam.dmin;
+				float norm = std::max(0.01f, sqrt(nx*nx + ny*ny + nz*nz));
+				v[3] = -nx / norm;
+				v[4] = -ny / norm;
+				v[5] = -nz / norm;
+			}
+			else {
+				cv::Vec3f A(v[0], v[1], v[2]), B = A, C = A;
+				if (j + 1 < ncols) cam.Point(disp[i][j + 1], i, j + 1, &B[0]);
+				if (i + 1 < nrows) cam.Point(disp[i + 1][j], i + 1, j, &C[0]);
+				cv::Vec3f u = C - A, w = B - A;
+				cv::Vec3f N = CrossProduct(u, w);
+				float norm = sqrt(N[0]*N[0] + N[1]*N[1] + N[2]*N[2]);
+				norm = norm > 0 ? norm : 1;
+				v[3] = N[0] / norm;
+				v[4] = N[1] / norm;
+				v[5] = N[2] / norm;
+			}
 
+			if (binary) {
+				unsigned char rgb[3] = { c[2], c[1], c[0] };
+				buf.insert(buf.end(), (char*)v, (char*)v + sizeof(v));
+				buf.insert(buf.end(), (char*)rgb, (char*)rgb + 3);
+			}
+			else {
+				char line[256];
+				int len = sprintf(line, "%f %f %f %f %f %f %d %d %d\n", v[0], v[1], v[2], v[3], v[4], v[5], c[2], c[1], c[0]);
+				buf.insert(buf.end(), line, line + len);
+			}
+		}
+	}
+}
 
+void WriteToPlyFile(VECBITMAP<float>& disp, cv::Mat& img, std::string filepath, VECBITMAP<Plane> *coeffs, bool binary)
+{
+	PlyCamera cam;
+	cam.f = 3740;
+	cam.B = 160;
+	cam.cutoff = 15;
+	cam.dmin = 240;
+	FILE *ff = fopen((folders[folder_id] + "dmin.txt").c_str(), "r");
+	if (ff != NULL) {
+		fscanf(ff, "%f", &cam.dmin);
+		fclose(ff);
+	}
+	printf("dmin = %f\n", cam.dmin);
 
-	FILE *fid = fopen(filepath.c_str(), "w");
-	//fprintf(fid, "ply\nformat ascii 1.0 \nelement vertex %d \nproperty float x \nproperty float y \nproperty float z \nproperty uchar red \nproperty uchar green \nproperty uchar blue \nend_header \n", nrows*ncols);
-	fprintf(fid, "ply\nformat ascii 1.0 \nelement vertex %d \nproperty float x \nproperty float y \nproperty float z \nproperty float nx \nproperty float ny \nproperty float nz \nproperty uchar red \nproperty uchar green \nproperty uchar blue \nend_header \n", nrows*ncols);
+	FILE *fid = fopen(filepath.c_str(), "wb");
+	if (fid == NULL) {
+		printf("cannot open %s for writing.\n", filepath.c_str());
+		return;
+	}
+	fprintf(fid, "ply\nformat %s 1.0 \nelement vertex %d \nproperty float x \nproperty float y \nproperty float z \nproperty float nx \nproperty float ny \nproperty float nz \nproperty uchar red \nproperty uchar green \nproperty uchar blue \nend_header \n",
+		binary ? "binary_little_endian" : "ascii", nrows*ncols);
+
+	// Chunks of rows are formatted in parallel, one batch of nthreads chunks at a time,
+	// and each batch is written in row order before the next one starts.
+	int nthreads = omp_get_max_threads();
+	int nchunks = (nrows + PLY_ROWS_PER_CHUNK - 1) / PLY_ROWS_PER_CHUNK;
+	std::vector<std::vector<char> > buffers(nthreads);
+
+	for (int first = 0; first < nchunks; first += nthreads) {
+		int nbatch = std::min(nthreads, nchunks - first);
+		#pragma omp parallel for schedule(dynamic, 1)
+		for (int k = 0; k < nbatch; k++) {
+			int ybegin = (first + k) * PLY_ROWS_PER_CHUNK;
+			int yend = std::min(nrows, ybegin + PLY_ROWS_PER_CHUNK);
+			FormatPlyRows(disp, img, coeffs, cam, ybegin, yend, binary, buffers[k]);
+		}
+		for (int k = 0; k < nbatch; k++) {
+			fwrite(&buffers[k][0], 1, buffers[k].size(), fid);
+		}
+	}
+	fclose(fid);
+}
 
+// Rows converted per parallel work item when writing PFM files.
+#define PFM_ROWS_PER_CHUNK		64
 
+// Disparities of row y, from the planes when coeffs is given. Negative or non-finite values are invalid.
+static void DisparityRow(VECBITMAP<float>& disp, VECBITMAP<Plane> *coeffs, int y, float *row)
+{
+	if (coeffs) {
+		for (int x = 0; x < ncols; x++) {
+			row[x] = (*coeffs)[y][x].ToDisparity(y, x);
+		}
+	}
+	else {
+		memcpy(row, disp[y], ncols * sizeof(float));
+	}
+}
 
-	for (int i = 0; i < nrows; i++) {
-		for (int j = 0; j < ncols; j++) {
-			cv::Vec3b c = img.at<cv::Vec3b>(i, j);
-			cv::Vec3f A, B, C;
-			A[0] = X[i][j];
-			A[1] = Y[i][j];
-			A[2] = Z[i][j];
-			B = A;
-			C = A;
-			if (j + 1 < ncols) {
-				B[0] = X[i][j + 1];
-				B[1] = Y[i][j + 1];
-				B[2] = Z[i][j + 1];
-			}
-			if (i + 1 < nrows) {
-				C[0] = X[i + 1][j];
-				C[1] = Y[i + 1][j];
-				C[2] = Z[i + 1][j];
+bool WriteToPfmFile(VECBITMAP<float>& disp, std::string filepath, VECBITMAP<Plane> *coeffs)
+{
+	FILE *fid = fopen(filepath.c_str(), "wb");
+	if (fid == NULL) {
+		printf("cannot open %s for writing.\n", filepath.c_str());
+		return false;
+	}
+	// Negative scale: little-endian floats.
+	fprintf(fid, "Pf\n%d %d\n-1\n", ncols, nrows);
+
+	// PFM stores the bottom row first. Chunks are converted in parallel
+	// and written in file order, one batch of nthreads chunks at a time.
+	int nthreads = omp_get_max_threads();
+	int nchunks = (nrows + PFM_ROWS_PER_CHUNK - 1) / PFM_ROWS_PER_CHUNK;
+	std::vector<std::vector<float> > buffers(nthreads, std::vector<float>(PFM_ROWS_PER_CHUNK * ncols));
+	bool ok = true;
+
+	for (int first = 0; first < nchunks; first += nthreads) {
+		int nbatch = std::min(nthreads, nchunks - first);
+		#pragma omp parallel for schedule(dynamic, 1)
+		for (int k = 0; k < nbatch; k++) {
+			int rbegin = (first + k) * PFM_ROWS_PER_CHUNK;
+			int rend = std::min(nrows, rbegin + PFM_ROWS_PER_CHUNK);
+			for (int r = rbegin; r < rend; r++) {
+				float *row = &buffers[k][(r - rbegin) * ncols];
+				DisparityRow(disp, coeffs, nrows - 1 - r, row);
+				for (int x = 0; x < ncols; x++) {
+					if (!(row[x] >= 0 && row[x] < FLT_MAX)) {
+						row[x] = INFINITY;		// Middlebury v3 marks unknown disparities with inf
+					}
+				}
 			}
-			cv::Vec3f N = CrossProduct(C - A, B - A);
-			fprintf(fid, "%f %f %f %f %f %f %d %d %d\n", A[0], A[1], A[2], N[0], N[1], N[2], c[2], c[1], c[0]);
+		}
+		for (int k = 0; k < nbatch; k++) {
+			int nrowsChunk = std::min(nrows - (first + k) * PFM_ROWS_PER_CHUNK, PFM_ROWS_PER_CHUNK);
+			ok = ok && fwrite(&buffers[k][0], sizeof(float), nrowsChunk * ncols, fid) == nrowsChunk * ncols;
+		}
+	}
+	ok = (fclose(fid) == 0) && ok;
+	if (!ok) {
+		printf("failed writing %s.\n", filepath.c_str());
+	}
+	return ok;
+}
 
-			//fprintf(fid, "%f %f %f %d %d %d\n", X[i][j], Y[i][j], Z[i][j], c[2], c[1], c[0]);
-				
+bool WriteToPng16File(VECBITMAP<float>& disp, std::string filepath, float fixedPointScale, VECBITMAP<Plane> *coeffs)
+{
+	cv::Mat png(nrows, ncols, CV_16UC1);
+	#pragma omp parallel for
+	for (int y = 0; y < nrows; y++) {
+		std::vector<float> row(ncols);
+		DisparityRow(disp, coeffs, y, &row[0]);
+		unsigned short *out = png.ptr<unsigned short>(y);
+		for (int x = 0; x < ncols; x++) {
+			// 0 is reserved for invalid pixels, valid ones are clamped to [1, 65535].
+			float v = row[x] * fixedPointScale + 0.5f;
+			out[x] = (row[x] >= 0 && v < FLT_MAX) ? (unsigned short)std::min(65535.f, std::max(1.f, v)) : 0;
 		}
 	}
-	fclose(fid);
+	bool ok = cv::imwrite(filepath, png);
+	if (!ok) {
+		printf("failed writing %s.\n", filepath.c_str());
+	}
+	return ok;
 }
 
 
@@ -534,23 +794,20 @@ void on_mouse2(int event, int x, int y, int flags, void *param)
 
 	if (event == CV_EVENT_LBUTTONDOWN)
 	{
-		if (g_regionList.size() > 0) {
+		if (g_regions.NumRegions() > 0) {
 
 			y %= nrows;
 			x %= ncols;
 			tmp = g_stereo.clone();
 			int id = g_labelmap[y][x];
 
-			std::vector<cv::Point2d> pointList = g_regionList[id];
-			int regionSize = pointList.size();
-			std::vector<float> dGT(regionSize), dMY(regionSize);
-
 			g_dispOld = g_dispNew;
 			Plane coeff = g_selectedCoeff;
 
-			for (int i = 0; i < regionSize; i++) {
-				int y = pointList[i].y, x = pointList[i].x;
-				g_dispNew[y][x] = coeff.ToDisparity(y, x);
+			for (RegionRun *r = g_regions.RunsBegin(id); r != g_regions.RunsEnd(id); r++) {
+				for (int x = r->x0; x < r->x1; x++) {
+					g_dispNew[r->y][x] = coeff.ToDisparity(r->y, x);
+				}
 			}
 
 		}
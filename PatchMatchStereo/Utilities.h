@@ -2,7 +2,17 @@
 
 #include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include <algorithm>
+#include <vector>
+#include <stack>
+#include <string>
+#include <utility>
+#include <memory>
+#include <omp.h>
+#include "tdef.h"
+#include "BinaryFile.h"
+#include "MemoryTracker.h"
 
 
 struct Plane {
@@ -56,6 +66,28 @@ struct Plane {
 		nz /= norm;
 		*this = Plane(nx, ny, nz, y, x, z);
 	}
+	// Same as RandomAssign/RandomAssignNormal, but drawing from the caller's generator
+	// instead of rand(), so that segments can be initialized from several threads.
+	template<class RNG>
+	static float UniformRand(RNG& rng) { return (float)(rng() - rng.min()) / (float)(rng.max() - rng.min()); }
+	template<class RNG>
+	void RandomAssign(int y, int x, int dmax, RNG& rng)
+	{
+		RandomAssignNormal(y, x, dmax, dmax * UniformRand(rng), rng);
+	}
+	template<class RNG>
+	void RandomAssignNormal(int y, int x, float dmax, float z, RNG& rng)
+	{
+		z = std::max(0.f, std::min(dmax, z));
+		float nx = 2.f * UniformRand(rng) - 1.f;
+		float ny = 2.f * UniformRand(rng) - 1.f;
+		float nz = 2.f * UniformRand(rng) - 1.f;
+		float norm = std::max(0.01f, sqrt(nx*nx + ny*ny + nz*nz));
+		nx /= norm;
+		ny /= norm;
+		nz /= norm;
+		*this = Plane(nx, ny, nz, y, x, z);
+	}
 	Plane RandomSearch(int y, int x, float radius_z0, float radius_n, float dmax)
 	{
 		const int RAND_HALF = RAND_MAX / 2;
@@ -88,27 +120,38 @@ struct Plane {
 	}
 };
 
+// Element type tags of the VECBITMAP file format.
+template<class T> struct VbmElemTypeOf			{ enum { value = VBM_UNKNOWN }; };
+template<> struct VbmElemTypeOf<unsigned char>	{ enum { value = VBM_UINT8 }; };
+template<> struct VbmElemTypeOf<bool>			{ enum { value = VBM_BOOL }; };
+template<> struct VbmElemTypeOf<int>			{ enum { value = VBM_INT32 }; };
+template<> struct VbmElemTypeOf<long long>		{ enum { value = VBM_INT64 }; };
+template<> struct VbmElemTypeOf<float>			{ enum { value = VBM_FLOAT32 }; };
+template<> struct VbmElemTypeOf<double>			{ enum { value = VBM_FLOAT64 }; };
+template<> struct VbmElemTypeOf<Plane>			{ enum { value = VBM_PLANE }; };
+
 template<class T>
 class VECBITMAP {
 public:
 	T *data;
 	int w, h, n;
 	bool is_shared;
+	std::shared_ptr<VbmMapping> mapping;		// keeps a mapped file alive while data points into it
 	T *get(int y, int x) { return &data[(y*w + x)*n]; }		/* Get patch (y, x). */
 	T *line_n1(int y) { return &data[y*w]; }				/* Get line y assuming n=1. */
-	VECBITMAP() { w = h = n = 0; data = NULL; }
+	VECBITMAP() { w = h = n = 0; data = NULL; is_shared = false; }
 	VECBITMAP(const VECBITMAP& obj)
 	{
 		// This constructor is very necessary for returning an object in a function,
 		// in the case that the Name Return Value Optimization (NRVO) is turned off.
-		w = obj.w; h = obj.h; n = obj.n; is_shared = obj.is_shared;
+		w = obj.w; h = obj.h; n = obj.n; is_shared = obj.is_shared; mapping = obj.mapping;
 		if (is_shared) { data = obj.data; }
-		else { data = new T[w*h*n]; memcpy(data, obj.data, w*h*n*sizeof(T)); }
+		else { data = Allocate(); memcpy(data, obj.data, w*h*n*sizeof(T)); }
 	}
 	VECBITMAP(int h_, int w_, int n_ = 1, T* data_ = NULL)
 	{
 		w = w_; h = h_; n = n_;
-		if (!data_) { data = new T[w*h*n]; is_shared = false; }
+		if (!data_) { data = Allocate(); is_shared = false; }
 		else	    { data = data_;        is_shared = true; }
 	}
 	VECBITMAP& operator=(const VECBITMAP& m)
@@ -116,78 +159,275 @@ public:
 		// printf("= operator invoked.\n");
 		// FIXME: it's not suggested to overload assignment operator, should declare a copyTo() function instead.
 		// However, if the assignment operator is not overloaded, do not invoke it (e.g. a = b), it is dangerous.
-		if (data) { delete[] data; }
-		w = m.w; h = m.h; n = m.n; is_shared = m.is_shared;
+		Release();
+		w = m.w; h = m.h; n = m.n; is_shared = m.is_shared; mapping = m.mapping;
 		if (m.is_shared) { data = m.data; }
-		else { data = new T[w*h*n]; memcpy(data, m.data, w*h*n*sizeof(T)); }
+		else { data = Allocate(); memcpy(data, m.data, w*h*n*sizeof(T)); }
 		return *this;
 	}
-	~VECBITMAP() { if (!is_shared) delete[] data; }
+	// Temporaries hand over their buffer instead of being copied.
+	VECBITMAP(VECBITMAP&& obj) { w = h = n = 0; data = NULL; is_shared = false; Adopt(obj); }
+	VECBITMAP& operator=(VECBITMAP&& m) { if (this != &m) { Adopt(m); } return *this; }
+	~VECBITMAP() { Release(); }
 	T *operator[](int y) { return &data[y*w]; }
 
-	void SaveToBinaryFile(std::string filename)
+	// Raw elements only, for tools that know w*h*n. Prefer SaveToFile/LoadFromFile.
+	bool SaveToBinaryFile(std::string filename)
 	{
 		FILE *fid = fopen(filename.c_str(), "wb");
-		assert(fid != NULL);
-		fwrite(data, sizeof(T), w*h*n, fid);
+		if (fid == NULL) { printf("cannot open %s for writing.\n", filename.c_str()); return false; }
+		bool ok = fwrite(data, sizeof(T), w*h*n, fid) == w*h*n;
+		ok = (fclose(fid) == 0) && ok;
+		if (!ok) { printf("failed writing %s.\n", filename.c_str()); }
+		return ok;
+	}
+	bool LoadFromBinaryFile(std::string filename)
+	{
+		FILE *fid = fopen(filename.c_str(), "rb");
+		if (fid == NULL) { printf("cannot open %s.\n", filename.c_str()); return false; }
+		bool ok = fread(data, sizeof(T), w*h*n, fid) == w*h*n;
 		fclose(fid);
+		if (!ok) { printf("%s is shorter than %d x %d x %d elements.\n", filename.c_str(), h, w, n); }
+		return ok;
+	}
+
+	// Self-describing format of BinaryFile.h. params records how the data was produced.
+	bool SaveToFile(const std::string& filename, const std::string& params = "")
+	{
+		VbmHeader header;
+		memset(&header, 0, sizeof(header));
+		header.elemType = VbmElemTypeOf<T>::value;
+		header.elemSize = sizeof(T);
+		header.h = h; header.w = w; header.n = n;
+		strncpy(header.params, params.c_str(), VBM_PARAMS_SIZE - 1);
+		return VbmWriteFile(filename, header, data);
 	}
-	void LoadFromBinaryFile(std::string filename)
+	// Reads a copy, taking the dimensions from the file, and verifies the checksum.
+	// On failure the bitmap is left unchanged.
+	bool LoadFromFile(const std::string& filename, std::string *params = NULL)
 	{
 		FILE *fid = fopen(filename.c_str(), "rb");
-		assert(fid != NULL);
-		fread(data, sizeof(T), w*h*n, fid);
+		if (fid == NULL) { printf("cannot open %s.\n", filename.c_str()); return false; }
+		VbmHeader header;
+		if (!VbmReadHeader(fid, filename, header, VbmElemTypeOf<T>::value, sizeof(T))) { fclose(fid); return false; }
+		VECBITMAP<T> tmp(header.h, header.w, header.n);
+		bool ok = VbmReadPayload(fid, filename, header, tmp.data);
 		fclose(fid);
+		if (!ok) { return false; }
+		Adopt(tmp);
+		if (params) { *params = header.params; }
+		return true;
+	}
+	// Zero-copy: data points into a private mapping of the file, shared by all copies of the bitmap.
+	// Writes stay in memory. The checksum is only checked with verify, since that reads every page.
+	bool MapFromFile(const std::string& filename, bool verify = false, std::string *params = NULL)
+	{
+		VbmHeader header;
+		VbmMapping *m = VbmMapFile(filename, header, VbmElemTypeOf<T>::value, sizeof(T), verify);
+		if (m == NULL) { return false; }
+		Release();
+		w = header.w; h = header.h; n = header.n;
+		data = (T *)((char *)m->base + header.payloadOffset);
+		is_shared = true;
+		mapping.reset(m);
+		if (params) { *params = header.params; }
+		return true;
+	}
+
+private:
+	// Owned buffers come from the BufferPool and are counted by MemoryTracker.
+	T *Allocate()
+	{
+		MemoryTracker::Allocated((long long)w * h * n * sizeof(T));
+		return (T *)BufferPool::Acquire((long long)w * h * n * sizeof(T));
+	}
+	void Release()
+	{
+		if (data && !is_shared) {
+			MemoryTracker::Freed((long long)w * h * n * sizeof(T));
+			BufferPool::Return(data, (long long)w * h * n * sizeof(T));
+		}
+	}
+	void Adopt(VECBITMAP<T>& other)
+	{
+		// takes over the buffer of other
+		Release();
+		w = other.w; h = other.h; n = other.n; data = other.data; is_shared = other.is_shared; mapping = other.mapping;
+		other.data = NULL; other.is_shared = false; other.mapping.reset();
+	}
+};
+
+
+// Pixels of all segments packed as horizontal runs, sorted in raster order within each region.
+// Region i owns runs[runOffsets[i]] .. runs[runOffsets[i + 1] - 1] and
+// pixelOffsets[i + 1] - pixelOffsets[i] pixels. Built by FromSegmentMapToLabelMap.
+// The per-region fits that take a region id and a std::mt19937 (NelderMeadEstimate, RansacEstimate,
+// NelderMeadImproveNonlinear) are reentrant: all randomness comes from the generator and only the
+// pixels of that region are written, so regions can be fitted in parallel.
+struct RegionRun {
+	int y, x0, x1;		// pixels (y, x0) .. (y, x1 - 1)
+	int start;			// index of the run's first pixel within its region
+};
+
+struct RegionIndex {
+	std::vector<int> runOffsets;
+	std::vector<int> pixelOffsets;
+	std::vector<RegionRun> runs;
+	int NumRegions() { return (int)runOffsets.size() - 1; }
+	int Size(int i) { return pixelOffsets[i + 1] - pixelOffsets[i]; }
+	RegionRun *RunsBegin(int i) { return &runs[0] + runOffsets[i]; }
+	RegionRun *RunsEnd(int i) { return &runs[0] + runOffsets[i + 1]; }
+	void PixelAt(int i, int k, int& y, int& x)
+	{
+		// k-th pixel of region i in raster order
+		RegionRun *lo = RunsBegin(i), *hi = RunsEnd(i);
+		while (hi - lo > 1) {
+			RegionRun *mid = lo + (hi - lo) / 2;
+			if (mid->start <= k)	lo = mid;
+			else					hi = mid;
+		}
+		y = lo->y;
+		x = lo->x0 + (k - lo->start);
 	}
 };
 
 
+// Adaptive support weights of the patch_w x patch_w window around every pixel of an image,
+// stored as chosen by the StereoPlan.
+struct SupportWeights {
+	cv::Mat img;
+	VECBITMAP<float> table;						// WEIGHTS_FLOAT_TABLE
+	VECBITMAP<unsigned short> distances;		// WEIGHTS_QUANTIZED_TABLE
+	void Compute(cv::Mat& img, WeightStorage storage);
+	bool Empty() const { return img.empty(); }
+	// The weights of the window centered at (y, x). Unless they are stored as floats, they are
+	// written to scratch, which must hold patch_w * patch_w floats.
+	VECBITMAP<float> Window(int y, int x, float *scratch);
+};
+
+// Everything RunPatchMatchStereo keeps alive between the theta steps of RunLaplacianStereo.
+// Start with a default-constructed state; the first call fills it.
+struct PatchMatchState {
+	VECBITMAP<float> dsiL, dsiR;				// matching costs without the coupling term
+	SupportWeights weightsL, weightsR;
+	VECBITMAP<Plane> coeffsL, coeffsR;
+	VECBITMAP<float> bestcostsL, bestcostsR;
+	int nsweeps;
+	PatchMatchState() : nsweeps(0) {}
+};
+
+
+// Bad pixel rates of a disparity map against the ground truth of folders[folder_id],
+// one entry per threshold (in pixels) for each of the nonocc, all and disc masks. The rates
+// are empty when the ground truth is missing, of another size, or a mask selects no pixel.
+struct EvaluationResult {
+	std::string dataset;
+	std::vector<float> thresholds;
+	std::vector<float> badNonocc, badAll, badDisc;		// fractions in [0, 1]
+	bool Valid() const { return !badNonocc.empty(); }
+	std::string ToJson() const;
+};
+
+// Options of EvaluateDisparity; with none of them it only prints the bad pixel rates.
+#define EVAL_SAVE_IMAGES	1		// write the disparity and error images into the dataset folder
+#define EVAL_SHOW_GUI		2		// show the comparison window and wait for a key
+
+
 class Timer
 {
 public:
 	static void tic()
 	{
-		time_stamps.push(clock());
+		time_stamps.push(omp_get_wtime());
+		names.push("");
+		MemoryTracker::BeginStage();
 	}
 	static void tic(const char *msg)
 	{
 		printf("Processing %s ...\n", msg);
-		tic();
+		time_stamps.push(omp_get_wtime());
+		names.push(msg);
+		MemoryTracker::BeginStage();
 	}
 	static void toc()
 	{
-		clock_t tic = time_stamps.top();
-		clock_t toc = clock();
-		float time_elapsed = (toc - tic) / 1000.f;
-		printf("%.2fs\n", time_elapsed);
+		double time_elapsed = omp_get_wtime() - time_stamps.top();
+		double peakMB = MemoryTracker::EndStage() / (1024.0 * 1024.0);
+		printf("%.2fs, peak %.1f MB\n", time_elapsed, peakMB);
+		if (recording && !names.top().empty()) {
+			stages.push_back(std::make_pair(names.top(), time_elapsed));
+			stagePeaks.push_back(std::make_pair(names.top(), peakMB));
+		}
 		time_stamps.pop();
+		names.pop();
+	}
+	// Collects the wall time of every named tic/toc pair that ends between the two calls.
+	static void StartRecording() { stages.clear(); stagePeaks.clear(); recording = true; }
+	static std::vector<std::pair<std::string, double> > StopRecording() { recording = false; return stages; }
+	// Peak MB of the tracked buffers during each stage of the last recording.
+	static std::vector<std::pair<std::string, double> > RecordedPeaks() { return stagePeaks; }
+	// Drops the stages left open by an exception, so that later stages are timed and measured right.
+	static void Reset()
+	{
+		time_stamps = std::stack<double>();
+		names = std::stack<std::string>();
+		recording = false;
+		MemoryTracker::ResetStages();
 	}
 private:
-	static std::stack<clock_t> time_stamps;
+	static std::stack<double> time_stamps;
+	static std::stack<std::string> names;
+	static std::vector<std::pair<std::string, double> > stages, stagePeaks;
+	static bool recording;
 };
 
 
-void EvaluateDisparity(VECBITMAP<float>& h_disp, float thresh, VECBITMAP<Plane>& coeffsL = VECBITMAP<Plane>());
-void RunLaplacianStereo(cv::Mat& imL, cv::Mat& imR, int ndisps);
+void EvaluateDisparity(VECBITMAP<float>& h_disp, float thresh, VECBITMAP<Plane>& coeffsL = VECBITMAP<Plane>(), int options = 0);
+EvaluationResult EvaluateDisparityHeadless(VECBITMAP<float>& disp, const std::vector<float>& thresholds);
+// Hands an already loaded dataset to the evaluation, which otherwise loads folders[folder_id] itself.
+struct StereoDataset;
+void SetEvaluationDataset(const StereoDataset& ds);
+VECBITMAP<float> RunLaplacianStereo(cv::Mat& imL, cv::Mat& imR, int ndisps);
+// Frees what RunLaplacianStereo keeps for the next image of the same size: the multigrid hierarchy
+// and the factorization of its coarsest grid (--serve), or the symbolic Cholesky factorization.
+void ReleaseSolverCaches();
 VECBITMAP<float> ComputeAdGradientCostVolume(cv::Mat& imL, cv::Mat& imR, int ndisps, int sign, float granularity);
 VECBITMAP<float> ComputeAdCensusCostVolume(cv::Mat& cvimL, cv::Mat& cvimR, int ndisps, int sign);
 VECBITMAP<float> WinnerTakesAll(VECBITMAP<float>& dsi, float granularity = 1.f);
+VECBITMAP<float> RunPatchMatchStereo(cv::Mat& imL, cv::Mat& imR, int ndisps);
 void RunPatchMatchStereo(cv::Mat& imL, cv::Mat& imR, int ndisps, VECBITMAP<float>& uL, VECBITMAP<float>& uR, float theta, float lambda);
-int meanShiftSegmentation(const cv::Mat &img, const float colorRadius, const int spatialRadius, const int minRegion, cv::Mat &result);
+void RunPatchMatchStereo(cv::Mat& imL, cv::Mat& imR, int ndisps, VECBITMAP<float>& uL, VECBITMAP<float>& uR, float theta, float lambda,
+	PatchMatchState& state);
+int meanShiftSegmentation(const cv::Mat &img, const float colorRadius, const int spatialRadius, const int minRegion, cv::Mat &result,
+	SpeedUpLevel speedUpLevel = NO_SPEEDUP);
 void RansacPlanefit(cv::Mat& imL, cv::Mat& imR, int ndisps);
+void LocalSearch(cv::Mat& imL, cv::Mat& imR, int ndisps, cv::Mat& dispL, cv::Mat& dispR);
 void PlaneMapToDisparityMap(VECBITMAP<Plane>& coeffs, VECBITMAP<float>& disp);
-void RunRansacPlaneFitting(cv::Mat& imL, cv::Mat& imR, int ndisps);
+VECBITMAP<float> RunRansacPlaneFitting(cv::Mat& imL, cv::Mat& imR, int ndisps);
 void PostProcess(
-	VECBITMAP<float>& weightsL, VECBITMAP<float>& weightsR,
+	SupportWeights& weightsL, SupportWeights& weightsR,
 	VECBITMAP<Plane>& coeffsL, VECBITMAP<Plane>& coeffsR,
 	VECBITMAP<float>& dispL, VECBITMAP<float>& dispR);
 VECBITMAP<float> PrecomputeWeights(cv::Mat& img);
-void WriteToPlyFile(VECBITMAP<float>& disp, cv::Mat& img, std::string filepath);
+// Writes a colored point cloud; normals come from the planes when coeffs is given,
+// from finite differences of the points otherwise.
+void WriteToPlyFile(VECBITMAP<float>& disp, cv::Mat& img, std::string filepath,
+	VECBITMAP<Plane> *coeffs = NULL, bool binary = true);
+// Float disparity outputs without 8-bit quantization, from the planes when coeffs is given.
+// Negative or non-finite disparities are written as inf (PFM) or 0 (PNG).
+// The 16-bit PNG stores round(d * fixedPointScale), 256 as in the KITTI format.
+bool WriteToPfmFile(VECBITMAP<float>& disp, std::string filepath, VECBITMAP<Plane> *coeffs = NULL);
+bool WriteToPng16File(VECBITMAP<float>& disp, std::string filepath, float fixedPointScale = 256.f, VECBITMAP<Plane> *coeffs = NULL);
 int slicSegmentation(const cv::Mat &img, const int numPreferedRegions, const int compactness, cv::Mat& result);
 
 
-extern const std::string folders[60];
-extern const int scale, ndisps, dmax, patch_w, patch_r, folder_id;
+extern const std::string folders[];
+extern const int nfolders;
+extern int scale, ndisps, dmax, folder_id;
+extern const int patch_w, patch_r;
+extern bool g_batchMode;
+void SelectDataset(int id);
+std::string RunParameters();
 extern const float alpha, gamma, tau_col, tau_grad, granularity, BAD_PLANE_PENALTY;
 
 
@@ -16,6 +16,9 @@
 #include <omp.h>
 #include "SLIC.h"
 #include "Utilities.h"
+#include "Benchmark.h"
+#include "DatasetPack.h"
+#include "StereoServer.h"
 
 #ifdef _DEBUG
 #pragma comment(lib, "opencv_core248d.lib")
@@ -41,8 +44,16 @@
 //#define DO_POST_PROCESSING
 //#define USE_NELDERMEAD_OPT
 
+// Refinement done per theta step when PatchMatch is warm-started from the previous planes.
+#define WARM_START_ITERS	1
+#define WARM_START_RADIUS	2.0f
+
 // Static class member initialization 
-std::stack<clock_t> Timer::time_stamps = std::stack<clock_t>();
+std::stack<double> Timer::time_stamps = std::stack<double>();
+std::stack<std::string> Timer::names = std::stack<std::string>();
+std::vector<std::pair<std::string, double> > Timer::stages;
+std::vector<std::pair<std::string, double> > Timer::stagePeaks;
+bool Timer::recording = false;
 
 // Gobal variables
 int nrows, ncols;
@@ -50,8 +61,12 @@ const float BAD_PLANE_PENALTY = 120;  // defined as 2 times the max cost of dsi.
 const float	gamma_proximity = 25;
 int			g_improve_cnt = 0;
 
-const int		patch_w		= 35;
-const int		patch_r		= 17;
+// Build with PATCH_W defined (e.g. /DPATCH_W=21) to try other support windows.
+#ifndef PATCH_W
+#define PATCH_W			35
+#endif
+const int		patch_w		= PATCH_W;
+const int		patch_r		= PATCH_W / 2;
 const int		maxiters	= 2;
 const float		alpha		= 0.9;
 const float		gamma		= 10;
@@ -59,13 +74,36 @@ const float		tau_col		= 10;
 const float		tau_grad	= 2;
 const float		granularity = 0.25f;
 
-const int folder_id = 8;    //     0          1         2         3          4           5         6            7              8            9          10          11          12        13        14         15         16          17      18         19
-const std::string folders[] = { "tsukuba/", "venus/", "teddy/", "cones/", "Bowling2/", "Baby1/", "Cloth3/", "Flowerpots/", "Lampshade2/", "Midd1/", "Monopoly/", "Plastic/", "Rocks1/", "Wood1/", "Books/", "Moebius/", "Dolls/", "Baby2/", "Wood2/", "Rocks2/"};
-const int scales[] = { 16, 8, 4, 4, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3 };
-const int drange[] = { 16, 20, 60, 60, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70 };
-const int scale				= scales[folder_id];
-const int ndisps			= drange[folder_id];
-const int dmax				= ndisps - 1;
+int folder_id = 8;    //     0          1         2         3          4           5         6            7              8            9          10          11          12        13        14         15         16          17      18         19
+const std::string folders[] = { "tsukuba/", "venus/", "teddy/", "cones/", "Bowling2/", "Baby1/", "Cloth3/", "Flowerpots/", "Lampshade2/", "Midd1/", "Monopoly/", "Plastic/", "Rocks1/", "Wood1/", "Books/", "Moebius/", "Dolls/", "Baby2/", "Wood2/", "Rocks2/",
+	//	20		 21		 22			23			 24			 25			 26			27			   28		   29		  30
+	"Aloe/", "Art/", "Baby3/", "Bowling1/", "Cloth1/", "Cloth2/", "Cloth4/", "Lampshade1/", "Laundry/", "Midd2/", "Reindeer/" };
+const int nfolders = sizeof(folders) / sizeof(folders[0]);
+const int scales[] = { 16, 8, 4, 4, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3 };
+const int drange[] = { 16, 20, 60, 60, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70, 70 };
+int scale				= scales[folder_id];
+int ndisps				= drange[folder_id];
+int dmax				= ndisps - 1;
+
+// Set by the benchmark: no windows, meshlab or result files, pipelines just return their disparity.
+bool g_batchMode = false;
+
+void SelectDataset(int id)
+{
+	folder_id = id;
+	scale = scales[id];
+	ndisps = drange[id];
+	dmax = ndisps - 1;
+}
+
+// Recorded in the header of every result file written with SaveToFile.
+std::string RunParameters()
+{
+	char buf[512];
+	sprintf(buf, "dataset=%s\nscale=%d\nndisps=%d\npatch_w=%d\nmaxiters=%d\nalpha=%g\ngamma=%g\ntau_col=%g\ntau_grad=%g\ngranularity=%g\n",
+		folders[folder_id].c_str(), scale, ndisps, patch_w, maxiters, alpha, gamma, tau_col, tau_grad, granularity);
+	return buf;
+}
 
 
 
@@ -316,7 +354,43 @@ double ComputePlaneCost(int yc, int xc, Plane& coeff_try, VECBITMAP<float>& dsi,
 	return cost;
 }
 
-void RandomInit(VECBITMAP<Plane>& coeffs, VECBITMAP<float>& bestcosts, VECBITMAP<float>& dsi, VECBITMAP<float>& weights)
+// Coupling of RunLaplacianStereo, lambda * cost + theta * (d - u)^2, when it is added while
+// the plane cost is computed instead of to a copy of the cost volume.
+struct CouplingTerm {
+	VECBITMAP<float> *u;
+	float theta, lambda;
+};
+
+double ComputePlaneCost(int yc, int xc, Plane& coeff_try, VECBITMAP<float>& dsi, VECBITMAP<float>& w, const CouplingTerm *coupling)
+{
+	if (coupling == NULL) {
+		return ComputePlaneCost(yc, xc, coeff_try, dsi, w);
+	}
+	VECBITMAP<float>& u = *coupling->u;
+	double cost = 0;
+	for (int y = yc - patch_r; y <= yc + patch_r; y++) {
+		for (int x = xc - patch_r; x <= xc + patch_r; x++) {
+			float d = (coeff_try.a * x + coeff_try.b * y + coeff_try.c);
+			int level = 0.5 + d / granularity;
+			if (InBound(y, x)) {
+				if (d < 0 || d > dmax) {	// must be a bad plane.
+					cost += BAD_PLANE_PENALTY;
+				}
+				else {
+					// the same operations as on the copied volume, so both give the same costs
+					float dl = level * granularity;
+					float c = dsi.get(y, x)[level] * coupling->lambda;
+					c += coupling->theta * (dl - u[y][x]) * (dl - u[y][x]);
+					cost += w[y - yc + patch_r][x - xc + patch_r] * c;
+				}
+			}
+		}
+	}
+	return cost;
+}
+
+void RandomInit(VECBITMAP<Plane>& coeffs, VECBITMAP<float>& bestcosts, VECBITMAP<float>& dsi, SupportWeights& weights,
+	const CouplingTerm *coupling = NULL)
 {
 	for (int y = 0; y < nrows; y++) {
 		for (int x = 0; x < ncols; x++) {
@@ -325,65 +399,129 @@ void RandomInit(VECBITMAP<Plane>& coeffs, VECBITMAP<float>& bestcosts, VECBITMAP
 	}
 	#pragma omp parallel for
 	for (int y = 0; y < nrows; y++) {
+		float scratch[patch_w * patch_w];
 		for (int x = 0; x < ncols; x++) {
-			bestcosts[y][x] = ComputePlaneCost(y, x, coeffs[y][x], dsi, VECBITMAP<float>(patch_w, patch_w, 1, weights.line_n1(y*ncols + x)));
+			VECBITMAP<float> w = weights.Window(y, x, scratch);
+			bestcosts[y][x] = ComputePlaneCost(y, x, coeffs[y][x], dsi, w, coupling);
 		}
 	}
 }
 
-VECBITMAP<float> PrecomputeWeights(cv::Mat& img)
+void RescorePlanes(VECBITMAP<Plane>& coeffs, VECBITMAP<float>& bestcosts, VECBITMAP<float>& dsi, SupportWeights& weights,
+	const CouplingTerm *coupling = NULL)
 {
-	assert(img.isContinuous());
-	VECBITMAP<unsigned char> im(nrows, ncols, 3, img.data);
+	// Re-evaluate the current planes under a new cost volume, e.g. after the coupling penalty changed.
+	#pragma omp parallel for
+	for (int y = 0; y < nrows; y++) {
+		float scratch[patch_w * patch_w];
+		for (int x = 0; x < ncols; x++) {
+			VECBITMAP<float> w = weights.Window(y, x, scratch);
+			bestcosts[y][x] = ComputePlaneCost(y, x, coeffs[y][x], dsi, w, coupling);
+		}
+	}
+}
 
-	const int nw = nrows * ncols * patch_w * patch_w;
-	const int patchsize = patch_w * patch_w;
+// Support weight exp(-dist / gamma) of every color distance, the sum of the absolute
+// differences of the three channels, which is an integer in [0, 3 * 255].
+static float weightOfDistance[3 * 255 + 1];
+
+static void InitWeightOfDistance()
+{
+	for (int i = 0; i <= 3 * 255; i++) {
+		float dist = i;
+		weightOfDistance[i] = exp(-dist / gamma);
+	}
+}
 
-	VECBITMAP<float> ret(nrows * ncols, patch_w * patch_w);
-	float *weights = ret.data;
-	memset(weights, 0, nw * sizeof(float));
+// Color distances of the window centered at (yc, xc) to its center, 0 outside the image.
+static void ComputeWindowDistances(VECBITMAP<unsigned char>& im, int yc, int xc, unsigned short *dist)
+{
+	memset(dist, 0, patch_w * patch_w * sizeof(unsigned short));
+	unsigned char *rgb1 = im.get(yc, xc);
+
+	int yb = std::max(0, yc - patch_r), ye = std::min(nrows - 1, yc + patch_r);
+	int xb = std::max(0, xc - patch_r), xe = std::min(ncols - 1, xc + patch_r);
 
-	float w_prox[patch_w * patch_w];
-	for (int y = 0; y < patch_w; y++) {
-		for (int x = 0; x < patch_w; x++) {
-			float dist = sqrt((y - patch_r) * (y - patch_r) + (x - patch_r) * (x - patch_r));
-			w_prox[y * patch_w + x] = exp(-dist / gamma_proximity);
+	for (int y = yb; y <= ye; y++) {
+		for (int x = xb; x <= xe; x++) {
+			unsigned char *rgb2 = im.get(y, x);
+			dist[(y - yc + patch_r) * patch_w + (x - xc + patch_r)] = std::abs(rgb1[0] - rgb2[0])
+				+ std::abs(rgb1[1] - rgb2[1])
+				+ std::abs(rgb1[2] - rgb2[2]);
 		}
 	}
+}
+
+static void DistancesToWeights(const unsigned short *dist, float *w)
+{
+	for (int i = 0; i < patch_w * patch_w; i++) {
+		w[i] = weightOfDistance[dist[i]];
+	}
+}
 
+VECBITMAP<float> PrecomputeWeights(cv::Mat& img)
+{
+	assert(img.isContinuous());
+	VECBITMAP<unsigned char> im(nrows, ncols, 3, img.data);
+	const int patchsize = patch_w * patch_w;
+	InitWeightOfDistance();
+
+	VECBITMAP<float> ret(nrows * ncols, patchsize);
 	#pragma omp parallel for
 	for (int yc = 0; yc < nrows; yc++) {
+		unsigned short dist[patch_w * patch_w];
 		for (int xc = 0; xc < ncols; xc++) {
+			ComputeWindowDistances(im, yc, xc, dist);
+			DistancesToWeights(dist, ret.line_n1(yc*ncols + xc));
+		}
+	}
+	return ret;
+}
 
-			float *w = &weights[(yc*ncols + xc) * patchsize];
-			unsigned char *rgb1 = im.get(yc, xc);
-			unsigned char *rgb2 = NULL;
-
-			int yb = std::max(0, yc - patch_r), ye = std::min(nrows - 1, yc + patch_r);
-			int xb = std::max(0, xc - patch_r), xe = std::min(ncols - 1, xc + patch_r);
-
-			for (int y = yb; y <= ye; y++) {
-				for (int x = xb; x <= xe; x++) {
-					rgb2 = im.get(y, x);
-					float cost = std::abs((float)rgb1[0] - (float)rgb2[0])
-						+ std::abs((float)rgb1[1] - (float)rgb2[1])
-						+ std::abs((float)rgb1[2] - (float)rgb2[2]);
-					w[(y - yc + patch_r) * patch_w + (x - xc + patch_r)] = cost;
-				}
+void SupportWeights::Compute(cv::Mat& img_, WeightStorage storage)
+{
+	assert(img_.isContinuous());
+	img = img_;
+	table = VECBITMAP<float>();
+	distances = VECBITMAP<unsigned short>();
+	InitWeightOfDistance();
+
+	if (storage == WEIGHTS_FLOAT_TABLE) {
+		table = PrecomputeWeights(img);
+	}
+	else if (storage == WEIGHTS_QUANTIZED_TABLE) {
+		VECBITMAP<unsigned char> im(nrows, ncols, 3, img.data);
+		distances = VECBITMAP<unsigned short>(nrows * ncols, patch_w * patch_w);
+		#pragma omp parallel for
+		for (int yc = 0; yc < nrows; yc++) {
+			for (int xc = 0; xc < ncols; xc++) {
+				ComputeWindowDistances(im, yc, xc, distances.line_n1(yc*ncols + xc));
 			}
 		}
 	}
+}
 
-	for (int i = 0; i < nw; i++) {
-		weights[i] = exp(-weights[i] / gamma);
+VECBITMAP<float> SupportWeights::Window(int y, int x, float *scratch)
+{
+	if (table.data) {
+		return VECBITMAP<float>(patch_w, patch_w, 1, table.line_n1(y*ncols + x));
 	}
-
-	return ret;
+	if (distances.data) {
+		DistancesToWeights(distances.line_n1(y*ncols + x), scratch);
+	}
+	else {
+		unsigned short dist[patch_w * patch_w];
+		VECBITMAP<unsigned char> im(nrows, ncols, 3, img.data);
+		ComputeWindowDistances(im, y, x, dist);
+		DistancesToWeights(dist, scratch);
+	}
+	return VECBITMAP<float>(patch_w, patch_w, 1, scratch);
 }
 
-void ImproveGuess(int y, int x, Plane& coeff_old, float& bestcost, Plane& coeff_try, VECBITMAP<float>& dsi, VECBITMAP<float>& w)
+void ImproveGuess(int y, int x, Plane& coeff_old, float& bestcost, Plane& coeff_try, VECBITMAP<float>& dsi, VECBITMAP<float>& w,
+	const CouplingTerm *coupling = NULL)
 {
-	float cost = ComputePlaneCost(y, x, coeff_try, dsi, w);
+	float cost = ComputePlaneCost(y, x, coeff_try, dsi, w, coupling);
 	if (cost < bestcost) {
 		g_improve_cnt++;
 		bestcost = cost;
@@ -395,34 +533,36 @@ void PropagateAndRandomSearch(int y, int x,
 	VECBITMAP<Plane>& coeffsL,		VECBITMAP<Plane>& coeffsR,
 	VECBITMAP<float>& bestcostsL,	VECBITMAP<float>& bestcostsR,
 	VECBITMAP<float>& dsiL,			VECBITMAP<float>& dsiR,
-	VECBITMAP<float>& weightsL,		VECBITMAP<float>& weightsR,
-	int iter, int sign)
+	SupportWeights& weightsL,		SupportWeights& weightsR,
+	int iter, int sign, float maxRadiusZ = dmax / 2.0f,
+	const CouplingTerm *couplingL = NULL, const CouplingTerm *couplingR = NULL)
 {
 	int xchange, ychange;
 	if (iter % 2 == 0)  xchange = ychange = +1;
 	else				xchange = ychange = -1;
-	VECBITMAP<float> wL(patch_w, patch_w, 1, weightsL.line_n1(y*ncols + x));
+	float scratchL[patch_w * patch_w], scratchR[patch_w * patch_w];
+	VECBITMAP<float> wL = weightsL.Window(y, x, scratchL);
 
 #ifndef USE_NELDERMEAD_OPT
 	// Spatial Propagation
 	int qy = y - ychange, qx = x;
 	if (InBound(qy, qx)) {
 		Plane coeff_try = coeffsL[qy][qx];
-		ImproveGuess(y, x, coeffsL[y][x], bestcostsL[y][x], coeff_try, dsiL, wL);
+		ImproveGuess(y, x, coeffsL[y][x], bestcostsL[y][x], coeff_try, dsiL, wL, couplingL);
 	}
 
 	qy = y; qx = x - xchange;
 	if (InBound(qy, qx)) {
 		Plane coeff_try = coeffsL[qy][qx];
-		ImproveGuess(y, x, coeffsL[y][x], bestcostsL[y][x], coeff_try, dsiL, wL);
+		ImproveGuess(y, x, coeffsL[y][x], bestcostsL[y][x], coeff_try, dsiL, wL, couplingL);
 	}
 
 	// Random Search
-	float radius_z = dmax / 2.0f;
-	float radius_n = 1.0f;
+	float radius_z = maxRadiusZ;
+	float radius_n = maxRadiusZ / (dmax / 2.0f);
 	while (radius_z >= 0.1) {
 		Plane coeff_try = coeffsL[y][x].RandomSearch(y, x, radius_z, radius_n, dmax);
-		ImproveGuess(y, x, coeffsL[y][x], bestcostsL[y][x], coeff_try, dsiL, wL);
+		ImproveGuess(y, x, coeffsL[y][x], bestcostsL[y][x], coeff_try, dsiL, wL, couplingL);
 		radius_z /= 2.0f;
 		radius_n /= 2.0f;
 	}
@@ -430,8 +570,8 @@ void PropagateAndRandomSearch(int y, int x,
 	// View Propagation
 	Plane coeff_try = coeffsL[y][x].ReparametrizeInOtherView(y, x, sign, qy, qx);
 	if (0 <= qx && qx < ncols) {
-		VECBITMAP<float> wR(patch_w, patch_w, 1, weightsR.line_n1(qy*ncols + qx));
-		ImproveGuess(qy, qx, coeffsR[qy][qx], bestcostsR[qy][qx], coeff_try, dsiR, wR);
+		VECBITMAP<float> wR = weightsR.Window(qy, qx, scratchR);
+		ImproveGuess(qy, qx, coeffsR[qy][qx], bestcostsR[qy][qx], coeff_try, dsiR, wR, couplingR);
 	}
 #else
 	const int dx[] = { -1, 0, +1, 0 };
@@ -550,7 +690,7 @@ void WeightedMedianFilter(int yc, int xc, VECBITMAP<float>& disp, VECBITMAP<floa
 }
 
 void PostProcess(
-	VECBITMAP<float>& weightsL, VECBITMAP<float>& weightsR,
+	SupportWeights& weightsL, SupportWeights& weightsR,
 	VECBITMAP<Plane>& coeffsL,	VECBITMAP<Plane>& coeffsR,
 	VECBITMAP<float>& dispL,	VECBITMAP<float>& dispR)
 {
@@ -595,13 +735,14 @@ void PostProcess(
 		#pragma omp parallel for
 		for (int y = 0; y < nrows; y++) {
 			//if (y % 10 == 0) { printf("median filtering row %d\n", y); }
+			float scratch[patch_w * patch_w];
 			for (int x = 0; x < ncols; x++) {
 				if (!validL[y][x]){
-					VECBITMAP<float> wL(patch_w, patch_w, 1, weightsL.line_n1(y * ncols + x));
+					VECBITMAP<float> wL = weightsL.Window(y, x, scratch);
 					WeightedMedianFilter(y, x, dispL, wL, validL, useInvalidPixels);
 				}
 				if (!validR[y][x]){
-					VECBITMAP<float> wR(patch_w, patch_w, 1, weightsR.line_n1(y * ncols + x));
+					VECBITMAP<float> wR = weightsR.Window(y, x, scratch);
 					WeightedMedianFilter(y, x, dispR, wR, validR, useInvalidPixels);
 				}
 			}
@@ -610,165 +751,241 @@ void PostProcess(
 #endif
 }
 
-void RunPatchMatchStereo(cv::Mat& imL, cv::Mat& imR, int ndisps)
+// Planes saved by the last run on this dataset. Fails, leaving the planes unchanged,
+// if they are missing, corrupt or of another resolution.
+static bool LoadLastPlanes(VECBITMAP<Plane>& coeffsL, VECBITMAP<Plane>& coeffsR)
+{
+	VECBITMAP<Plane> lastL, lastR;
+	if (!lastL.LoadFromFile(folders[folder_id] + "coeffsL.bin") || !lastR.LoadFromFile(folders[folder_id] + "coeffsR.bin")) {
+		return false;
+	}
+	if (lastL.h != nrows || lastL.w != ncols || lastR.h != nrows || lastR.w != ncols) {
+		printf("saved planes are %d x %d, the images %d x %d.\n", lastL.h, lastL.w, nrows, ncols);
+		return false;
+	}
+	coeffsL = lastL;
+	coeffsR = lastR;
+	return true;
+}
+
+VECBITMAP<float> RunPatchMatchStereo(cv::Mat& imL, cv::Mat& imR, int ndisps)
 {
 	VECBITMAP<float> dsiL = ComputeAdGradientCostVolume(imL, imR, ndisps, -1, granularity);
 	VECBITMAP<float> dsiR = ComputeAdGradientCostVolume(imR, imL, ndisps, +1, granularity);
-	VECBITMAP<float> weightsL = PrecomputeWeights(imL);
-	VECBITMAP<float> weightsR = PrecomputeWeights(imR);
+	SupportWeights weightsL, weightsR;
+	weightsL.Compute(imL, g_plan.weights);
+	weightsR.Compute(imR, g_plan.weights);
 
 	VECBITMAP<float> dispL(nrows, ncols), dispR(nrows, ncols);
 	VECBITMAP<Plane> coeffsL(nrows, ncols), coeffsR(nrows, ncols);
 	VECBITMAP<float> bestcostsL(nrows, ncols), bestcostsR(nrows, ncols);
 
-#ifndef LOAD_RESULT_FROM_LAST_RUN
-	// Random initialization
-	Timer::tic("Random Init");
-	RandomInit(coeffsL, bestcostsL, dsiL, weightsL);
-	RandomInit(coeffsR, bestcostsR, dsiR, weightsR);
-	Timer::toc();
-
-	// Iteration
-	for (int iter = 0; iter < maxiters; iter++) {
-
-		if (iter % 2 == 0) {
-			Timer::tic("Left View");
-			#pragma omp parallel for
-			for (int y = 0; y < nrows; y++) {
-				for (int x = 0; x < ncols; x++) {
-					PropagateAndRandomSearch(y, x, coeffsL, coeffsR, bestcostsL, bestcostsR, dsiL, dsiR, weightsL, weightsR, iter, -1);
+#ifdef LOAD_RESULT_FROM_LAST_RUN
+	bool loadResult = !g_batchMode && LoadLastPlanes(coeffsL, coeffsR);		// the benchmark always runs the search
+#else
+	bool loadResult = false;
+#endif
+	if (!loadResult) {
+		// Random initialization
+		Timer::tic("Random Init");
+		RandomInit(coeffsL, bestcostsL, dsiL, weightsL);
+		RandomInit(coeffsR, bestcostsR, dsiR, weightsR);
+		Timer::toc();
+
+		// Iteration
+		for (int iter = 0; iter < maxiters; iter++) {
+
+			if (iter % 2 == 0) {
+				Timer::tic("Left View");
+				#pragma omp parallel for
+				for (int y = 0; y < nrows; y++) {
+					for (int x = 0; x < ncols; x++) {
+						PropagateAndRandomSearch(y, x, coeffsL, coeffsR, bestcostsL, bestcostsR, dsiL, dsiR, weightsL, weightsR, iter, -1);
+					}
 				}
-			}
-			Timer::toc();
-			Timer::tic("Right View");
-			#pragma omp parallel for
-			for (int y = 0; y < nrows; y++) {
-				for (int x = 0; x < ncols; x++) {
-					PropagateAndRandomSearch(y, x, coeffsR, coeffsL, bestcostsR, bestcostsL, dsiR, dsiL, weightsR, weightsL, iter, +1);
+				Timer::toc();
+				Timer::tic("Right View");
+				#pragma omp parallel for
+				for (int y = 0; y < nrows; y++) {
+					for (int x = 0; x < ncols; x++) {
+						PropagateAndRandomSearch(y, x, coeffsR, coeffsL, bestcostsR, bestcostsL, dsiR, dsiL, weightsR, weightsL, iter, +1);
+					}
 				}
+				Timer::toc();
 			}
-			Timer::toc();
-		}
-		else {
-			Timer::tic("Left View");
-			#pragma omp parallel for
-			for (int y = nrows - 1; y >= 0; y--) {
-				for (int x = ncols - 1; x >= 0; x--) {
-					PropagateAndRandomSearch(y, x, coeffsL, coeffsR, bestcostsL, bestcostsR, dsiL, dsiR, weightsL, weightsR, iter, -1);
+			else {
+				Timer::tic("Left View");
+				#pragma omp parallel for
+				for (int y = nrows - 1; y >= 0; y--) {
+					for (int x = ncols - 1; x >= 0; x--) {
+						PropagateAndRandomSearch(y, x, coeffsL, coeffsR, bestcostsL, bestcostsR, dsiL, dsiR, weightsL, weightsR, iter, -1);
+					}
 				}
-			}
-			Timer::toc();
-			Timer::tic("Right View");
-			#pragma omp parallel for
-			for (int y = nrows - 1; y >= 0; y--) {
-				for (int x = ncols - 1; x >= 0; x--) {
-					PropagateAndRandomSearch(y, x, coeffsR, coeffsL, bestcostsR, bestcostsL, dsiR, dsiL, weightsR, weightsL, iter, +1);
+				Timer::toc();
+				Timer::tic("Right View");
+				#pragma omp parallel for
+				for (int y = nrows - 1; y >= 0; y--) {
+					for (int x = ncols - 1; x >= 0; x--) {
+						PropagateAndRandomSearch(y, x, coeffsR, coeffsL, bestcostsR, bestcostsL, dsiR, dsiL, weightsR, weightsL, iter, +1);
+					}
 				}
+				Timer::toc();
 			}
-			Timer::toc();
 		}
-	}
 
-	printf("g_improve_cnt: %d\n", g_improve_cnt);
-	coeffsL.SaveToBinaryFile(folders[folder_id] + "coeffsL.bin");
-	coeffsR.SaveToBinaryFile(folders[folder_id] + "coeffsR.bin");
-#else
-	coeffsL.LoadFromBinaryFile(folders[folder_id] + "coeffsL.bin");
-	coeffsR.LoadFromBinaryFile(folders[folder_id] + "coeffsR.bin");
-#endif
+		printf("g_improve_cnt: %d\n", g_improve_cnt);
+		if (!g_batchMode) {
+			coeffsL.SaveToFile(folders[folder_id] + "coeffsL.bin", RunParameters());
+			coeffsR.SaveToFile(folders[folder_id] + "coeffsR.bin", RunParameters());
+		}
+	}
 
 	// Post processing
 	Timer::tic("POST PROCESSING");
 	PostProcess(weightsL, weightsR, coeffsL, coeffsR, dispL, dispR);
 	Timer::toc();
 
-	WriteToPlyFile(dispL, imL, folders[folder_id] + "PatchMatch.ply");
-	dispL.SaveToBinaryFile(folders[folder_id] + "PatchMatch_dispL.bin");
-	dispR.SaveToBinaryFile(folders[folder_id] + "PatchMatch_dispR.bin");
+	if (!g_batchMode) {
+		WriteToPlyFile(dispL, imL, folders[folder_id] + "PatchMatch.ply", &coeffsL);
+		dispL.SaveToFile(folders[folder_id] + "PatchMatch_dispL.bin", RunParameters());
+		dispR.SaveToFile(folders[folder_id] + "PatchMatch_dispR.bin", RunParameters());
+		WriteToPfmFile(dispL, folders[folder_id] + "PatchMatch_dispL.pfm");
 
-	EvaluateDisparity(dispL, 1.f, coeffsL);
+		EvaluateDisparity(dispL, 1.f, coeffsL, EVAL_SAVE_IMAGES | EVAL_SHOW_GUI);
+	}
+	return dispL;
 }
 
-void RunPatchMatchStereo(cv::Mat& imL, cv::Mat& imR, int ndisps, VECBITMAP<float>& uL, VECBITMAP<float>& uR, float theta, float lambda)
+void RunPatchMatchStereo(cv::Mat& imL, cv::Mat& imR, int ndisps, VECBITMAP<float>& uL, VECBITMAP<float>& uR, float theta, float lambda,
+	PatchMatchState& state)
 {
-	VECBITMAP<float> dsiL = ComputeAdGradientCostVolume(imL, imR, ndisps, -1, granularity);
-	VECBITMAP<float> dsiR = ComputeAdGradientCostVolume(imR, imL, ndisps, +1, granularity);
+	// The matching costs and support weights do not depend on theta, compute them once.
+	if (!state.dsiL.data) {
+		state.dsiL = ComputeAdGradientCostVolume(imL, imR, ndisps, -1, granularity);
+		state.dsiR = ComputeAdGradientCostVolume(imR, imL, ndisps, +1, granularity);
+		state.weightsL.Compute(imL, g_plan.weights);
+		state.weightsR.Compute(imR, g_plan.weights);
+	}
 
-	int nlevels = ndisps / granularity;
-	for (int y = 0; y < nrows; y++) {
-		for (int x = 0; x < ncols; x++) {
-			for (int level = 0; level < nlevels; level++) {
-				float d = level * granularity;
-				dsiL.get(y, x)[level] *= lambda;
-				dsiL.get(y, x)[level] += theta * (d - uL[y][x]) * (d - uL[y][x]);
-				dsiR.get(y, x)[level] *= lambda;
-				dsiR.get(y, x)[level] += theta * (d - uR[y][x]) * (d - uR[y][x]);
+	// The coupling goes either into copies of the volumes or, lazily, into every plane cost.
+	CouplingTerm lazyL = { &uL, theta, lambda }, lazyR = { &uR, theta, lambda };
+	const CouplingTerm *couplingL = NULL, *couplingR = NULL;
+	VECBITMAP<float> dsiL, dsiR;
+	if (g_plan.lazyCoupling) {
+		dsiL = VECBITMAP<float>(state.dsiL.h, state.dsiL.w, state.dsiL.n, state.dsiL.data);
+		dsiR = VECBITMAP<float>(state.dsiR.h, state.dsiR.w, state.dsiR.n, state.dsiR.data);
+		couplingL = &lazyL;
+		couplingR = &lazyR;
+	}
+	else {
+		dsiL = state.dsiL;
+		dsiR = state.dsiR;
+		int nlevels = ndisps / granularity;
+		for (int y = 0; y < nrows; y++) {
+			for (int x = 0; x < ncols; x++) {
+				for (int level = 0; level < nlevels; level++) {
+					float d = level * granularity;
+					dsiL.get(y, x)[level] *= lambda;
+					dsiL.get(y, x)[level] += theta * (d - uL[y][x]) * (d - uL[y][x]);
+					dsiR.get(y, x)[level] *= lambda;
+					dsiR.get(y, x)[level] += theta * (d - uR[y][x]) * (d - uR[y][x]);
+				}
 			}
 		}
 	}
 
-	VECBITMAP<float> weightsL = PrecomputeWeights(imL);
-	VECBITMAP<float> weightsR = PrecomputeWeights(imR);
+	SupportWeights& weightsL = state.weightsL;
+	SupportWeights& weightsR = state.weightsR;
 
 	VECBITMAP<float> dispL(nrows, ncols), dispR(nrows, ncols);
-	VECBITMAP<Plane> coeffsL(nrows, ncols), coeffsR(nrows, ncols);
-	VECBITMAP<float> bestcostsL(nrows, ncols), bestcostsR(nrows, ncols);
-
-#ifndef LOAD_RESULT_FROM_LAST_RUN
-	// Random initialization
-	Timer::tic("Random Init");
-	RandomInit(coeffsL, bestcostsL, dsiL, weightsL);
-	RandomInit(coeffsR, bestcostsR, dsiR, weightsR);
-	Timer::toc();
-
-	// Iteration
-	for (int iter = 0; iter < maxiters; iter++) {
-
-		if (iter % 2 == 0) {
-			Timer::tic("Left View");
-			#pragma omp parallel for
-			for (int y = 0; y < nrows; y++) {
-				for (int x = 0; x < ncols; x++) {
-					PropagateAndRandomSearch(y, x, coeffsL, coeffsR, bestcostsL, bestcostsR, dsiL, dsiR, weightsL, weightsR, iter, -1);
-				}
-			}
-			Timer::toc();
-			Timer::tic("Right View");
-			#pragma omp parallel for
-			for (int y = 0; y < nrows; y++) {
-				for (int x = 0; x < ncols; x++) {
-					PropagateAndRandomSearch(y, x, coeffsR, coeffsL, bestcostsR, bestcostsL, dsiR, dsiL, weightsR, weightsL, iter, +1);
-				}
-			}
+	bool warmStart = (state.coeffsL.data != NULL);
+	if (!warmStart) {
+		state.coeffsL = VECBITMAP<Plane>(nrows, ncols);
+		state.coeffsR = VECBITMAP<Plane>(nrows, ncols);
+		state.bestcostsL = VECBITMAP<float>(nrows, ncols);
+		state.bestcostsR = VECBITMAP<float>(nrows, ncols);
+	}
+	VECBITMAP<Plane>& coeffsL = state.coeffsL;
+	VECBITMAP<Plane>& coeffsR = state.coeffsR;
+	VECBITMAP<float>& bestcostsL = state.bestcostsL;
+	VECBITMAP<float>& bestcostsR = state.bestcostsR;
+
+#ifdef LOAD_RESULT_FROM_LAST_RUN
+	// The planes of the last run only stand in for the first theta step, later steps start from
+	// the planes of the previous one. Batch runs and --serve always search.
+	bool loadResult = !warmStart && !g_batchMode && LoadLastPlanes(coeffsL, coeffsR);
+#else
+	bool loadResult = false;
+#endif
+	if (!loadResult) {
+		int niters = maxiters;
+		float radius = dmax / 2.0f;
+		if (!warmStart) {
+			// Random initialization
+			Timer::tic("Random Init");
+			RandomInit(coeffsL, bestcostsL, dsiL, weightsL, couplingL);
+			RandomInit(coeffsR, bestcostsR, dsiR, weightsR, couplingR);
 			Timer::toc();
 		}
 		else {
-			Timer::tic("Left View");
-			#pragma omp parallel for
-			for (int y = nrows - 1; y >= 0; y--) {
-				for (int x = ncols - 1; x >= 0; x--) {
-					PropagateAndRandomSearch(y, x, coeffsL, coeffsR, bestcostsL, bestcostsR, dsiL, dsiR, weightsL, weightsR, iter, -1);
+			// The planes converged at the previous theta are a good guess, the coupling target
+			// only moves slowly. Re-score them and refine with a single local sweep.
+			Timer::tic("Warm Start");
+			RescorePlanes(coeffsL, bestcostsL, dsiL, weightsL, couplingL);
+			RescorePlanes(coeffsR, bestcostsR, dsiR, weightsR, couplingR);
+			Timer::toc();
+			niters = WARM_START_ITERS;
+			radius = WARM_START_RADIUS;
+		}
+
+		// Iteration, alternating the scan order across theta steps as well
+		for (int i = 0; i < niters; i++, state.nsweeps++) {
+			int iter = state.nsweeps;
+
+			if (iter % 2 == 0) {
+				Timer::tic("Left View");
+				#pragma omp parallel for
+				for (int y = 0; y < nrows; y++) {
+					for (int x = 0; x < ncols; x++) {
+						PropagateAndRandomSearch(y, x, coeffsL, coeffsR, bestcostsL, bestcostsR, dsiL, dsiR, weightsL, weightsR, iter, -1, radius, couplingL, couplingR);
+					}
 				}
+				Timer::toc();
+				Timer::tic("Right View");
+				#pragma omp parallel for
+				for (int y = 0; y < nrows; y++) {
+					for (int x = 0; x < ncols; x++) {
+						PropagateAndRandomSearch(y, x, coeffsR, coeffsL, bestcostsR, bestcostsL, dsiR, dsiL, weightsR, weightsL, iter, +1, radius, couplingR, couplingL);
+					}
+				}
+				Timer::toc();
 			}
-			Timer::toc();
-			Timer::tic("Right View");
-			#pragma omp parallel for
-			for (int y = nrows - 1; y >= 0; y--) {
-				for (int x = ncols - 1; x >= 0; x--) {
-					PropagateAndRandomSearch(y, x, coeffsR, coeffsL, bestcostsR, bestcostsL, dsiR, dsiL, weightsR, weightsL, iter, +1);
+			else {
+				Timer::tic("Left View");
+				#pragma omp parallel for
+				for (int y = nrows - 1; y >= 0; y--) {
+					for (int x = ncols - 1; x >= 0; x--) {
+						PropagateAndRandomSearch(y, x, coeffsL, coeffsR, bestcostsL, bestcostsR, dsiL, dsiR, weightsL, weightsR, iter, -1, radius, couplingL, couplingR);
+					}
 				}
+				Timer::toc();
+				Timer::tic("Right View");
+				#pragma omp parallel for
+				for (int y = nrows - 1; y >= 0; y--) {
+					for (int x = ncols - 1; x >= 0; x--) {
+						PropagateAndRandomSearch(y, x, coeffsR, coeffsL, bestcostsR, bestcostsL, dsiR, dsiL, weightsR, weightsL, iter, +1, radius, couplingR, couplingL);
+					}
+				}
+				Timer::toc();
 			}
-			Timer::toc();
 		}
-	}
 
-	printf("g_improve_cnt: %d\n", g_improve_cnt);
-	coeffsL.SaveToBinaryFile(folders[folder_id] + "coeffsL.bin");
-	coeffsR.SaveToBinaryFile(folders[folder_id] + "coeffsR.bin");
-#else
-	coeffsL.LoadFromBinaryFile(folders[folder_id] + "coeffsL.bin");
-	coeffsR.LoadFromBinaryFile(folders[folder_id] + "coeffsR.bin");
-#endif
+		printf("g_improve_cnt: %d\n", g_improve_cnt);
+		if (!g_batchMode) {
+			coeffsL.SaveToFile(folders[folder_id] + "coeffsL.bin", RunParameters());
+			coeffsR.SaveToFile(folders[folder_id] + "coeffsR.bin", RunParameters());
+		}
+	}
 
 	// Post processing
 	Timer::tic("POST PROCESSING");
@@ -781,24 +998,32 @@ void RunPatchMatchStereo(cv::Mat& imL, cv::Mat& imR, int ndisps, VECBITMAP<float
 	//EvaluateDisparity(dispL, 0.5f, coeffsL);
 }
 
+void RunPatchMatchStereo(cv::Mat& imL, cv::Mat& imR, int ndisps, VECBITMAP<float>& uL, VECBITMAP<float>& uR, float theta, float lambda)
+{
+	PatchMatchState state;
+	RunPatchMatchStereo(imL, imR, ndisps, uL, uR, theta, lambda, state);
+}
 
 
 
 
 
 extern VECBITMAP<float> g_dispOld, g_dispNew;
-extern std::vector<std::vector<cv::Point2d>> g_regionList;
+extern RegionIndex g_regions;
 extern VECBITMAP<int> g_labelmap;
 void InteractiveRefinement(cv::Mat& imL)
 {
 	printf("1111\n");
 	VECBITMAP<Plane> coeffsL(nrows, ncols), coeffsR(nrows, ncols);
-	coeffsL.LoadFromBinaryFile(folders[folder_id] + "coeffsL.bin");
-	coeffsR.LoadFromBinaryFile(folders[folder_id] + "coeffsR.bin");
+	if (!LoadLastPlanes(coeffsL, coeffsR)) {
+		return;
+	}
 	printf("1111\n");
-	VECBITMAP<float> dispL(nrows, ncols), dispR(nrows, ncols);
-	dispL.LoadFromBinaryFile(folders[folder_id] + "PatchMatch_dispL.bin");
-	dispR.LoadFromBinaryFile(folders[folder_id] + "PatchMatch_dispR.bin");
+	VECBITMAP<float> dispL, dispR;
+	// Loaded, not mapped: copies of a mapped bitmap share its data, and the undo needs g_dispOld and g_dispNew to be separate.
+	if (!dispL.LoadFromFile(folders[folder_id] + "PatchMatch_dispL.bin") || !dispR.LoadFromFile(folders[folder_id] + "PatchMatch_dispR.bin")) {
+		return;
+	}
 
 	printf("1111\n");
 
@@ -829,28 +1054,9 @@ void InteractiveRefinement(cv::Mat& imL)
 	cv::imwrite(folders[folder_id] + "segments.png", g_segments);
 
 	VECBITMAP<int> labelmap(nrows, ncols);
-	int FromSegmentMapToLabelMap(cv::Mat& segmap, VECBITMAP<int>& labelmap);
-	int nlables = FromSegmentMapToLabelMap(g_segments, labelmap);
-
-
-	std::vector<int> regionSize(nlables, 0);
-	for (int y = 0; y < nrows; y++) {
-		for (int x = 0; x < ncols; x++) {
-			regionSize[labelmap[y][x]]++;
-		}
-	}
-	std::vector<std::vector<cv::Point2d>> regionList(nlables);
-	for (int i = 0; i < nlables; i++) {
-		regionList[i].reserve(regionSize[i]);
-	}
-	for (int y = 0; y < nrows; y++) {
-		for (int x = 0; x < ncols; x++) {
-			int label = labelmap[y][x];
-			regionList[label].push_back(cv::Point2d(x, y));
-		}
-	}
+	int FromSegmentMapToLabelMap(cv::Mat& segmap, VECBITMAP<int>& labelmap, RegionIndex& regions);
+	FromSegmentMapToLabelMap(g_segments, labelmap, g_regions);
 
-	g_regionList = regionList;
 	g_labelmap = labelmap;
 
 	void EvaluateDisparity2(VECBITMAP<float>& h_disp, float thresh, VECBITMAP<Plane>& coeffsL);
@@ -908,14 +1114,35 @@ void WeightedMedianFilter(int yc, int xc, VECBITMAP<float>& disp, VECBITMAP<floa
 
 
 
-int main()
+int main(int argc, char **argv)
 {
 #ifndef USE_OPENMP
 	omp_set_num_threads(1);
 #endif
 
-	cv::Mat imL = cv::imread(folders[folder_id] + "im2.png");
-	cv::Mat imR = cv::imread(folders[folder_id] + "im6.png");
+	if (argc > 1 && std::string(argv[1]) == "--benchmark") {
+		return RunBenchmark(argc - 1, argv + 1);
+	}
+	if (argc > 1 && std::string(argv[1]) == "--microbench") {
+		return RunMicroBenchmark(argc - 1, argv + 1);
+	}
+	if (argc > 1 && std::string(argv[1]) == "--pack") {
+		return RunPackDatasets(argc - 1, argv + 1);
+	}
+	if (argc > 1 && std::string(argv[1]) == "--serve") {
+		return RunStereoServer(argc - 1, argv + 1);
+	}
+	if (argc > 2 && std::string(argv[1]) == "--mem-budget") {
+		g_memoryBudgetBytes = (long long)(atof(argv[2]) * 1048576.0);
+	}
+
+	StereoDataset ds;
+	if (!ds.Load(folder_id)) {
+		return 1;
+	}
+	SetEvaluationDataset(ds);
+	cv::Mat imL = ds.L;
+	cv::Mat imR = ds.R;
 	nrows = imL.rows;
 	ncols = imL.cols;
 
@@ -945,6 +1172,9 @@ int main()
 	
 	//Timer::tic("LocalSearch");
 	//LocalSearch(imL, imR, ndisps, dispL, dispR);
+	if (!PlanStereo("laplacian", nrows, ncols, ndisps)) {
+		return 1;
+	}
 	Timer::tic("PatchMatchStereo");
 	//RunPatchMatchStereo(imL, imR, ndisps);
 	RunLaplacianStereo(imL, imR, ndisps);
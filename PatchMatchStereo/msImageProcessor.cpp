@@ -35,6 +35,7 @@
 
 //include image processor class prototype
 #include	"msImageProcessor.h"
+#include	"ColorConversion.h"
 
 //include needed libraries
 #include	<math.h>
@@ -42,6 +43,16 @@
 #include	<assert.h>
 #include	<string.h>
 #include	<stdlib.h>
+#include	<algorithm>
+#include	<vector>
+#include	<omp.h>
+
+//rows per band of the parallel filter
+#define	MS_BAND_HEIGHT	16
+
+//cell size of the grid filter, as a fraction of sigmaS and sigmaR
+#define	MS_GRID_SPATIAL_CELL	1.0
+#define	MS_GRID_RANGE_CELL		1.0
 
 /*@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@*/
 /*@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@*/
@@ -89,6 +100,10 @@ msImageProcessor::msImageProcessor(void)
 	raList = NULL;
 	freeRAList = NULL;
 	raPool = NULL;
+	raPoolSize = 0;
+	ramOffsets = NULL;
+	ramEdges = NULL;
+	ramEdgeCapacity = 0;
 
 	//intialize visit table to having NULL entries
 	visitTable = NULL;
@@ -173,10 +188,7 @@ void msImageProcessor::DefineImage(byte *data_, imageType type, int height_, int
 	}
 	else
 	{
-		for (i = 0; i < height_*width_; i++)
-		{
-			RGBtoLUV(&data_[dim*i], &luv[dim*i]);
-		}
+		RGBtoLUV(data_, luv, height_*width_);
 	}
 
 	//define input defined on a lattice using mean shift base class
@@ -225,9 +237,7 @@ void msImageProcessor::DefineBgImage(byte* data_, imageType type, int height_, i
 	}
 	else
 	{
-		for (i = 0; i < height_*width_; i++)
-			RGBtoLUV(&data_[dim*i], &luv[dim*i]);
-
+		RGBtoLUV(data_, luv, height_*width_);
 	}
 
 	//define input defined on a lattice using mean shift base class
@@ -337,7 +347,9 @@ void msImageProcessor::RemoveWeightMap(void)
 /*        filtering should be optimized for faster     */
 /*        execution: a value of NO_SPEEDUP turns this  */
 /*        optimization off and a value SPEEDUP turns   */
-/*        this optimization on                         */
+/*        this optimization on; GRID_SPEEDUP runs an   */
+/*        approximate mean shift on a downsampled      */
+/*        spatial-range grid instead                   */
 /*      - a data set has been defined                  */
 /*      - the height and width of the lattice has been */
 /*        specified using method DefineLattice()       */
@@ -376,15 +388,6 @@ void msImageProcessor::Filter(int sigmaS, float sigmaR, SpeedUpLevel speedUpLeve
 			return;
 	}
 
-	//****************** Allocate Memory ******************
-
-	//Allocate memory for basin of attraction mode structure...
-	if ((!(modeTable = new unsigned char[L])) || (!(pointList = new int[L])))
-	{
-		ErrorHandler("msImageProcessor", "Allocate", "Not enough memory.");
-		return;
-	}
-
 	//start timer
 #ifdef PROMPT
 	double timer;
@@ -399,34 +402,28 @@ void msImageProcessor::Filter(int sigmaS, float sigmaR, SpeedUpLevel speedUpLeve
 		//no speedup...
 	case NO_SPEEDUP:
 		//NonOptimizedFilter((float)(sigmaS), sigmaR);	break;
-		NewNonOptimizedFilter((float) (sigmaS), sigmaR);
+		//NewNonOptimizedFilter((float) (sigmaS), sigmaR);
+		ParallelFilter((float) (sigmaS), sigmaR, NO_SPEEDUP);
 		break;
 		//medium speedup
 	case MED_SPEEDUP:
 		//OptimizedFilter1((float)(sigmaS), sigmaR);		break;
-		NewOptimizedFilter1((float) (sigmaS), sigmaR);
+		//NewOptimizedFilter1((float) (sigmaS), sigmaR);
+		ParallelFilter((float) (sigmaS), sigmaR, MED_SPEEDUP);
 		break;
 		//high speedup
 	case HIGH_SPEEDUP:
 		//OptimizedFilter2((float)(sigmaS), sigmaR);		break;
-		NewOptimizedFilter2((float) (sigmaS), sigmaR);
+		//NewOptimizedFilter2((float) (sigmaS), sigmaR);
+		ParallelFilter((float) (sigmaS), sigmaR, HIGH_SPEEDUP);
+		break;
+		//approximate mean shift on a downsampled grid
+	case GRID_SPEEDUP:
+		GridFilter((float) (sigmaS), sigmaR);
 		break;
 		// new speedup
 	}
 
-	//****************** Deallocate Memory ******************
-
-	//de-allocate memory used by basin of attraction mode structure
-	delete [] modeTable;
-	delete [] pointList;
-
-	//re-initialize structure
-	modeTable = NULL;
-	pointList = NULL;
-	pointCount = 0;
-
-	//*******************************************************	
-
 	//Label image regions, also if segmentation is not to be
 	//performed use the resulting classification structure to
 	//calculate the image boundaries...
@@ -810,6 +807,67 @@ void msImageProcessor::RGBtoLUV(byte *rgbVal, float *luvVal)
 
 }
 
+/*******************************************************/
+/*RGB To LUV (image)                                   */
+/*******************************************************/
+/*Converts n RGB vectors to LUV.                       */
+/*******************************************************/
+/*Pre:                                                 */
+/*      - rgbVal is an unsigned char array containing  */
+/*        n interleaved RGB vectors                    */
+/*      - luvVal is a floating point array of 3n       */
+/*        elements                                     */
+/*Post:                                                */
+/*      - the pixels have been converted as by         */
+/*        RGBtoLUV(rgbVal, luvVal), in single          */
+/*        precision blocks (see ColorConversion.h).    */
+/*******************************************************/
+
+void msImageProcessor::RGBtoLUV(byte *rgbVal, float *luvVal, int n)
+{
+
+	//fold the 1/255 of L0 into the matrix; u' and v' are
+	//ratios and do not change
+	float	M[3][3];
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++)
+			M[i][j] = (float) (XYZ[i][j] / (255.0 * Yn));
+
+	#pragma omp parallel for
+	for (int start = 0; start < n; start += COLOR_BLOCK_SIZE)
+	{
+		int		m = (n - start < COLOR_BLOCK_SIZE) ? n - start : COLOR_BLOCK_SIZE;
+		float	r[COLOR_BLOCK_SIZE], g[COLOR_BLOCK_SIZE], b[COLOR_BLOCK_SIZE];
+		float	x[COLOR_BLOCK_SIZE], y[COLOR_BLOCK_SIZE], z[COLOR_BLOCK_SIZE];
+
+		byte	*rgb = rgbVal + 3*start;
+		for (int k = 0; k < m; k++)
+		{
+			r[k] = rgb[3*k    ];
+			g[k] = rgb[3*k + 1];
+			b[k] = rgb[3*k + 2];
+		}
+		ApplyColorMatrix(M, r, g, b, x, y, z, m);
+
+		float	*luv = luvVal + 3*start;
+		for (int k = 0; k < m; k++)
+		{
+			//y[k] is L0 here
+			float L		   = (y[k] > Lt) ? 116.0f * CubeRoot(y[k]) - 16.0f : 903.3f * y[k];
+			float constant = x[k] + 15 * y[k] + 3 * z[k];
+			float u_prime  = (constant != 0) ? (4 * x[k]) / constant : 4.0f;
+			float v_prime  = (constant != 0) ? (9 * y[k]) / constant : 9.0f / 15.0f;
+			luv[3*k    ] = L;
+			luv[3*k + 1] = (float) (13 * L * (u_prime - Un_prime));
+			luv[3*k + 2] = (float) (13 * L * (v_prime - Vn_prime));
+		}
+	}
+
+	//done.
+	return;
+
+}
+
 /*******************************************************/
 /*LUV To RGB                                           */
 /*******************************************************/
@@ -1299,6 +1357,10 @@ void msImageProcessor::OptimizedFilter1(float sigmaS, float sigmaR)
 	// Allocate memory for Mh
 	double	*Mh = new double[lN];
 
+	// Allocate memory for basin of attraction mode structure
+	modeTable = new unsigned char[L];
+	pointList = new int[L];
+
 	// Initialize mode table used for basin of attraction
 	memset(modeTable, 0, width*height);
 
@@ -1513,6 +1575,11 @@ void msImageProcessor::OptimizedFilter1(float sigmaS, float sigmaR)
 #endif
 
 	// de-allocate memory
+	delete [] modeTable;
+	delete [] pointList;
+	modeTable = NULL;
+	pointList = NULL;
+	pointCount = 0;
 	delete [] modeCandidatePoint;
 	delete [] yk;
 	delete [] Mh;
@@ -1593,6 +1660,10 @@ void msImageProcessor::OptimizedFilter2(float sigmaS, float sigmaR)
 	// Allocate memory for Mh
 	double	*Mh = new double[lN];
 
+	// Allocate memory for basin of attraction mode structure
+	modeTable = new unsigned char[L];
+	pointList = new int[L];
+
 	// Initialize mode table used for basin of attraction
 	memset(modeTable, 0, width*height);
 
@@ -1807,6 +1878,11 @@ void msImageProcessor::OptimizedFilter2(float sigmaS, float sigmaR)
 #endif
 
 	// de-allocate memory
+	delete [] modeTable;
+	delete [] pointList;
+	modeTable = NULL;
+	pointList = NULL;
+	pointCount = 0;
 	delete [] modeCandidatePoint;
 	delete [] yk;
 	delete [] Mh;
@@ -2014,11 +2090,14 @@ void msImageProcessor::BuildRAM(void)
 {
 
 	//Allocate memory for region adjacency matrix if it hasn't already been allocated
-	if ((!raList)&&((!(raList = new RAList[regionCount])) || (!(raPool = new RAList[NODE_MULTIPLE*regionCount]))))
+	if ((!raList)&&((!(raList = new RAList[regionCount])) || (!(raPool = new RAList[NODE_MULTIPLE*regionCount]))
+		|| (!(ramOffsets = new int[regionCount + 1]))))
 	{
 		ErrorHandler("msImageProcessor", "Allocate", "Not enough memory.");
 		return;
 	}
+	if (!raPoolSize)
+		raPoolSize = NODE_MULTIPLE*regionCount;
 
 	//initialize the region adjacency list
 	int i;
@@ -2030,6 +2109,11 @@ void msImageProcessor::BuildRAM(void)
 		raList[i].next = NULL;
 	}
 
+#ifdef MS_FLAT_RAM
+	BuildRAMFromEdges();
+	return;
+#endif
+
 	//initialize RAM free list
 	freeRAList = raPool;
 	for (i = 0; i < NODE_MULTIPLE*regionCount - 1; i++)
@@ -2229,6 +2313,165 @@ void msImageProcessor::BuildRAM(void)
 
 }
 
+//records that regions a and b are adjacent: pass 0 counts the
+//entry in both regions, pass 1 stores it at their fill positions
+static inline void AddRAMEdge(int a, int b, int pass, int *offsets, int *edges)
+{
+	if (pass == 0)
+	{
+		offsets[a + 1]++;
+		offsets[b + 1]++;
+	}
+	else
+	{
+		edges[offsets[a]++] = b;
+		edges[offsets[b]++] = a;
+	}
+}
+
+/*******************************************************/
+/*Build RAM From Edges                                 */
+/*******************************************************/
+/*Builds the region adjacency matrix from a flat array */
+/*of region neighbors.                                 */
+/*******************************************************/
+/*Pre:                                                 */
+/*      - raList has been initialized by BuildRAM.     */
+/*Post:                                                */
+/*      - the RAM holds the same sorted neighbor lists */
+/*        as the pixel by pixel construction in        */
+/*        BuildRAM.                                    */
+/*                                                     */
+/*The labeled image is scanned twice: the first pass   */
+/*counts the neighbor entries of every region and the  */
+/*second stores them grouped by region in ramEdges.    */
+/*Each group is then sorted and made unique, and       */
+/*linked into raList using consecutive nodes of        */
+/*raPool, which is simply reused by the next build.    */
+/*Consecutive pixels along a boundary, which give the  */
+/*same pair of regions, are only entered once.         */
+/*******************************************************/
+
+void msImageProcessor::BuildRAMFromEdges(void)
+{
+
+	int		i, j, k, pass, curLabel, nextLabel;
+	int		lastRight, lastRightNext, lastBottom, lastBottomNext;
+
+	//count (pass 0) and store (pass 1) the neighbor entries
+	for (pass = 0; pass < 2; pass++)
+	{
+		if (pass == 0)
+			memset(ramOffsets, 0, (regionCount + 1)*sizeof(int));
+
+		for (i = 0; i < height; i++)
+		{
+			lastRight = lastRightNext = lastBottom = lastBottomNext = -1;
+			for (j = 0; j < width; j++)
+			{
+				curLabel = labels[i*width + j];
+
+				//right neighbor
+				if ((j < width - 1) && ((nextLabel = labels[i*width + j + 1]) != curLabel)
+					&& ((curLabel != lastRight) || (nextLabel != lastRightNext)))
+				{
+					AddRAMEdge(curLabel, nextLabel, pass, ramOffsets, ramEdges);
+					lastRight = curLabel;
+					lastRightNext = nextLabel;
+				}
+
+				//bottom neighbor
+				if ((i < height - 1) && ((nextLabel = labels[(i + 1)*width + j]) != curLabel)
+					&& ((curLabel != lastBottom) || (nextLabel != lastBottomNext)))
+				{
+					AddRAMEdge(curLabel, nextLabel, pass, ramOffsets, ramEdges);
+					lastBottom = curLabel;
+					lastBottomNext = nextLabel;
+				}
+			}
+		}
+
+		if (pass == 0)
+		{
+			//turn counts into start positions, growing the edge
+			//array if needed
+			for (i = 0; i < regionCount; i++)
+				ramOffsets[i + 1] += ramOffsets[i];
+			if (ramOffsets[regionCount] > ramEdgeCapacity)
+			{
+				if (ramEdges)	delete [] ramEdges;
+				ramEdgeCapacity = ramOffsets[regionCount];
+				if (!(ramEdges = new int[ramEdgeCapacity]))
+				{
+					ErrorHandler("msImageProcessor", "BuildRAMFromEdges", "Not enough memory.");
+					return;
+				}
+			}
+		}
+		else
+		{
+			//the fill positions have advanced to the start of
+			//the next region, shift them back
+			for (i = regionCount; i > 0; i--)
+				ramOffsets[i] = ramOffsets[i - 1];
+			ramOffsets[0] = 0;
+		}
+	}
+
+	//sort the neighbors of every region and remove duplicates,
+	//compacting ramEdges in place
+	int	start = 0, end, count = 0;
+	for (i = 0; i < regionCount; i++)
+	{
+		end = ramOffsets[i + 1];
+		std::sort(ramEdges + start, ramEdges + end);
+		ramOffsets[i] = count;
+		for (k = start; k < end; k++)
+		{
+			if ((count == ramOffsets[i]) || (ramEdges[k] != ramEdges[count - 1]))
+				ramEdges[count++] = ramEdges[k];
+		}
+		start = end;
+	}
+	ramOffsets[regionCount] = count;
+
+	//make sure the node pool is large enough
+	if (count > raPoolSize)
+	{
+		delete [] raPool;
+		raPoolSize = count;
+		if (!(raPool = new RAList[raPoolSize]))
+		{
+			ErrorHandler("msImageProcessor", "BuildRAMFromEdges", "Not enough memory.");
+			return;
+		}
+	}
+
+	//link the RAM
+	RAList	*node, *tail;
+	for (i = 0; i < regionCount; i++)
+	{
+		tail = &raList[i];
+		for (k = ramOffsets[i]; k < ramOffsets[i + 1]; k++)
+		{
+			node = &raPool[k];
+			node->label = ramEdges[k];
+			node->edgeStrength = 0;
+			node->edgePixelCount = 0;
+			tail->next = node;
+			tail = node;
+		}
+		tail->next = NULL;
+	}
+
+	//the pool is not used as a free list here
+	freeRAList = NULL;
+
+	//done.
+	return;
+
+}
+
 /*******************************************************/
 /*Destroy Region Adjacency Matrix                      */
 /*******************************************************/
@@ -2247,11 +2490,17 @@ void msImageProcessor::DestroyRAM(void)
 	//de-allocate memory for region adjaceny list
 	if (raList)				delete [] raList;
 	if (raPool)				delete [] raPool;
+	if (ramOffsets)			delete [] ramOffsets;
+	if (ramEdges)			delete [] ramEdges;
 
 	//initialize region adjacency matrix
 	raList = NULL;
 	freeRAList = NULL;
 	raPool = NULL;
+	raPoolSize = 0;
+	ramOffsets = NULL;
+	ramEdges = NULL;
+	ramEdgeCapacity = 0;
 
 	//done.
 	return;
@@ -3380,6 +3629,10 @@ void msImageProcessor::NewOptimizedFilter1(float sigmaS, float sigmaR)
 	// done indexing/hashing
 
 
+	// Allocate memory for basin of attraction mode structure
+	modeTable = new unsigned char[L];
+	pointList = new int[L];
+
 	// Initialize mode table used for basin of attraction
 	memset(modeTable, 0, width*height);
 
@@ -3715,6 +3968,11 @@ void msImageProcessor::NewOptimizedFilter1(float sigmaS, float sigmaR)
 	msSys.Prompt("done.");
 #endif
 	// de-allocate memory
+	delete [] modeTable;
+	delete [] pointList;
+	modeTable = NULL;
+	pointList = NULL;
+	pointCount = 0;
 	delete [] buckets;
 	delete [] slist;
 	delete [] sdata;
@@ -3862,6 +4120,10 @@ void msImageProcessor::NewOptimizedFilter2(float sigmaS, float sigmaR)
 	// done indexing/hashing
 
 
+	// Allocate memory for basin of attraction mode structure
+	modeTable = new unsigned char[L];
+	pointList = new int[L];
+
 	// Initialize mode table used for basin of attraction
 	memset(modeTable, 0, width*height);
 
@@ -4217,6 +4479,11 @@ void msImageProcessor::NewOptimizedFilter2(float sigmaS, float sigmaR)
 	msSys.Prompt("done.");
 #endif
 	// de-allocate memory
+	delete [] modeTable;
+	delete [] pointList;
+	modeTable = NULL;
+	pointList = NULL;
+	pointCount = 0;
 	delete [] buckets;
 	delete [] slist;
 	delete [] sdata;
@@ -4582,6 +4849,762 @@ void msImageProcessor::NewNonOptimizedFilter(float sigmaS, float sigmaR)
 
 }
 
+/*******************************************************/
+/*Parallel Filter                                      */
+/*******************************************************/
+/*Applies mean shift to every point of the lattice on  */
+/*all cores.                                           */
+/*******************************************************/
+/*Pre:                                                 */
+/*      - sigmaS and sigmaR are the spatial and range  */
+/*        radii of the search window                   */
+/*      - speedUpLevel selects which of the            */
+/*        NewNonOptimizedFilter, NewOptimizedFilter1   */
+/*        and NewOptimizedFilter2 shortcuts are used   */
+/*Post:                                                */
+/*      - msRawData holds the mode of every point.     */
+/*                                                     */
+/*The lattice is cut into bands of MS_BAND_HEIGHT rows */
+/*that are processed independently, each with its own  */
+/*window buffers, point list and basin of attraction   */
+/*table. A basin shortcut is only taken for points of  */
+/*the same band, so every point is written by exactly  */
+/*one thread and the result does not depend on the     */
+/*number of threads. With NO_SPEEDUP the result is the */
+/*same as NewNonOptimizedFilter.                       */
+/*******************************************************/
+
+void msImageProcessor::ParallelFilter(float sigmaS, float sigmaR, SpeedUpLevel speedUpLevel)
+{
+
+	// Declare Variables
+	int   i, j;
+
+	//make sure that a lattice height and width have
+	//been defined...
+	if (!height)
+	{
+		ErrorHandler("msImageProcessor", "LFilter", "Lattice height and width are undefined.");
+		return;
+	}
+
+	//re-assign bandwidths to sigmaS and sigmaR
+	if (((h[0] = sigmaS) <= 0) || ((h[1] = sigmaR) <= 0))
+	{
+		ErrorHandler("msImageProcessor", "Segment", "sigmaS and/or sigmaR is zero or negative.");
+		return;
+	}
+
+	//define input data dimension with lattice
+	int lN = N + 2;
+
+	// let's use some temporary data
+	double* sdata;
+	sdata = new double[lN*L];
+
+	// copy the scaled data
+	int idxs, idxd;
+	idxs = idxd = 0;
+	if (N == 3)
+	{
+		for (i = 0; i < L; i++)
+		{
+			sdata[idxs++] = (i%width) / sigmaS;
+			sdata[idxs++] = (i / width) / sigmaS;
+			sdata[idxs++] = data[idxd++] / sigmaR;
+			sdata[idxs++] = data[idxd++] / sigmaR;
+			sdata[idxs++] = data[idxd++] / sigmaR;
+		}
+	}
+	else if (N == 1)
+	{
+		for (i = 0; i < L; i++)
+		{
+			sdata[idxs++] = (i%width) / sigmaS;
+			sdata[idxs++] = (i / width) / sigmaS;
+			sdata[idxs++] = data[idxd++] / sigmaR;
+		}
+	}
+	else
+	{
+		for (i = 0; i < L; i++)
+		{
+			sdata[idxs++] = (i%width) / sigmaS;
+			sdata[idxs++] = (i%width) / sigmaS;
+			for (j = 0; j < N; j++)
+				sdata[idxs++] = data[idxd++] / sigmaR;
+		}
+	}
+	// index the data in the 3d buckets (x, y, L)
+	int* buckets;
+	int* slist;
+	slist = new int[L];
+	int bucNeigh[27];
+
+	double sMins; // just for L
+	double sMaxs[3]; // for all
+	sMaxs[0] = width / sigmaS;
+	sMaxs[1] = height / sigmaS;
+	sMins = sMaxs[2] = sdata[2];
+	idxs = 2;
+	double cval;
+	for (i = 0; i < L; i++)
+	{
+		cval = sdata[idxs];
+		if (cval < sMins)
+			sMins = cval;
+		else if (cval > sMaxs[2])
+			sMaxs[2] = cval;
+
+		idxs += lN;
+	}
+
+	int nBuck1, nBuck2, nBuck3;
+	int cBuck1, cBuck2, cBuck3, cBuck;
+	nBuck1 = (int) (sMaxs[0] + 3);
+	nBuck2 = (int) (sMaxs[1] + 3);
+	nBuck3 = (int) (sMaxs[2] - sMins + 3);
+	buckets = new int[nBuck1*nBuck2*nBuck3];
+	for (i = 0; i < (nBuck1*nBuck2*nBuck3); i++)
+		buckets[i] = -1;
+
+	idxs = 0;
+	for (i = 0; i < L; i++)
+	{
+		// find bucket for current data and add it to the list
+		cBuck1 = (int) sdata[idxs] + 1;
+		cBuck2 = (int) sdata[idxs + 1] + 1;
+		cBuck3 = (int) (sdata[idxs + 2] - sMins) + 1;
+		cBuck = cBuck1 + nBuck1*(cBuck2 + nBuck2*cBuck3);
+
+		slist[i] = buckets[cBuck];
+		buckets[cBuck] = i;
+
+		idxs += lN;
+	}
+	// init bucNeigh
+	idxd = 0;
+	for (cBuck1 = -1; cBuck1 <= 1; cBuck1++)
+	{
+		for (cBuck2 = -1; cBuck2 <= 1; cBuck2++)
+		{
+			for (cBuck3 = -1; cBuck3 <= 1; cBuck3++)
+			{
+				bucNeigh[idxd++] = cBuck1 + nBuck1*(cBuck2 + nBuck2*cBuck3);
+			}
+		}
+	}
+	double hiLTr = 80.0 / sigmaR;
+	// done indexing/hashing
+
+	// basin of attraction radius, see NewOptimizedFilter1/2
+	double basinDist = (speedUpLevel == HIGH_SPEEDUP) ? speedThreshold : TC_DIST_FACTOR;
+	int nBands = (height + MS_BAND_HEIGHT - 1) / MS_BAND_HEIGHT;
+
+	// proceed ...
+#ifdef PROMPT
+	msSys.Prompt("done.\nApplying mean shift (Using Lattice, %d threads)... ", omp_get_max_threads());
+#endif
+
+	#pragma omp parallel
+	{
+		// thread-local window center, mean shift vector,
+		// basin of attraction table and point list of a band
+		int		iterationCount, k, idx, modeCandidateX, modeCandidateY, modeCandidate_i;
+		int		bcBuck, pointCount;
+		double	mvAbs, diff, el, wsuml, weight;
+		double	*yk = new double[lN];
+		double	*Mh = new double[lN];
+		unsigned char *bandTable = new unsigned char[MS_BAND_HEIGHT*width];
+		int		*bandPoints = new int[MS_BAND_HEIGHT*width];
+
+		#pragma omp for schedule(dynamic, 1)
+		for (int band = 0; band < nBands; band++)
+		{
+			int first = band*MS_BAND_HEIGHT*width;
+			int last = (first + MS_BAND_HEIGHT*width < L) ? first + MS_BAND_HEIGHT*width : L;
+			memset(bandTable, 0, last - first);
+
+			for (int p = first; p < last; p++)
+			{
+				// if a mode was already assigned to this data point
+				// then skip this point
+				if ((speedUpLevel != NO_SPEEDUP) && (bandTable[p - first] == 1))
+					continue;
+
+				// initialize point list...
+				pointCount = 0;
+
+				// Assign window center
+				idx = p*lN;
+				for (int j = 0; j < lN; j++)
+					yk[j] = sdata[idx + j];
+
+				iterationCount = 0;
+				for (;;)
+				{
+					// Calculate the mean shift vector at yk using the lattice
+					for (int j = 0; j < lN; j++)
+						Mh[j] = 0;
+					wsuml = 0;
+					bcBuck = ((int) yk[0] + 1) + nBuck1*(((int) yk[1] + 1) + nBuck2*((int) (yk[2] - sMins) + 1));
+					for (int j = 0; j < 27; j++)
+					{
+						int nb = buckets[bcBuck + bucNeigh[j]];
+						// list parse, crt point is cHeadList
+						while (nb >= 0)
+						{
+							idx = lN*nb;
+							// determine if inside search window
+							el = sdata[idx + 0] - yk[0];
+							diff = el*el;
+							el = sdata[idx + 1] - yk[1];
+							diff += el*el;
+
+							if (diff < 1.0)
+							{
+								el = sdata[idx + 2] - yk[2];
+								if (yk[2] > hiLTr)
+									diff = 4 * el*el;
+								else
+									diff = el*el;
+
+								if (N > 1)
+								{
+									el = sdata[idx + 3] - yk[3];
+									diff += el*el;
+									el = sdata[idx + 4] - yk[4];
+									diff += el*el;
+								}
+
+								if (diff < 1.0)
+								{
+									weight = 1 - weightMap[nb];
+									for (k = 0; k < lN; k++)
+										Mh[k] += weight*sdata[idx + k];
+									wsuml += weight;
+
+									//set basin of attraction mode table
+									if ((speedUpLevel == HIGH_SPEEDUP) && (diff < speedThreshold)
+										&& (first <= nb) && (nb < last) && (bandTable[nb - first] == 0))
+									{
+										bandPoints[pointCount++] = nb;
+										bandTable[nb - first] = 2;
+									}
+								}
+							}
+							nb = slist[nb];
+						}
+					}
+					if (wsuml > 0)
+					{
+						for (int j = 0; j < lN; j++)
+							Mh[j] = Mh[j] / wsuml - yk[j];
+					}
+					else
+					{
+						for (int j = 0; j < lN; j++)
+							Mh[j] = 0;
+					}
+
+					// Calculate its magnitude squared (NewNonOptimizedFilter
+					// measures the first step unscaled)
+					if ((iterationCount == 0) && (speedUpLevel == NO_SPEEDUP))
+					{
+						mvAbs = 0;
+						for (int j = 0; j < lN; j++)
+							mvAbs += Mh[j] * Mh[j];
+					}
+					else
+					{
+						mvAbs = (Mh[0] * Mh[0] + Mh[1] * Mh[1])*sigmaS*sigmaS;
+						if (N == 3)
+							mvAbs += (Mh[2] * Mh[2] + Mh[3] * Mh[3] + Mh[4] * Mh[4])*sigmaR*sigmaR;
+						else
+							mvAbs += Mh[2] * Mh[2] * sigmaR*sigmaR;
+					}
+					iterationCount++;
+
+					// Keep shifting window center until the magnitude squared of the
+					// mean shift vector is under EPSILON
+					if ((mvAbs < EPSILON) || (iterationCount >= LIMIT))
+						break;
+
+					// Shift window location
+					for (int j = 0; j < lN; j++)
+						yk[j] += Mh[j];
+
+					if (speedUpLevel == NO_SPEEDUP)
+						continue;
+
+					// check to see if the current mode location is in the
+					// basin of attraction of a point of this band
+					modeCandidateX = (int) (sigmaS*yk[0] + 0.5);
+					modeCandidateY = (int) (sigmaS*yk[1] + 0.5);
+					modeCandidate_i = modeCandidateY*width + modeCandidateX;
+
+					if ((first <= modeCandidate_i) && (modeCandidate_i < last) && (modeCandidate_i != p)
+						&& (bandTable[modeCandidate_i - first] != 2))
+					{
+						diff = 0;
+						idx = lN*modeCandidate_i;
+						for (k = 2; k < lN; k++)
+						{
+							el = sdata[idx + k] - yk[k];
+							diff += el*el;
+						}
+
+						if (diff < basinDist)
+						{
+							if (bandTable[modeCandidate_i - first] == 0)
+							{
+								// no mode associated yet so associate
+								// it with this one...
+								bandPoints[pointCount++] = modeCandidate_i;
+								bandTable[modeCandidate_i - first] = 2;
+							}
+							else
+							{
+								// take over the mode of data[basin_i]
+								for (int j = 0; j < N; j++)
+									yk[j + 2] = msRawData[modeCandidate_i*N + j] / sigmaR;
+								bandTable[p - first] = 1;
+								mvAbs = -1;
+								break;
+							}
+						}
+					}
+				}
+
+				// if a mode was not associated with this data point
+				// yet associate it with yk...
+				if (mvAbs >= 0)
+				{
+					for (int j = 0; j < lN; j++)
+						yk[j] += Mh[j];
+					bandTable[p - first] = 1;
+				}
+
+				for (k = 0; k < N; k++)
+					yk[k + 2] *= sigmaR;
+
+				// associate the data points of the point list
+				// with the mode stored by yk
+				for (int j = 0; j < pointCount; j++)
+				{
+					modeCandidate_i = bandPoints[j];
+					bandTable[modeCandidate_i - first] = 1;
+					for (k = 0; k < N; k++)
+						msRawData[N*modeCandidate_i + k] = (float) (yk[k + 2]);
+				}
+
+				//store result into msRawData...
+				for (int j = 0; j < N; j++)
+					msRawData[N*p + j] = (float) (yk[j + 2]);
+			}
+		}
+
+		delete [] yk;
+		delete [] Mh;
+		delete [] bandTable;
+		delete [] bandPoints;
+	}
+
+	// Prompt user that filtering is completed
+#ifdef PROMPT
+	msSys.Prompt("done.");
+#endif
+
+	// de-allocate memory
+	delete [] buckets;
+	delete [] slist;
+	delete [] sdata;
+
+	// done.
+	return;
+
+}
+
+//cells of the grid filter, bucketed in (x, y, L) like the
+//lattice points in NewNonOptimizedFilter
+struct MSGridCells
+{
+	int		N, lN, nCells;
+	int		nBuck1, nBuck2, bucNeigh[27];
+	int		*buckets, *slist;
+	double	sMins, hiLTr, sigmaS, sigmaR;
+	double	*cdata;			// cell centroids, in window units
+	double	*cweight;		// cell masses
+};
+
+//computes the mean shift vector Mh at yk over the cells
+//and returns its squared magnitude
+static double GridMeanShift(const MSGridCells& g, const double *yk, double *Mh)
+{
+	int		j, k, idx, nb, lN = g.lN;
+	double	diff, el, wsum = 0;
+
+	for (j = 0; j < lN; j++)
+		Mh[j] = 0;
+	int bc = ((int) yk[0] + 1) + g.nBuck1*(((int) yk[1] + 1) + g.nBuck2*((int) (yk[2] - g.sMins) + 1));
+	for (j = 0; j < 27; j++)
+	{
+		nb = g.buckets[bc + g.bucNeigh[j]];
+		while (nb >= 0)
+		{
+			idx = lN*nb;
+			el = g.cdata[idx + 0] - yk[0];
+			diff = el*el;
+			el = g.cdata[idx + 1] - yk[1];
+			diff += el*el;
+
+			if (diff < 1.0)
+			{
+				el = g.cdata[idx + 2] - yk[2];
+				if (yk[2] > g.hiLTr)
+					diff = 4 * el*el;
+				else
+					diff = el*el;
+
+				if (g.N > 1)
+				{
+					el = g.cdata[idx + 3] - yk[3];
+					diff += el*el;
+					el = g.cdata[idx + 4] - yk[4];
+					diff += el*el;
+				}
+
+				if (diff < 1.0)
+				{
+					for (k = 0; k < lN; k++)
+						Mh[k] += g.cweight[nb]*g.cdata[idx + k];
+					wsum += g.cweight[nb];
+				}
+			}
+			nb = g.slist[nb];
+		}
+	}
+	if (wsum > 0)
+	{
+		for (j = 0; j < lN; j++)
+			Mh[j] = Mh[j] / wsum - yk[j];
+	}
+	else
+	{
+		for (j = 0; j < lN; j++)
+			Mh[j] = 0;
+	}
+
+	double mvAbs = (Mh[0] * Mh[0] + Mh[1] * Mh[1])*g.sigmaS*g.sigmaS;
+	if (g.N == 3)
+		mvAbs += (Mh[2] * Mh[2] + Mh[3] * Mh[3] + Mh[4] * Mh[4])*g.sigmaR*g.sigmaR;
+	else
+		mvAbs += Mh[2] * Mh[2] * g.sigmaR*g.sigmaR;
+	return mvAbs;
+}
+
+/*******************************************************/
+/*Grid Filter                                          */
+/*******************************************************/
+/*Approximate mean shift on a downsampled joint        */
+/*spatial-range grid (GRID_SPEEDUP).                   */
+/*******************************************************/
+/*Pre:                                                 */
+/*      - sigmaS and sigmaR are the spatial and range  */
+/*        radii of the search window                   */
+/*Post:                                                */
+/*      - msRawData holds an approximate mode for      */
+/*        every point.                                 */
+/*                                                     */
+/*The points are splatted into cells of                */
+/*MS_GRID_SPATIAL_CELL*sigmaS pixels by                */
+/*MS_GRID_RANGE_CELL*sigmaR range units, each cell     */
+/*keeping its centroid and mass. Every cell then takes */
+/*a single mean shift step (same window as             */
+/*NewNonOptimizedFilter) and points to the cell it     */
+/*lands in; following these links ends in a root cell, */
+/*from which the full mean shift is run once. Every    */
+/*point takes the mode of its cell's root. Boundaries  */
+/*are only accurate to about a cell; FuseRegions and   */
+/*Prune clean up the regions as usual.                 */
+/*******************************************************/
+
+void msImageProcessor::GridFilter(float sigmaS, float sigmaR)
+{
+
+	// Declare Variables
+	int		i, j, k;
+
+	//make sure that a lattice height and width have
+	//been defined...
+	if (!height)
+	{
+		ErrorHandler("msImageProcessor", "LFilter", "Lattice height and width are undefined.");
+		return;
+	}
+
+	//re-assign bandwidths to sigmaS and sigmaR
+	if (((h[0] = sigmaS) <= 0) || ((h[1] = sigmaR) <= 0))
+	{
+		ErrorHandler("msImageProcessor", "Segment", "sigmaS and/or sigmaR is zero or negative.");
+		return;
+	}
+
+	//define input data dimension with lattice
+	int lN = N + 2;
+
+	//****************** Splat ******************
+
+	// range of every dimension in window units, and the strides of the
+	// cell key (cells of the spatial dimensions first)
+	double vMin[5], vMax[5], cellSize[5];
+	long long stride[5];
+	vMin[0] = vMin[1] = 0;
+	vMax[0] = width / sigmaS;
+	vMax[1] = height / sigmaS;
+	cellSize[0] = cellSize[1] = MS_GRID_SPATIAL_CELL;
+	for (j = 0; j < N; j++)
+	{
+		vMin[j + 2] = vMax[j + 2] = data[j] / sigmaR;
+		for (i = 1; i < L; i++)
+		{
+			double v = data[N*i + j] / sigmaR;
+			if (v < vMin[j + 2])
+				vMin[j + 2] = v;
+			else if (v > vMax[j + 2])
+				vMax[j + 2] = v;
+		}
+		cellSize[j + 2] = MS_GRID_RANGE_CELL;
+	}
+	stride[0] = 1;
+	for (j = 1; j < lN; j++)
+		stride[j] = stride[j - 1] * ((long long) ((vMax[j - 1] - vMin[j - 1]) / cellSize[j - 1]) + 1);
+
+	// cell key of every point, sorted
+	std::vector< std::pair<long long, int> > keys(L);
+	#pragma omp parallel for private(j)
+	for (i = 0; i < L; i++)
+	{
+		double v[5];
+		v[0] = (i%width) / sigmaS;
+		v[1] = (i / width) / sigmaS;
+		for (j = 0; j < N; j++)
+			v[j + 2] = data[N*i + j] / sigmaR;
+		long long key = 0;
+		for (j = 0; j < lN; j++)
+			key += stride[j] * (long long) ((v[j] - vMin[j]) / cellSize[j]);
+		keys[i] = std::make_pair(key, i);
+	}
+	std::sort(keys.begin(), keys.end());
+
+	// one cell per distinct key, holding the centroid and mass of its points
+	int *cellOf = new int[L];
+	std::vector<long long> cellKeys;
+	for (i = 0; i < L; i++)
+	{
+		if ((i == 0) || (keys[i].first != keys[i - 1].first))
+			cellKeys.push_back(keys[i].first);
+		cellOf[keys[i].second] = (int) cellKeys.size() - 1;
+	}
+	int nCells = (int) cellKeys.size();
+	double *cdata = new double[lN*nCells];
+	double *cweight = new double[nCells];
+	int *ccount = new int[nCells];
+	memset(cdata, 0, lN*nCells*sizeof(double));
+	memset(cweight, 0, nCells*sizeof(double));
+	memset(ccount, 0, nCells*sizeof(int));
+	for (i = 0; i < L; i++)
+	{
+		int c = cellOf[i];
+		double *cd = cdata + lN*c;
+		cd[0] += (i%width) / sigmaS;
+		cd[1] += (i / width) / sigmaS;
+		for (j = 0; j < N; j++)
+			cd[j + 2] += data[N*i + j] / sigmaR;
+		cweight[c] += 1 - weightMap[i];
+		ccount[c]++;
+	}
+	for (i = 0; i < nCells; i++)
+		for (j = 0; j < lN; j++)
+			cdata[lN*i + j] /= ccount[i];
+
+	//****************** Index the cells ******************
+
+	MSGridCells g;
+	g.N = N;
+	g.lN = lN;
+	g.nCells = nCells;
+	g.cdata = cdata;
+	g.cweight = cweight;
+	g.sigmaS = sigmaS;
+	g.sigmaR = sigmaR;
+	g.hiLTr = 80.0 / sigmaR;
+
+	double sMax = g.sMins = cdata[2];
+	for (i = 0; i < nCells; i++)
+	{
+		if (cdata[lN*i + 2] < g.sMins)
+			g.sMins = cdata[lN*i + 2];
+		else if (cdata[lN*i + 2] > sMax)
+			sMax = cdata[lN*i + 2];
+	}
+	g.nBuck1 = (int) (width / sigmaS + 3);
+	g.nBuck2 = (int) (height / sigmaS + 3);
+	int nBuck3 = (int) (sMax - g.sMins + 3);
+	g.buckets = new int[g.nBuck1*g.nBuck2*nBuck3];
+	g.slist = new int[nCells];
+	for (i = 0; i < g.nBuck1*g.nBuck2*nBuck3; i++)
+		g.buckets[i] = -1;
+	for (i = 0; i < nCells; i++)
+	{
+		int cBuck = ((int) cdata[lN*i] + 1) + g.nBuck1*(((int) cdata[lN*i + 1] + 1) + g.nBuck2*((int) (cdata[lN*i + 2] - g.sMins) + 1));
+		g.slist[i] = g.buckets[cBuck];
+		g.buckets[cBuck] = i;
+	}
+	k = 0;
+	for (int b1 = -1; b1 <= 1; b1++)
+		for (int b2 = -1; b2 <= 1; b2++)
+			for (int b3 = -1; b3 <= 1; b3++)
+				g.bucNeigh[k++] = b1 + g.nBuck1*(b2 + g.nBuck2*b3);
+
+#ifdef PROMPT
+	msSys.Prompt("done.\nApplying mean shift (Using Grid, %d cells)... ", nCells);
+#endif
+
+	//****************** Link every cell to where it shifts ******************
+
+	int *parent = new int[nCells];
+	#pragma omp parallel
+	{
+		double	*yk = new double[lN];
+		double	*Mh = new double[lN];
+
+		#pragma omp for schedule(dynamic, 256)
+		for (int c = 0; c < nCells; c++)
+		{
+			parent[c] = c;
+			if (GridMeanShift(g, cdata + lN*c, Mh) < EPSILON)
+				continue;
+
+			// key of the cell the shifted centroid falls in
+			long long key = 0;
+			for (int j = 0; j < lN; j++)
+			{
+				yk[j] = cdata[lN*c + j] + Mh[j];
+				long long cj = (long long) ((yk[j] - vMin[j]) / cellSize[j]);
+				long long nj = (j + 1 < lN) ? stride[j + 1] / stride[j] : cj + 1;
+				if ((cj < 0) || (cj >= nj))
+				{
+					key = -1;
+					break;
+				}
+				key += stride[j] * cj;
+			}
+			if (key < 0)
+				continue;
+			std::vector<long long>::iterator it = std::lower_bound(cellKeys.begin(), cellKeys.end(), key);
+			if ((it != cellKeys.end()) && (*it == key))
+				parent[c] = (int) (it - cellKeys.begin());
+		}
+
+		delete [] yk;
+		delete [] Mh;
+	}
+
+	// follow the links to a root: a cell linking to itself, or the
+	// cell where a walk closes a cycle
+	int *root = new int[nCells];
+	int *stamp = new int[nCells];
+	for (i = 0; i < nCells; i++)
+	{
+		root[i] = -1;
+		stamp[i] = -1;
+	}
+	std::vector<int> roots;
+	for (i = 0; i < nCells; i++)
+	{
+		int c = i;
+		while ((root[c] < 0) && (stamp[c] != i))
+		{
+			stamp[c] = i;
+			c = parent[c];
+		}
+		int r = root[c];
+		if (r < 0)
+		{
+			r = c;
+			roots.push_back(r);
+		}
+		for (c = i; root[c] < 0; c = parent[c])
+			root[c] = r;
+	}
+
+	//****************** Mode seeking from the roots ******************
+
+	float *cmode = new float[N*nCells];
+	int nRoots = (int) roots.size();
+
+	#pragma omp parallel
+	{
+		int		iterationCount;
+		double	*yk = new double[lN];
+		double	*Mh = new double[lN];
+
+		#pragma omp for schedule(dynamic, 16)
+		for (int r = 0; r < nRoots; r++)
+		{
+			int c = roots[r];
+			for (int j = 0; j < lN; j++)
+				yk[j] = cdata[lN*c + j];
+
+			iterationCount = 0;
+			for (;;)
+			{
+				double mvAbs = GridMeanShift(g, yk, Mh);
+				for (int j = 0; j < lN; j++)
+					yk[j] += Mh[j];
+				iterationCount++;
+				if ((mvAbs < EPSILON) || (iterationCount >= LIMIT))
+					break;
+			}
+
+			for (int j = 0; j < N; j++)
+				cmode[N*c + j] = (float) (yk[j + 2] * sigmaR);
+		}
+
+		delete [] yk;
+		delete [] Mh;
+	}
+
+	//****************** Slice ******************
+
+	// every point takes the mode of its cell's root
+	#pragma omp parallel for private(j)
+	for (i = 0; i < L; i++)
+		for (j = 0; j < N; j++)
+			msRawData[N*i + j] = cmode[N*root[cellOf[i]] + j];
+
+#ifdef PROMPT
+	msSys.Prompt("done (%d modes).", nRoots);
+#endif
+
+	// de-allocate memory
+	delete [] cmode;
+	delete [] root;
+	delete [] stamp;
+	delete [] parent;
+	delete [] g.buckets;
+	delete [] g.slist;
+	delete [] cdata;
+	delete [] cweight;
+	delete [] ccount;
+	delete [] cellOf;
+
+	// done.
+	return;
+
+}
+
 void msImageProcessor::SetSpeedThreshold(float speedUpThreshold)
 {
 	speedThreshold = speedUpThreshold;
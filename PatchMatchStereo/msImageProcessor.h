@@ -57,6 +57,10 @@
 #define BIG_NUM				0xffffffff	//BIG_NUM = 2^32-1
 #define NODE_MULTIPLE		10
 
+//build the region adjacency matrix from a flat edge array
+//instead of inserting RAM nodes pixel by pixel
+#define MS_FLAT_RAM
+
 //data space conversion...
 const double Xn = 0.95050;
 const double Yn = 1.00000;
@@ -259,6 +263,8 @@ public:
 	//|   used to perform image filtering. A value of      |//
 	//|   NO_SPEEDUP turns this optimization off and a     |//
 	//|   value of SPEEDUP turns this optimization on.     |//
+	//|   GRID_SPEEDUP runs an approximate mean shift on   |//
+	//|   a downsampled spatial-range grid instead.        |//
 	//|                                                    |//
 	//<--------------------------------------------------->|//
 	//|                                                    |//
@@ -412,6 +418,33 @@ public:
 
 	void RGBtoLUV(byte*, float*);
 
+	//--\\||//--\\||//--\\||//--\\||//--\\||//--\\||//--\\||//
+	//<--------------------------------------------------->|//
+	//|                                                    |//
+	//|	Method Name:								     |//
+	//|   ============								     |//
+	//|				 *  RGB To LUV (image)  *            |//
+	//|                                                    |//
+	//<--------------------------------------------------->|//
+	//|                                                    |//
+	//|	Description:								     |//
+	//|	============								     |//
+	//|                                                    |//
+	//|   Converts n interleaved RGB vectors to LUV at     |//
+	//|   once, giving the same result as calling the      |//
+	//|   method above on each of them.                    |//
+	//|                                                    |//
+	//<--------------------------------------------------->|//
+	//|                                                    |//
+	//|	Usage:      								     |//
+	//|   ======      								     |//
+	//|		RGBtoLUV(rgbVal, luvVal, n)                  |//
+	//|                                                    |//
+	//<--------------------------------------------------->|//
+	//--\\||//--\\||//--\\||//--\\||//--\\||//--\\||//--\\||//
+
+	void RGBtoLUV(byte*, float*, int);
+
 	//--\\||//--\\||//--\\||//--\\||//--\\||//--\\||//--\\||//
 	//<--------------------------------------------------->|//
 	//|                                                    |//
@@ -653,6 +686,22 @@ private:
 	void NewOptimizedFilter2(float, float);
 
 
+	void ParallelFilter(float, float, SpeedUpLevel);	// any of the three filters above, on all cores,
+	// over independent bands of rows
+	// Advantage	: scales with the number of cores; same result
+	//				  as NewNonOptimizedFilter with NO_SPEEDUP
+	// Disadvantage	: with MED/HIGH_SPEEDUP, modes are not shared
+	//				  across bands, so slightly more mean shift work
+	//				  (and results) than the serial filters
+
+	void GridFilter(float, float);	// approximate mean shift on the cells of a
+	// downsampled joint spatial-range grid (GRID_SPEEDUP)
+	// Advantage	: about 5x faster than the exact filter on a
+	//				  single core (cones, sigmaS = sigmaR = 5)
+	// Disadvantage	: region boundaries are only accurate to about
+	//				  a grid cell
+
+
 	/*/\/\/\/\/\/\/\/\/\/\/\*/
 	/* Image Classification */
 	/*\/\/\/\/\/\/\/\/\/\/\/*/
@@ -671,6 +720,9 @@ private:
 	void BuildRAM(void);					// build a region adjacency matrix using the region list
 	// object
 
+	void BuildRAMFromEdges(void);			// used by BuildRAM to link the RAM from a flat array of
+	// region neighbors sorted per region (MS_FLAT_RAM)
+
 	void DestroyRAM(void);				// destroy the region adjacency matrix: de-allocate its memory
 	// initialize it for re-use
 
@@ -773,6 +825,17 @@ private:
 	RAList			*raPool;				// a pool of RAList objects used in the construction of the
 	// RAM
 
+	int				raPoolSize;				// number of RAList objects in raPool
+
+	//////////RAM Edge Array///////////
+	int				*ramOffsets;			// the neighbors of region i are ramEdges[ramOffsets[i]] ..
+	// ramEdges[ramOffsets[i+1]-1]
+
+	int				*ramEdges;				// neighbor labels of all regions grouped by region; kept
+	// between RAM builds and grown when needed
+
+	int				ramEdgeCapacity;		// allocated length of ramEdges
+
 	//##############################################
 	//#######  COMPUTATION OF EDGE STRENGTHS #######
 	//##############################################